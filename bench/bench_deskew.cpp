@@ -0,0 +1,170 @@
+/**
+* This file is part of oblam_deskew.
+*
+* End-to-end benchmark of the deskew core on synthetic scans: PointCloud2 unpacking, IMU extraction and
+* propagation, column poses, point deskewing and the conversion back to the Ouster point type. Reports ns/point
+* per stage, scans/s, the error against the ground truth and the deskew quality metric. No ROS master needed.
+* DeskewOrganized times the engine on the same scan kept organized, with the range and intensity images.
+* With decimate set the IMU samples are decimated before propagating, and the end pose is compared with the
+* full-rate propagation against the reported bound. motion scales the speed and the shaking of the sensor.
+*
+* Usage: bench_deskew [scans] [rings] [cols] [threads] [decimate] [motion]
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+
+#include "utility.h"
+#include "deskew_core.h"
+#include "deskew_quality.h"
+#include "synthetic_scan.h"
+
+using namespace std;
+using namespace Eigen;
+
+struct StageTimer
+{
+    vector<pair<string, double>> total;     // In order of first use [ns]
+
+    template <typename Op>
+    void time(const string &name, Op op)
+    {
+        auto tic = chrono::steady_clock::now();
+        op();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - tic).count();
+
+        for (auto &kv : total)
+            if (kv.first == name) { kv.second += ns; return; }
+        total.push_back(make_pair(name, ns));
+    }
+};
+
+int main(int argc, char **argv)
+{
+    int scans   = argc > 1 ? atoi(argv[1]) : 50;
+    SyntheticConfig config;
+    config.rings = argc > 2 ? atoi(argv[2]) : config.rings;
+    config.cols  = argc > 3 ? atoi(argv[3]) : config.cols;
+    int threads  = argc > 4 ? atoi(argv[4]) : int(MAX_THREADS);
+    ImuDecimationConfig decimation;
+    decimation.enabled = argc > 5 && atoi(argv[5]) != 0;
+    double motion = argc > 6 ? atof(argv[6]) : 1.0;
+    config.speed *= motion; config.sway *= motion; config.roll *= motion; config.pitch *= motion;
+
+    // Same extrinsic as the node's default
+    mytf tf_Bimu_Blidar = Util::defaultExtrinsic();
+
+    SyntheticLidarImu sim(config, tf_Bimu_Blidar);
+    DeskewQualityMetric qualityMetric;
+
+    DeskewEngineConfig engineConfig;
+    engineConfig.organized = true;
+    engineConfig.threads = threads;
+    DeskewEngine engine(engineConfig, tf_Bimu_Blidar);
+    PointCompactVec organized;
+
+    printf("Synthetic scans: %d x %d at %.0f Hz, IMU at %.0f Hz, %d scans, %d threads\n",
+           config.rings, config.cols, config.scanRate, config.imuRate, scans, threads);
+
+    StageTimer timer;
+    ImuTrajectory traj;
+    double sqErr = 0, sqErrSkewed = 0, maxErr = 0, seam = 0, seamSkewed = 0, thickness = 0;
+    size_t pointsTotal = 0;
+    size_t imuIn = 0, imuOut = 0;
+    double rotDev = 0, posDev = 0, rotBound = 0, posBound = 0;
+
+    for (int k = 0; k < scans; k++)
+    {
+        double t0 = 1.0 + k*sim.scanPeriod();
+
+        // Inputs as they arrive at the node, not timed
+        CloudOuster cloudTrue; vector<Vector3f> truthW;
+        sim.scan(t0, cloudTrue, truthW);
+        sensor_msgs::PointCloud2 cloudMsg;
+        pcl::toROSMsg(cloudTrue, cloudMsg);
+        cloudMsg.header.stamp = ros::Time(t0);
+
+        OdomState odom = sim.odom(t0);
+        double tend = t0 + sim.scanPeriod();
+        ImuSeq imuSeq = sim.imuWindow(t0, tend);
+
+        CloudCompact cloud;
+        timer.time("fromROSMsg", [&]{ Util::fromROSMsg(cloudMsg, cloud); });
+
+        timer.time("ExtractImuData", [&]{ traj.extract(imuSeq, t0, tend); });
+
+        ImuTrajectory full;
+        if (decimation.enabled)
+        {
+            full = traj;
+            full.propagate(odom, Vector3d::Zero(), Vector3d::Zero(), config.grav);
+            timer.time("DecimateIMU", [&]{ traj.decimate(decimation); });
+        }
+
+        timer.time("PropagateIMU", [&]{ traj.propagate(odom, Vector3d::Zero(), Vector3d::Zero(), config.grav); });
+
+        if (decimation.enabled)
+        {
+            imuIn += traj.decimation.samplesIn; imuOut += traj.decimation.samplesOut;
+            rotDev = max(rotDev, Eigen::AngleAxisd(full.q.back().inverse()*traj.q.back()).angle());
+            posDev = max(posDev, (full.p.back() - traj.p.back()).norm());
+            rotBound = max(rotBound, traj.decimation.rotBound);
+            posBound = max(posBound, traj.decimation.posBound);
+        }
+
+        vector<Matrix3f> R_W_Lcol; vector<Vector3f> p_W_Lcol;
+        timer.time("ColumnPoses", [&]
+        {
+            ColumnPoses(cloud.col_t, t0, odom.tf(), tf_Bimu_Blidar, traj.ts, traj.q, traj.p, R_W_Lcol, p_W_Lcol);
+        });
+
+        PointCompactVec deskewed(cloud.size());
+        timer.time("DeskewPoints", [&]{ DeskewPoints(cloud.points.data(), deskewed.data(), cloud.size(), R_W_Lcol, p_W_Lcol, threads); });
+
+        organized.resize(cloud.size());
+        timer.time("DeskewOrganized", [&]
+        {
+            engine.deskew(cloud, odom, traj, true, [&](size_t) { return organized.data(); });
+        });
+
+        CloudOuster cloudOut;
+        timer.time("toCloudOuster", [&]{ Util::toCloudOuster(deskewed, cloud, cloudOut); });
+
+        // Accuracy against the truth, and against not deskewing at all (every point at the scan start pose)
+        PointCompactVec skewed;
+        Util::transformCloud(cloud.points, skewed, (odom.tf()*tf_Bimu_Blidar).cast<float>().tfMat());
+        for (size_t i = 0; i < cloud.size(); i++)
+        {
+            const PointCompact &p = deskewed[i], &s = skewed[i];
+            double e = (Vector3f(p.x, p.y, p.z) - truthW[i]).norm();
+            double es = (Vector3f(s.x, s.y, s.z) - truthW[i]).norm();
+            sqErr += e*e; sqErrSkewed += es*es; maxErr = max(maxErr, e);
+        }
+        pointsTotal += cloud.size();
+
+        DeskewQuality q = qualityMetric.compute(deskewed.data(), deskewed.size(), cloud.col_t.size());
+        DeskewQuality qs = qualityMetric.compute(skewed.data(), skewed.size(), cloud.col_t.size());
+        seam += q.seamRms; seamSkewed += qs.seamRms; thickness += q.thickness;
+    }
+
+    double nsTotal = 0;
+    printf("%-16s %10s %10s\n", "Stage", "ns/point", "ms/scan");
+    for (auto &kv : timer.total)
+    {
+        printf("%-16s %10.2f %10.3f\n", kv.first.c_str(), kv.second/pointsTotal, kv.second/scans*1e-6);
+        nsTotal += kv.second;
+    }
+    printf("%-16s %10.2f %10.3f\n", "Total", nsTotal/pointsTotal, nsTotal/scans*1e-6);
+    printf("Throughput: %.1f scans/s, %.2f Mpoints/s\n", scans/(nsTotal*1e-9), pointsTotal/(nsTotal*1e-3));
+    printf("Error vs truth: RMS %.4f m, max %.4f m. Without deskew: RMS %.4f m\n",
+           sqrt(sqErr/pointsTotal), maxErr, sqrt(sqErrSkewed/pointsTotal));
+    printf("Quality: seam %.4f m (%.4f m without deskew), thickness %.4f m\n",
+           seam/scans, seamSkewed/scans, thickness/scans);
+    if (decimation.enabled)
+        printf("Decimation: %lu of %lu IMU samples. Max end pose deviation %.2e rad, %.2e m, bound %.2e rad, %.2e m\n",
+               imuOut, imuIn, rotDev, posDev, rotBound, posBound);
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Micro-benchmark of myTf composition and inversion, closed form against the former round trip through
+* Eigen::Transform<Affine>. Usage: bench_mytf [iterations]
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "mytf.h"
+
+using namespace std;
+using namespace Eigen;
+
+// The previous implementation, for reference
+template <typename T>
+myTf<T> affineCompose(const myTf<T> &a, const myTf<T> &b)
+{
+    return myTf<T>(Transform<T, 3, Affine>(a.transform()*b.transform()));
+}
+
+template <typename T>
+myTf<T> affineInverse(const myTf<T> &a)
+{
+    Transform<T, 3, Affine> inv = a.transform().inverse();
+    return myTf<T>(Quaternion<T>(inv.linear()), Matrix<T, 3, 1>(inv.translation()));
+}
+
+template <typename T>
+vector<myTf<T>> randomPoses(int N, mt19937 &rng)
+{
+    uniform_real_distribution<double> u(-1.0, 1.0);
+    vector<myTf<T>> poses(N);
+    for (auto &tf : poses)
+    {
+        Quaternd q(u(rng), u(rng), u(rng), u(rng));
+        tf = myTf<double>(q.normalized(), Vector3d(10*u(rng), 10*u(rng), 10*u(rng))).template cast<T>();
+    }
+    return poses;
+}
+
+template <typename Op>
+double timeNs(int iters, int N, Op op)
+{
+    auto tic = chrono::steady_clock::now();
+    for (int k = 0; k < iters; k++)
+        for (int i = 0; i < N; i++)
+            op(i);
+    auto toc = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(toc - tic).count()/(double(iters)*N);
+}
+
+template <typename T>
+void run(const char *name, int iters)
+{
+    const int N = 1024;
+    mt19937 rng(42);
+    vector<myTf<T>> A = randomPoses<T>(N, rng), B = randomPoses<T>(N, rng), C(N);
+
+    // Accumulating into a sink keeps the compiler from dropping the work
+    T sink = 0;
+    double composeClosed = timeNs(iters, N, [&](int i) { C[i] = A[i]*B[i];             sink += C[i].pos.x(); });
+    double composeAffine = timeNs(iters, N, [&](int i) { C[i] = affineCompose(A[i], B[i]); sink += C[i].pos.x(); });
+    double inverseClosed = timeNs(iters, N, [&](int i) { C[i] = A[i].inverse();        sink += C[i].pos.x(); });
+    double inverseAffine = timeNs(iters, N, [&](int i) { C[i] = affineInverse(A[i]);   sink += C[i].pos.x(); });
+
+    double errRot = 0, errPos = 0;
+    for (int i = 0; i < N; i++)
+    {
+        myTf<T> c1 = A[i]*B[i], c2 = affineCompose(A[i], B[i]);
+        errRot = max(errRot, double(c1.rot.angularDistance(c2.rot)));
+        errPos = max(errPos, double((c1.pos - c2.pos).norm()));
+
+        myTf<T> i1 = A[i].inverse(), i2 = affineInverse(A[i]);
+        errRot = max(errRot, double(i1.rot.angularDistance(i2.rot)));
+        errPos = max(errPos, double((i1.pos - i2.pos).norm()));
+    }
+
+    printf("%-6s compose: %6.2f ns closed, %6.2f ns affine (x%.1f). inverse: %6.2f ns closed, %6.2f ns affine (x%.1f). "
+           "Max diff: %.2e rad, %.2e m. (%g)\n",
+           name, composeClosed, composeAffine, composeAffine/composeClosed,
+           inverseClosed, inverseAffine, inverseAffine/inverseClosed, errRot, errPos, double(sink)*0);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 2000;
+
+    run<double>("double", iters);
+    run<float>("float", iters);
+
+    return 0;
+}
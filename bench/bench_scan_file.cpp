@@ -0,0 +1,161 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Checks and times the scan file on synthetic scans: write and read back raw and, if built with zlib, deflated,
+* compare every column, look scans up by time, and reopen a copy cut off in its last scan (the writer died) to
+* see the complete scans recovered from the inline headers. Exits non-zero if a check fails.
+*
+* Usage: bench_scan_file [scans] [rings] [cols] [dir], dir is made if missing and defaults to /tmp
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scan_file.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what)
+{
+    printf("  %-48s %s\n", what.c_str(), ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+static double msSince(chrono::steady_clock::time_point tic)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - tic).count();
+}
+
+int main(int argc, char **argv)
+{
+    int scans    = max(argc > 1 ? atoi(argv[1]) : 20, 8);     // The lookups below need 8
+    int rings    = argc > 2 ? atoi(argv[2]) : 128;
+    int cols     = argc > 3 ? atoi(argv[3]) : 1024;
+    string dir   = argc > 4 ? argv[4] : "/tmp";
+    size_t N = size_t(rings)*cols;
+
+    // A cylinder of points with a little noise, so deflate sees something like a real scan
+    CloudCompact attr; attr.resize(N); attr.col_t.resize(cols);
+    for (int c = 0; c < cols; c++)
+        attr.col_t[c] = uint32_t(c*(1e8/cols));
+
+    mt19937 rng(1); normal_distribution<float> noise(0, 0.01f);
+    PointCompactVec points(N);
+    for (size_t i = 0; i < N; i++)
+    {
+        int r = i/cols, c = i%cols;
+        double a = 2*M_PI*c/cols;
+        points[i] = PointCompact{float(10*cos(a)) + noise(rng), float(10*sin(a)) + noise(rng), r*0.05f, uint16_t(c), 0};
+        attr.intensity[i] = (i*7)%255;
+        attr.ring[i] = r;
+    }
+
+    auto stampOf = [](int s) { return 100.0 + 0.1*s; };
+    auto poseOf = [](int s) { return mytf(Quaternd(Eigen::AngleAxisd(0.01*s, Eigen::Vector3d::UnitZ())), Eigen::Vector3d(s, 0, 0)); };
+
+    printf("Scan file: %d scans of %d x %d\n", scans, rings, cols);
+
+    try
+    {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            throw runtime_error("Cannot make " + dir + ": " + strerror(errno));
+
+        for (int level : {0, 1, 6})
+        {
+            if (level > 0 && !scan_file::deflateAvailable())
+            {
+                printf("Deflate level %d: skipped, built without zlib\n", level);
+                continue;
+            }
+
+            string path = dir + "/bench_scan_file_" + to_string(level) + ".oscan";
+
+            auto tic = chrono::steady_clock::now();
+            {
+                ScanFileWriter writer(path, level);
+                for (int s = 0; s < scans; s++)
+                    writer.write(stampOf(s), poseOf(s), points.data(), N, attr, nullptr);
+            }
+            double writeMs = msSince(tic);
+
+            tic = chrono::steady_clock::now();
+            ScanFileReader reader(path);
+            ScanFileReader::Buffer buffer;
+            bool same = reader.size() == size_t(scans);
+            for (size_t k = 0; same && k < reader.size(); k++)
+            {
+                ScanView v = reader.scan(k, buffer);
+                same = v.size == N && v.stamp == stampOf(k) && v.pose.pos == poseOf(k).pos
+                       && v.pose.rot.coeffs() == poseOf(k).rot.coeffs();
+                for (size_t i = 0; same && i < N; i++)
+                    same = v.xyz[3*i] == points[i].x && v.xyz[3*i + 1] == points[i].y && v.xyz[3*i + 2] == points[i].z
+                           && v.intensity[i] == attr.intensity[i] && v.ring[i] == attr.ring[i]
+                           && v.t[i] == attr.col_t[points[i].col];
+            }
+            double readMs = msSince(tic);
+
+            FILE *f = fopen(path.c_str(), "rb"); fseek(f, 0, SEEK_END); long bytes = ftell(f); fclose(f);
+            printf("Deflate level %d: %.1f MB, write %.2f ms/scan, read %.2f ms/scan\n",
+                   level, bytes/1e6, writeMs/scans, readMs/scans);
+
+            check(reader.indexed(), "index written on close");
+            check(same, "round trip of every column, stamp and pose");
+
+            // Time lookups, stamps in [tstart, tend)
+            size_t first, last;
+            reader.range(stampOf(3) - 0.05, stampOf(7), first, last);
+            check(first == 3 && last == 7, "range around scans 3 to 6");
+            reader.range(stampOf(scans - 1) + 1.0, stampOf(scans - 1) + 2.0, first, last);
+            check(first == last, "range past the last scan is empty");
+            check(reader.lowerBound(stampOf(0) - 1.0) == 0 && reader.lowerBound(stampOf(scans)) == size_t(scans),
+                  "lowerBound at both ends");
+
+            // Cut off in the middle of the last scan, as if the writer died: no index, the complete scans are kept
+            string cut = dir + "/bench_scan_file_" + to_string(level) + "_cut.oscan";
+            const scan_file::ScanHeader &lastHeader = reader.header(scans - 1);
+            off_t cutBytes = lastHeader.offset[scan_file::INTENSITY] + lastHeader.bytes[scan_file::INTENSITY]/2;
+            {
+                FILE *in = fopen(path.c_str(), "rb"), *out = fopen(cut.c_str(), "wb");
+                vector<char> copy(cutBytes);
+                bool copied = fread(copy.data(), 1, cutBytes, in) == size_t(cutBytes)
+                              && fwrite(copy.data(), 1, cutBytes, out) == size_t(cutBytes);
+                fclose(in); fclose(out);
+                check(copied, "truncated copy written");
+            }
+
+            ScanFileReader recovered(cut);
+            bool intact = recovered.size() == size_t(scans - 1);
+            for (size_t k = 0; intact && k < recovered.size(); k++)
+            {
+                ScanView v = recovered.scan(k, buffer);
+                intact = v.size == N && v.stamp == stampOf(k) && v.xyz[3*(N - 1)] == points[N - 1].x;
+            }
+            check(!recovered.indexed(), "truncated file has no index");
+            check(intact, "complete scans recovered from the inline headers");
+
+            unlink(path.c_str());
+            unlink(cut.c_str());
+        }
+    }
+    catch (const std::exception &e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+
+    printf("%s\n", failures ? "FAILED" : "All checks passed");
+    return failures ? 1 : 0;
+}
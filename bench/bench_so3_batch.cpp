@@ -0,0 +1,118 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Accuracy and speed of the so3_batch kernels against the scalar Eigen equivalents (AngleAxis for exp and log,
+* Quaternion::slerp). Exits with 1 if any kernel is off by more than a few ulp. Usage: bench_so3_batch [N] [iterations]
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+#include "so3_batch.h"
+
+using namespace std;
+using namespace Eigen;
+using namespace so3_batch;
+
+template <typename Op>
+double timeNs(int iters, int N, Op op)
+{
+    auto tic = chrono::steady_clock::now();
+    for (int k = 0; k < iters; k++)
+        op();
+    auto toc = chrono::steady_clock::now();
+    return chrono::duration<double, nano>(toc - tic).count()/(double(iters)*N);
+}
+
+template <typename T>
+bool run(const char *name, int N, int iters, double tol)
+{
+    typedef Matrix<T, 3, 1> Vec3;
+    typedef Quaternion<T> Quat;
+
+    mt19937 rng(7);
+    uniform_real_distribution<double> u(-1.0, 1.0);
+
+    // Rotation vectors up to pi (large) and up to 0.01 rad (IMU increments), with some exact zeros
+    Vec3Array<T> r; r.resize(N);
+    QuatArray<T> q0, q1; q0.resize(N); q1.resize(N);
+    vector<T> s(N);
+    for (int i = 0; i < N; i++)
+    {
+        // Inside the unit ball, so |r| < pi and log has a unique answer
+        Vector3d v;
+        do { v = Vector3d(u(rng), u(rng), u(rng)); } while (v.norm() >= 0.999);
+        double scale = (i % 3 == 0) ? M_PI : (i % 3 == 1 ? 0.01 : 0.0);
+        r.set(i, (v*scale).cast<T>());
+
+        q0.set(i, Quaterniond(u(rng), u(rng), u(rng), u(rng)).normalized().cast<T>());
+        q1.set(i, Quaterniond(u(rng), u(rng), u(rng), u(rng)).normalized().cast<T>());
+        s[i] = T(0.5 + 0.5*u(rng));
+    }
+
+    QuatArray<T> qe, qs; Vec3Array<T> rl;
+    vector<Quat> qeRef(N), qsRef(N); vector<Vec3> rlRef(N);
+
+    double tExp = timeNs(iters, N, [&]() { so3_batch::exp(r, qe); });
+    double tExpRef = timeNs(iters, N, [&]()
+    {
+        for (int i = 0; i < N; i++)
+        {
+            Vec3 v = r.get(i); T a = v.norm();
+            qeRef[i] = a > T(0) ? Quat(AngleAxis<T>(a, v/a)) : Quat::Identity();
+        }
+    });
+
+    double tLog = timeNs(iters, N, [&]() { so3_batch::log(qe, rl); });
+    double tLogRef = timeNs(iters, N, [&]()
+    {
+        for (int i = 0; i < N; i++)
+        {
+            Quat q = qe.get(i);
+            if (q.w() < 0)
+                q.coeffs() *= -1;
+            AngleAxis<T> aa(q);
+            rlRef[i] = aa.angle()*aa.axis();
+        }
+    });
+
+    double tSlerp = timeNs(iters, N, [&]() { slerp(q0, q1, s, qs); });
+    double tSlerpRef = timeNs(iters, N, [&]()
+    {
+        for (int i = 0; i < N; i++)
+            qsRef[i] = q0.get(i).slerp(s[i], q1.get(i));
+    });
+
+    // Quaternions are compared up to sign, rotation vectors against the input, which log should give back
+    double errExp = 0, errLog = 0, errSlerp = 0;
+    for (int i = 0; i < N; i++)
+    {
+        Quat a = qe.get(i), b = qeRef[i];
+        errExp = max(errExp, double(min((a.coeffs() - b.coeffs()).norm(), (a.coeffs() + b.coeffs()).norm())));
+        errLog = max(errLog, double((rl.get(i) - r.get(i)).norm()));
+        a = qs.get(i); b = qsRef[i];
+        errSlerp = max(errSlerp, double(min((a.coeffs() - b.coeffs()).norm(), (a.coeffs() + b.coeffs()).norm())));
+    }
+
+    printf("%-6s exp:   %6.2f ns batch, %6.2f ns Eigen (x%4.1f), max err %.2e\n", name, tExp, tExpRef, tExpRef/tExp, errExp);
+    printf("%-6s log:   %6.2f ns batch, %6.2f ns Eigen (x%4.1f), max err %.2e\n", name, tLog, tLogRef, tLogRef/tLog, errLog);
+    printf("%-6s slerp: %6.2f ns batch, %6.2f ns Eigen (x%4.1f), max err %.2e\n", name, tSlerp, tSlerpRef, tSlerpRef/tSlerp, errSlerp);
+
+    bool ok = errExp < tol && errLog < tol && errSlerp < tol;
+    if (!ok)
+        printf("%-6s FAILED, tolerance %.1e\n", name, tol);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int N = argc > 1 ? atoi(argv[1]) : 4096;
+    int iters = argc > 2 ? atoi(argv[2]) : 500;
+
+    bool ok = run<double>("double", N, iters, 1e-12);
+    ok = run<float>("float", N, iters, 1e-5) && ok;
+
+    return ok ? 0 : 1;
+}
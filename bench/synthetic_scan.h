@@ -0,0 +1,159 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Synthetic Ouster-shaped scans and IMU / odometry streams from a known trajectory, for benchmarking the deskew
+* core without a bag or a ROS master. The sensor moves on a circle inside a box-shaped room while rolling,
+* pitching and yawing; every quantity is closed form so the ground truth is exact.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_SYNTHETIC_SCAN_H_
+#define _OBLAM_SYNTHETIC_SCAN_H_
+
+#include <cmath>
+#include <deque>
+#include <vector>
+
+#include "utility.h"
+#include "deskew_core.h"
+
+struct SyntheticConfig
+{
+    int    rings     = 64;
+    int    cols      = 1024;
+    double scanRate  = 10.0;                // [Hz]
+    double imuRate   = 400.0;               // [Hz]
+    double vFov      = 45.0*M_PI/180.0;
+
+    double radius    = 5.0;                 // Circle driven by the sensor [m]
+    double speed     = 3.0;                 // [m/s]
+    double sway      = 0.3;                 // Height oscillation [m]
+    double roll      = 0.15;                // Roll and pitch oscillation amplitudes [rad]
+    double pitch     = 0.10;
+    double shakeFreq = 2.0;                 // [Hz]
+
+    Eigen::Vector3d roomMin = Eigen::Vector3d(-20, -15, -3);
+    Eigen::Vector3d roomMax = Eigen::Vector3d( 25,  18,  6);
+
+    Eigen::Vector3d grav = Eigen::Vector3d(0, 0, 9.81);
+    Eigen::Vector3d bg   = Eigen::Vector3d::Zero();
+    Eigen::Vector3d ba   = Eigen::Vector3d::Zero();
+};
+
+class SyntheticLidarImu
+{
+public:
+
+    SyntheticLidarImu(const SyntheticConfig &config, const mytf &tf_Bimu_Blidar)
+        : config(config), tf_Bimu_Blidar(tf_Bimu_Blidar) {}
+
+    double scanPeriod() const { return 1.0/config.scanRate; }
+
+    // Body pose, world velocity and acceleration, body angular velocity
+    void truth(double t, mytf &tf_W_B, Eigen::Vector3d &vel, Eigen::Vector3d &acc, Eigen::Vector3d &omega) const
+    {
+        double W = config.speed/config.radius, w = 2*M_PI*config.shakeFreq;
+
+        tf_W_B.pos = Eigen::Vector3d(config.radius*cos(W*t), config.radius*sin(W*t), config.sway*sin(w*t));
+        vel = Eigen::Vector3d(-config.radius*W*sin(W*t), config.radius*W*cos(W*t), config.sway*w*cos(w*t));
+        acc = Eigen::Vector3d(-config.radius*W*W*cos(W*t), -config.radius*W*W*sin(W*t), -config.sway*w*w*sin(w*t));
+
+        // ZYX Euler angles, yaw following the circle
+        double phi = config.roll*sin(w*t),         dphi = config.roll*w*cos(w*t);
+        double tht = config.pitch*sin(0.7*w*t),    dtht = config.pitch*0.7*w*cos(0.7*w*t);
+        double psi = W*t + M_PI/2,                 dpsi = W;
+
+        tf_W_B.rot = Eigen::AngleAxisd(psi, Eigen::Vector3d::UnitZ())
+                   * Eigen::AngleAxisd(tht, Eigen::Vector3d::UnitY())
+                   * Eigen::AngleAxisd(phi, Eigen::Vector3d::UnitX());
+
+        omega = Eigen::Vector3d(dphi - dpsi*sin(tht),
+                                dtht*cos(phi) + dpsi*cos(tht)*sin(phi),
+                               -dtht*sin(phi) + dpsi*cos(tht)*cos(phi));
+    }
+
+    ImuSample imu(double t) const
+    {
+        mytf tf_W_B; Eigen::Vector3d vel, acc, omega;
+        truth(t, tf_W_B, vel, acc, omega);
+
+        Eigen::Vector3d gyro = omega + config.bg;
+        Eigen::Vector3d acce = tf_W_B.rot.conjugate()*(acc + config.grav) + config.ba;
+        return ImuSample{t, gyro, acce};
+    }
+
+    OdomState odom(double t) const
+    {
+        mytf tf_W_B; Eigen::Vector3d vel, acc, omega;
+        truth(t, tf_W_B, vel, acc, omega);
+        return OdomState{t, tf_W_B.rot, tf_W_B.pos, vel};
+    }
+
+    // IMU samples on the imuRate grid, from the last one at or before tstart to the first one at or after tend
+    ImuSeq imuWindow(double tstart, double tend) const
+    {
+        ImuSeq seq;
+        long kstart = long(std::floor(tstart*config.imuRate)), kend = long(std::ceil(tend*config.imuRate));
+        for (long k = kstart; k <= kend; k++)
+            seq.push_back(imu(k/config.imuRate));
+        return seq;
+    }
+
+    // Organized scan starting at t0, points in the lidar frame at their firing time, and where they truly are
+    // in the world. Column c fires at t0 + c/(cols*scanRate).
+    void scan(double t0, CloudOuster &cloud, std::vector<Eigen::Vector3f> &truthW) const
+    {
+        int R = config.rings, C = config.cols;
+        cloud.clear();
+        cloud.resize(R*C);
+        cloud.height = R; cloud.width = C; cloud.is_dense = true;
+        truthW.resize(R*C);
+
+        for (int c = 0; c < C; c++)
+        {
+            double dt = double(c)/(C*config.scanRate);
+
+            mytf tf_W_B; Eigen::Vector3d vel, acc, omega;
+            truth(t0 + dt, tf_W_B, vel, acc, omega);
+            mytf tf_W_L = tf_W_B*tf_Bimu_Blidar;
+            Eigen::Matrix3d R_W_L = tf_W_L.rot.toRotationMatrix();
+
+            double az = 2*M_PI*c/C;
+            for (int r = 0; r < R; r++)
+            {
+                double el = -config.vFov/2 + config.vFov*r/(R - 1);
+                Eigen::Vector3d dirL(cos(el)*cos(az), cos(el)*sin(az), sin(el));
+                Eigen::Vector3d dirW = R_W_L*dirL;
+
+                // Distance to the wall of the room hit first
+                double range = std::numeric_limits<double>::max();
+                for (int k = 0; k < 3; k++)
+                {
+                    if (dirW(k) > 1e-9)
+                        range = std::min(range, (config.roomMax(k) - tf_W_L.pos(k))/dirW(k));
+                    else if (dirW(k) < -1e-9)
+                        range = std::min(range, (config.roomMin(k) - tf_W_L.pos(k))/dirW(k));
+                }
+
+                Eigen::Vector3d pL = range*dirL;
+                PointOuster &p = cloud.points[r*C + c];
+                p.x = pL.x(); p.y = pL.y(); p.z = pL.z();
+                p.intensity = 100 + 10*r;
+                p.t = uint32_t(dt*1e9);
+                p.reflectivity = 0;
+                p.ring = r;
+                p.range = uint32_t(range*1000);
+
+                truthW[r*C + c] = (tf_W_L.pos + range*dirW).cast<float>();
+            }
+        }
+    }
+
+private:
+
+    SyntheticConfig config;
+    mytf tf_Bimu_Blidar;
+};
+
+#endif
@@ -0,0 +1,27 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Heap allocations made by the calling thread, for the per-scan instrumentation. The counting is done by
+* src/alloc_counter.cpp, which wraps malloc and friends and is linked into the executables when
+* OBLAM_COUNT_ALLOCATIONS is on. Where it is not linked in (e.g. the nodelet in a stock nodelet manager),
+* available() is false and nothing is counted.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_ALLOC_COUNTER_H_
+#define _OBLAM_ALLOC_COUNTER_H_
+
+#include <cstdint>
+
+extern "C" uint64_t oblamThreadAllocations() __attribute__((weak));
+
+namespace AllocCounter
+{
+    inline bool available() { return oblamThreadAllocations != nullptr; }
+
+    // malloc, calloc, realloc and aligned allocations so far on this thread, operator new included
+    inline uint64_t thread() { return available() ? oblamThreadAllocations() : 0; }
+}
+
+#endif
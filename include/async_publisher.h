@@ -0,0 +1,94 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Runs publishing jobs (point type materialization, toROSMsg, publish) on a dedicated thread so that
+* serialization of large clouds never sits on the processing thread.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_ASYNC_PUBLISHER_H_
+#define _OBLAM_ASYNC_PUBLISHER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+class AsyncPublisher
+{
+public:
+
+    typedef std::function<void()> Job;
+
+    // At most maxPending jobs are queued, beyond that the oldest one is dropped. Publishing is best effort,
+    // a slow subscriber should not make the deskew stage fall behind.
+    explicit AsyncPublisher(size_t maxPending = 4) : maxPending(maxPending)
+    {
+        worker = std::thread(&AsyncPublisher::run, this);
+    }
+
+    ~AsyncPublisher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    AsyncPublisher(const AsyncPublisher &) = delete;
+    AsyncPublisher &operator=(const AsyncPublisher &) = delete;
+
+    void post(Job job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (jobs.size() >= maxPending)
+            {
+                jobs.pop_front();
+                droppedCount++;
+            }
+            jobs.push_back(std::move(job));
+        }
+        cv.notify_one();
+    }
+
+    size_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return droppedCount;
+    }
+
+private:
+
+    void run()
+    {
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this]{ return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    size_t maxPending;
+    size_t droppedCount = 0;
+    bool stopping = false;
+
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    std::thread worker;
+};
+
+#endif
@@ -0,0 +1,562 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Capture of the inputs of the node as they arrived: each IMU sample, odometry and cloud with the time its
+* callback ran, so the replay tool can feed them to the pipeline in the same order and with the same gaps.
+*
+* File layout, little endian:
+*
+*   uint64 magic, uint32 version, uint32 reserved
+*   records: [ RecordHeader | payload ]
+*
+*   IMU:       double t, gyro[3], acce[3]
+*   ODOM:      double t, q[4] (w x y z), p[3], v[3] (world frame)
+*   CLOUD:     double stamp, uint32 height, width, points, columns,
+*              PointCompact[points], uint32 col_t[columns], float intensity[points], uint32 range[points]
+*   EXTRINSIC: double q[4] (w x y z), p[3], the lidar-to-IMU transform the node used from then on
+*   CONFIG:    text, one "param value" line per pipeline setting, named like the node params. The first record.
+*   DROPPED:   uint64 imu, odom, clouds, the records dropped so far because the writer fell behind, written
+*              before the next record after a drop and on close
+*
+* Clouds are stored in the compact format, 24 bytes per point (PointCompact, intensity, range) and 4 per column,
+* against 48 per point for the Ouster point type.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_CAPTURE_FILE_H_
+#define _OBLAM_CAPTURE_FILE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "deskew_pipeline.h"
+
+namespace capture
+{
+
+static const uint64_t kMagic   = 0x50414d414c424f31ull;    // "1OBLAMAP"
+static const uint32_t kVersion = 2;             // Version 1 had no CONFIG record, it is still read
+
+enum RecordType : uint8_t { IMU = 1, ODOM = 2, CLOUD = 3, EXTRINSIC = 4, CONFIG = 5, DROPPED = 6 };
+
+struct RecordHeader
+{
+    uint8_t  type;
+    uint8_t  reserved[3];
+    uint32_t bytes;                 // Payload size
+    int64_t  arrivalNs;             // Since the capture was opened
+};
+static_assert(sizeof(RecordHeader) == 16, "RecordHeader is expected to be 16 bytes");
+
+// The settings of the pipeline that change what it does with the inputs, by the name of the node param. The
+// threads and buffer sizes are left to the machine that runs it.
+template <typename Config, typename Visit>
+void visitConfig(Config &c, Visit visit)
+{
+    visit("organized_output", c.engine.organized);
+    visit("crop_box", c.engine.filter.crop);
+    visit("crop_negative", c.engine.filter.cropNegative);
+    visit("crop_min", c.engine.filter.cropMin);
+    visit("crop_max", c.engine.filter.cropMax);
+    visit("downsample", c.engine.filter.downsample);
+    visit("leaf_size", c.engine.filter.leafSize);
+    visit("bias_estimation", c.biasEstimation);
+    visit("bias_forgetting", c.bias.forgetting);
+    visit("gravity_norm", c.bias.gravityNorm);
+    visit("bias_init_gyro_std", c.bias.initGyroStd);
+    visit("bias_init_acc_std", c.bias.initAccStd);
+    visit("imu_decimation", c.decimation.enabled);
+    visit("decimation_gyro_threshold", c.decimation.gyroThreshold);
+    visit("decimation_acc_threshold", c.decimation.accThreshold);
+    visit("decimation_max_step", c.decimation.maxStep);
+    visit("bidirectional_propagation", c.anchorBoth);
+    visit("min_imu_samples", c.minImuSamples);
+}
+
+template <typename T>
+inline void toText(std::ostream &os, const T &value) { os << value; }
+
+inline void toText(std::ostream &os, const Eigen::Vector3f &v) { os << v.x() << "," << v.y() << "," << v.z(); }
+
+inline void toText(std::ostream &os, const FusedFilterConfig::Downsample &d)
+{
+    os << (d == FusedFilterConfig::VOXEL ? "voxel" : d == FusedFilterConfig::UNIFORM ? "uniform" : "none");
+}
+
+template <typename T>
+inline bool fromText(const std::string &text, T &value)
+{
+    std::istringstream is(text);
+    T parsed;
+    if (!(is >> parsed) || !(is >> std::ws).eof())
+        return false;
+    value = parsed;
+    return true;
+}
+
+inline bool fromText(const std::string &text, bool &value)
+{
+    if (text != "0" && text != "1" && text != "true" && text != "false")
+        return false;
+    value = text == "1" || text == "true";
+    return true;
+}
+
+inline bool fromText(const std::string &text, Eigen::Vector3f &v)
+{
+    std::istringstream is(text);
+    float x, y, z; char c1, c2;
+    if (!(is >> x >> c1 >> y >> c2 >> z) || c1 != ',' || c2 != ',')
+        return false;
+    v << x, y, z;
+    return true;
+}
+
+inline bool fromText(const std::string &text, FusedFilterConfig::Downsample &d)
+{
+    if (text == "none")         d = FusedFilterConfig::NONE;
+    else if (text == "voxel")   d = FusedFilterConfig::VOXEL;
+    else if (text == "uniform") d = FusedFilterConfig::UNIFORM;
+    else return false;
+    return true;
+}
+
+inline std::string configText(const DeskewPipelineConfig &config)
+{
+    std::ostringstream os;
+    os.precision(17);
+    visitConfig(config, [&os](const char *name, const auto &value) { os << name << " "; toText(os, value); os << "\n"; });
+    return os.str();
+}
+
+// Sets the setting named like the node param, false if there is no such setting or the value does not parse
+inline bool setConfig(DeskewPipelineConfig &config, const std::string &name, const std::string &value)
+{
+    bool ok = false;
+    visitConfig(config, [&](const char *key, auto &field) { if (name == key) ok = fromText(value, field); });
+    return ok;
+}
+
+// The settings of a CONFIG record, settings this build does not know are left out
+inline void parseConfig(const std::string &text, DeskewPipelineConfig &config)
+{
+    std::istringstream is(text);
+    std::string line;
+    while (std::getline(is, line))
+    {
+        size_t space = line.find(' ');
+        if (space != std::string::npos)
+            setConfig(config, line.substr(0, space), line.substr(space + 1));
+    }
+}
+
+} // namespace capture
+
+// Records are stamped with their arrival time when handed over and written, in that order, by a thread of the
+// writer's own, so a callback only pays for a copy of a few doubles. A cloud is handed over as a function that
+// unpacks it, which the writer thread calls into a buffer it reuses, so the callback does not unpack it either.
+// What is queued is bounded by maxQueuedBytes (the clouds by the size of the message they hold on to): if the
+// disk falls behind, IMU, odometry and cloud records are dropped and counted rather than held in memory.
+class CaptureWriter
+{
+public:
+
+    typedef std::function<void(CloudCompact &)> Unpack;
+
+    CaptureWriter(const std::string &path, size_t maxQueuedBytes = size_t(256) << 20)
+        : path(path), start(std::chrono::steady_clock::now()), maxQueuedBytes(maxQueuedBytes)
+    {
+        file = fopen(path.c_str(), "wb");
+        if (!file)
+            throw std::runtime_error("CaptureWriter: cannot open " + path + ": " + strerror(errno));
+
+        uint32_t version[2] = {capture::kVersion, 0};
+        fwrite(&capture::kMagic, sizeof(uint64_t), 1, file);
+        fwrite(version, sizeof(uint32_t), 2, file);
+
+        writer = std::thread(&CaptureWriter::writeLoop, this);
+    }
+
+    // Writes what is still queued
+    ~CaptureWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        queued.notify_one();
+        writer.join();
+        writeDropped(make(capture::DROPPED).arrivalNs);
+        fclose(file);
+    }
+
+    CaptureWriter(const CaptureWriter &) = delete;
+    CaptureWriter &operator=(const CaptureWriter &) = delete;
+
+    uint64_t records() const { std::lock_guard<std::mutex> lock(mtx); return count; }
+
+    // Records dropped so far because the queue was full
+    uint64_t dropped() const
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return droppedCount[0] + droppedCount[1] + droppedCount[2];
+    }
+
+    // These return false if the record was dropped
+    bool imu(const ImuSample &s)
+    {
+        Pending rec = make(capture::IMU);
+        rec.set({s.t, s.gyro.x(), s.gyro.y(), s.gyro.z(), s.acce.x(), s.acce.y(), s.acce.z()});
+        return enqueue(std::move(rec));
+    }
+
+    bool odom(const OdomState &o)
+    {
+        Pending rec = make(capture::ODOM);
+        rec.set({o.t, o.q.w(), o.q.x(), o.q.y(), o.q.z(), o.p.x(), o.p.y(), o.p.z(), o.v.x(), o.v.y(), o.v.z()});
+        return enqueue(std::move(rec));
+    }
+
+    // The settings the pipeline runs with, before the first input
+    void config(const DeskewPipelineConfig &config)
+    {
+        Pending rec = make(capture::CONFIG);
+        rec.text = capture::configText(config);
+        enqueue(std::move(rec));
+    }
+
+    void extrinsic(const mytf &tf)
+    {
+        Pending rec = make(capture::EXTRINSIC);
+        rec.set({tf.rot.w(), tf.rot.x(), tf.rot.y(), tf.rot.z(), tf.pos.x(), tf.pos.y(), tf.pos.z()});
+        enqueue(std::move(rec));
+    }
+
+    // unpack runs on the writer thread, whatever it refers to must be kept alive by it. bytes is what that holds.
+    bool cloud(double stamp, size_t bytes, Unpack unpack)
+    {
+        Pending rec = make(capture::CLOUD);
+        rec.set({stamp});
+        rec.unpack = std::move(unpack);
+        rec.bytes += bytes;
+        return enqueue(std::move(rec));
+    }
+
+private:
+
+    struct Pending
+    {
+        capture::RecordType type;
+        int64_t arrivalNs;
+        double payload[11];             // The cloud stamp for a cloud
+        size_t doubles;
+        Unpack unpack;
+        std::string text;               // CONFIG
+        size_t bytes = sizeof(Pending); // Held while queued
+
+        void set(std::initializer_list<double> values)
+        {
+            std::copy(values.begin(), values.end(), payload);
+            doubles = values.size();
+        }
+    };
+
+    Pending make(capture::RecordType type) const
+    {
+        Pending rec;
+        rec.type = type;
+        rec.arrivalNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        return rec;
+    }
+
+    // The settings and the extrinsic are always queued, the inputs only while there is room
+    bool enqueue(Pending &&rec)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            bool input = rec.type == capture::IMU || rec.type == capture::ODOM || rec.type == capture::CLOUD;
+            if (input && queuedBytes + rec.bytes > maxQueuedBytes)
+            {
+                droppedCount[rec.type - capture::IMU]++;
+                return false;
+            }
+            queuedBytes += rec.bytes;
+            queue.push_back(std::move(rec));
+        }
+        queued.notify_one();
+        return true;
+    }
+
+    void writeLoop()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (;;)
+        {
+            queued.wait(lock, [this]{ return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            Pending rec = std::move(queue.front());
+            queue.pop_front();
+            queuedBytes -= rec.bytes;
+            lock.unlock();
+
+            writeDropped(rec.arrivalNs);
+
+            if (rec.type == capture::CLOUD)
+            {
+                rec.unpack(scratch);
+                writeCloud(rec.arrivalNs, rec.payload[0], scratch);
+            }
+            else if (rec.type == capture::CONFIG)
+            {
+                header(rec.type, rec.arrivalNs, rec.text.size());
+                fwrite(rec.text.data(), 1, rec.text.size(), file);
+            }
+            else
+            {
+                header(rec.type, rec.arrivalNs, rec.doubles*sizeof(double));
+                fwrite(rec.payload, sizeof(double), rec.doubles, file);
+            }
+
+            lock.lock();
+            count++;
+        }
+    }
+
+    void writeCloud(int64_t arrivalNs, double stamp, const CloudCompact &c)
+    {
+        uint32_t shape[4] = {c.height, c.width, uint32_t(c.size()), uint32_t(c.col_t.size())};
+        size_t N = c.size(), C = c.col_t.size();
+        size_t bytes = sizeof(double) + sizeof(shape) + N*(sizeof(PointCompact) + sizeof(float) + sizeof(uint32_t))
+                       + C*sizeof(uint32_t);
+
+        header(capture::CLOUD, arrivalNs, bytes);
+        fwrite(&stamp, sizeof(double), 1, file);
+        fwrite(shape, sizeof(shape), 1, file);
+        fwrite(c.points.data(), sizeof(PointCompact), N, file);
+        fwrite(c.col_t.data(), sizeof(uint32_t), C, file);
+        fwrite(c.intensity.data(), sizeof(float), N, file);
+        fwrite(c.range.data(), sizeof(uint32_t), N, file);
+    }
+
+    // The drop counts, if they changed since they were last written. Writer thread or after it stopped.
+    void writeDropped(int64_t arrivalNs)
+    {
+        uint64_t counts[3];
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            std::copy(droppedCount, droppedCount + 3, counts);
+        }
+        if (std::equal(counts, counts + 3, droppedWritten))
+            return;
+
+        header(capture::DROPPED, arrivalNs, sizeof(counts));
+        fwrite(counts, sizeof(uint64_t), 3, file);
+        std::copy(counts, counts + 3, droppedWritten);
+    }
+
+    void header(capture::RecordType type, int64_t arrivalNs, size_t bytes)
+    {
+        capture::RecordHeader h = {};
+        h.type = type;
+        h.bytes = bytes;
+        h.arrivalNs = arrivalNs;
+        fwrite(&h, sizeof(h), 1, file);
+    }
+
+    std::string path;
+    FILE *file = nullptr;
+    std::chrono::steady_clock::time_point start;
+
+    mutable std::mutex mtx;
+    std::condition_variable queued;
+    std::deque<Pending> queue;
+    bool stopping = false;
+    uint64_t count = 0;
+
+    size_t maxQueuedBytes;
+    size_t queuedBytes = 0;
+    uint64_t droppedCount[3] = {};      // IMU, ODOM, CLOUD
+    uint64_t droppedWritten[3] = {};    // Writer thread only
+
+    std::thread writer;
+    CloudCompact scratch;           // Only touched by the writer thread
+};
+
+struct CaptureRecord
+{
+    capture::RecordType type;
+    int64_t arrivalNs;
+
+    ImuSample imu;                  // IMU
+    OdomState odom;                 // ODOM
+    double cloudStamp;              // CLOUD
+    CloudCompactPtr cloud;
+    mytf extrinsic;                 // EXTRINSIC
+    std::string config;             // CONFIG
+    uint64_t dropped[3];            // DROPPED, imu, odom, clouds so far
+};
+
+class CaptureReader
+{
+public:
+
+    CaptureReader(const std::string &path) : path(path)
+    {
+        file = fopen(path.c_str(), "rb");
+        if (!file)
+            throw std::runtime_error("CaptureReader: cannot open " + path + ": " + strerror(errno));
+
+        uint64_t magic = 0; uint32_t version[2] = {0, 0};
+        if (fread(&magic, sizeof(uint64_t), 1, file) != 1 || fread(version, sizeof(uint32_t), 2, file) != 2
+            || magic != capture::kMagic || version[0] < 1 || version[0] > capture::kVersion)
+        {
+            fclose(file);
+            throw std::runtime_error("CaptureReader: " + path + " is not a capture file of version "
+                                     + std::to_string(capture::kVersion));
+        }
+
+        // The pipeline settings come first, if the capture has them
+        long start = ftell(file);
+        CaptureRecord first;
+        try
+        {
+            hasConfig = next(first) && first.type == capture::CONFIG;
+        }
+        catch (...)
+        {
+            fclose(file);
+            throw;
+        }
+        if (hasConfig)
+            configText = first.config;
+        else
+            fseek(file, start, SEEK_SET);
+    }
+
+    ~CaptureReader()
+    {
+        fclose(file);
+    }
+
+    CaptureReader(const CaptureReader &) = delete;
+    CaptureReader &operator=(const CaptureReader &) = delete;
+
+    // The pipeline settings of the node, false for captures without them (version 1)
+    bool config(DeskewPipelineConfig &config) const
+    {
+        if (hasConfig)
+            capture::parseConfig(configText, config);
+        return hasConfig;
+    }
+
+    // Next record, false at the end of the file. Throws on a truncated or corrupt record.
+    bool next(CaptureRecord &record)
+    {
+        capture::RecordHeader h;
+        if (fread(&h, sizeof(h), 1, file) != 1)
+            return false;
+
+        record.type = capture::RecordType(h.type);
+        record.arrivalNs = h.arrivalNs;
+
+        switch (h.type)
+        {
+            case capture::IMU:
+            {
+                double d[7];
+                read(d, sizeof(d), h.bytes == sizeof(d));
+                record.imu = ImuSample{d[0], Eigen::Vector3d(d[1], d[2], d[3]), Eigen::Vector3d(d[4], d[5], d[6])};
+                return true;
+            }
+            case capture::ODOM:
+            {
+                double d[11];
+                read(d, sizeof(d), h.bytes == sizeof(d));
+                record.odom = OdomState{d[0], Quaternd(d[1], d[2], d[3], d[4]), Eigen::Vector3d(d[5], d[6], d[7]),
+                                        Eigen::Vector3d(d[8], d[9], d[10])};
+                return true;
+            }
+            case capture::EXTRINSIC:
+            {
+                double d[7];
+                read(d, sizeof(d), h.bytes == sizeof(d));
+                record.extrinsic = mytf(Quaternd(d[0], d[1], d[2], d[3]), Eigen::Vector3d(d[4], d[5], d[6]));
+                return true;
+            }
+            case capture::DROPPED:
+            {
+                read(record.dropped, sizeof(record.dropped), h.bytes == sizeof(record.dropped));
+                return true;
+            }
+            case capture::CONFIG:
+            {
+                record.config.resize(h.bytes);
+                read(&record.config[0], h.bytes, true);
+                return true;
+            }
+            case capture::CLOUD:
+            {
+                uint32_t shape[4];
+                read(&record.cloudStamp, sizeof(double), h.bytes >= sizeof(double) + sizeof(shape));
+                read(shape, sizeof(shape), true);
+
+                size_t N = shape[2], C = shape[3];
+                size_t bytes = sizeof(double) + sizeof(shape) + N*(sizeof(PointCompact) + sizeof(float) + sizeof(uint32_t))
+                               + C*sizeof(uint32_t);
+
+                if (h.bytes != bytes)
+                    throw std::runtime_error("CaptureReader: corrupt record in " + path);
+
+                record.cloud = std::make_shared<CloudCompact>();
+                CloudCompact &c = *record.cloud;
+                c.height = shape[0]; c.width = shape[1];
+                c.resize(N); c.col_t.resize(C);
+                read(c.points.data(), N*sizeof(PointCompact), true);
+                read(c.col_t.data(), C*sizeof(uint32_t), true);
+                read(c.intensity.data(), N*sizeof(float), true);
+                read(c.range.data(), N*sizeof(uint32_t), true);
+
+                // Not captured, and left uninitialized by resize()
+                std::fill(c.t.begin(), c.t.end(), 0);
+                std::fill(c.reflectivity.begin(), c.reflectivity.end(), 0);
+                std::fill(c.ring.begin(), c.ring.end(), 0);
+                return true;
+            }
+            default:
+                throw std::runtime_error("CaptureReader: unknown record type " + std::to_string(h.type) + " in " + path);
+        }
+    }
+
+private:
+
+    void read(void *dst, size_t bytes, bool sizeOk)
+    {
+        if (!sizeOk)
+            throw std::runtime_error("CaptureReader: corrupt record in " + path);
+        if (bytes > 0 && fread(dst, bytes, 1, file) != 1)
+            throw std::runtime_error("CaptureReader: " + path + " is truncated");
+    }
+
+    std::string path;
+    FILE *file = nullptr;
+
+    bool hasConfig = false;
+    std::string configText;
+};
+
+#endif
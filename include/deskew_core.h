@@ -0,0 +1,247 @@
+/**
+* This file is part of oblam_deskew.
+*
+* The deskew pipeline without ROS: an IMU sample store, the propagation of the body pose through the IMU samples
+* of a scan (kept in an ImuTrajectory, whose buffers are reused from scan to scan) and the deskew engine that
+* turns the trajectory into per-column lidar poses and moves the points. The nodelet (src/oblam_deskew.cpp) is a
+* thin adapter that converts the messages and publishes the results, other pipelines and the benchmarks link
+* the oblam_deskew_core library directly. The stages chain as:
+*
+*   ImuStore::window -> ExtractImuData -> PropagateIMU -> ColumnPoses -> DeskewPoints
+*
+* The stages take a std::pmr memory resource for their temporaries, the pipeline passes its scan arena.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_DESKEW_CORE_H_
+#define _OBLAM_DESKEW_CORE_H_
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "mytf.h"
+#include "point_compact.h"
+#include "fused_filter.h"
+#include "range_image.h"
+#include "scan_arena.h"
+
+/* #region  Inputs ------------------------------------------------------------------------------------------------*/
+
+struct ImuSample
+{
+    double t;                       // [s]
+    Eigen::Vector3d gyro;           // [rad/s]
+    Eigen::Vector3d acce;           // [m/s^2]
+};
+
+// The IMU samples around a scan
+typedef std::pmr::vector<ImuSample> ImuSeq;
+
+// Body pose and world-frame velocity from the odometry
+struct OdomState
+{
+    double t;                       // [s]
+    Quaternd q;
+    Eigen::Vector3d p;
+    Eigen::Vector3d v;
+
+    mytf tf() const { return mytf(q, p); }
+};
+
+// The odometry at t between a and b: slerp of the rotation, cubic Hermite through the positions and velocities of
+// both ends for the position and the velocity. Clamped to [a.t, b.t].
+OdomState InterpolateOdom(const OdomState &a, const OdomState &b, double t);
+
+// IMU samples in time order, written by the IMU callback and read by the processing thread. The order is checked
+// once as the samples come in, so the windows are found by binary search and need no check per scan.
+class ImuStore
+{
+public:
+
+    // False if the sample is not after the last one, it is dropped then
+    bool push(const ImuSample &sample);
+
+    // Samples dropped by push
+    uint64_t dropped() const;
+
+    bool empty() const;
+    size_t size() const;
+    double frontTime() const;
+    double backTime() const;
+
+    // Drop the samples before t, keeping the last one at or before it for interpolation
+    void prune(double t);
+
+    // From the last sample at or before tstart (or the first one) up to and including the first one after tend,
+    // O(log n) to find plus the samples copied
+    ImuSeq window(double tstart, double tend, std::pmr::memory_resource *mr = std::pmr::get_default_resource()) const;
+
+private:
+
+    // Index of the last sample at or before t, 0 if there is none
+    size_t before(double t) const;
+
+    mutable std::mutex mtx;
+    std::deque<ImuSample> buf;
+    uint64_t droppedCount = 0;
+};
+
+/* #endregion  Inputs ---------------------------------------------------------------------------------------------*/
+
+/* #region  Stages ------------------------------------------------------------------------------------------------*/
+
+// IMU samples of imuSeq within [tstart, tend], interpolated at both ends
+void ExtractImuData(std::vector<double> &ts, std::vector<Eigen::Vector3d> &gyro, std::vector<Eigen::Vector3d> &acce,
+                    double tstart, double tend, const ImuSeq &imuSeq);
+
+// Body poses at the IMU sample times ts, starting from the odometry. bg, ba and grav are the gyro bias, accel bias
+// and the accelerometer reading at rest in world frame.
+void PropagateIMU(const OdomState &odom,
+                  const std::vector<double> &ts, const std::vector<Eigen::Vector3d> &gyro_,
+                  const std::vector<Eigen::Vector3d> &acce_,
+                  const Eigen::Vector3d &bg, const Eigen::Vector3d &ba, const Eigen::Vector3d &grav,
+                  std::vector<Quaternd> &q, std::vector<Eigen::Vector3d> &p, std::vector<Eigen::Vector3d> &v,
+                  std::pmr::memory_resource *scratch = std::pmr::get_default_resource());
+
+// Lidar pose in world at each column, col_t being the column times after tstart [ns]. Interpolated from the
+// propagated body poses and composed with the extrinsic, columns outside of ts get the start pose.
+void ColumnPoses(const std::vector<uint32_t> &col_t, double tstart, const mytf &tf_W_Bstart, const mytf &tf_Bimu_Blidar,
+                 const std::vector<double> &ts, const std::vector<Quaternd> &q_W_Bs,
+                 const std::vector<Eigen::Vector3d> &p_W_Bs,
+                 std::vector<Eigen::Matrix3f> &R_W_Lcol, std::vector<Eigen::Vector3f> &p_W_Lcol,
+                 std::pmr::memory_resource *scratch = std::pmr::get_default_resource());
+
+// Transform each point by the pose of its column, N points from in to out
+void DeskewPoints(const PointCompact *in, PointCompact *out, size_t N,
+                  const std::vector<Eigen::Matrix3f> &R_W_Lcol, const std::vector<Eigen::Vector3f> &p_W_Lcol, int threads);
+
+/* #endregion  Stages ---------------------------------------------------------------------------------------------*/
+
+/* #region  Trajectory and engine ---------------------------------------------------------------------------------*/
+
+// Merging of consecutive IMU samples into one integration step while the platform moves smoothly. A step grows
+// while the gyro and accel stay within the thresholds of its first sample and it is shorter than maxStep, and
+// integrates the time-weighted mean rates, so the rotation and velocity increments are kept to first order.
+struct ImuDecimationConfig
+{
+    bool   enabled       = false;
+    double gyroThreshold = 0.02;    // [rad/s]
+    double accThreshold  = 0.2;     // [m/s^2]
+    double maxStep       = 0.02;    // [s]
+};
+
+// Samples before and after decimation, and a first-order bound on how far the decimated propagation can end
+// from the full-rate one: the rotation from the non-commuting rates inside a step, the position from the accel
+// spread, the orientation held over a step and the rotation error tilting the accel of the later steps.
+struct ImuDecimation
+{
+    size_t samplesIn = 0, samplesOut = 0;
+    double rotBound = 0;            // [rad]
+    double posBound = 0;            // [m]
+};
+
+// The IMU samples of one scan and the body poses propagated through them
+struct ImuTrajectory
+{
+    std::vector<double> ts;
+    std::vector<Eigen::Vector3d> gyro, acce;
+
+    std::vector<Quaternd> q;
+    std::vector<Eigen::Vector3d> p, v;
+
+    ImuDecimation decimation;
+
+    // Correction pulled in by anchor(), at the later odometry [rad], [m]
+    double anchorRot = 0, anchorPos = 0;
+
+    size_t size() const { return ts.size(); }
+
+    // Samples of imuSeq within [tstart, tend], the propagated poses are cleared
+    void extract(const ImuSeq &imuSeq, double tstart, double tend);
+
+    // Merge samples into longer steps where the motion allows it, the first and last samples are kept
+    void decimate(const ImuDecimationConfig &config);
+
+    // Poses at ts from the odometry at the start of the window
+    void propagate(const OdomState &odom, const Eigen::Vector3d &bg, const Eigen::Vector3d &ba, const Eigen::Vector3d &grav,
+                   std::pmr::memory_resource *scratch = std::pmr::get_default_resource());
+
+    // Pull the propagated poses onto a later odometry within ts. The error at end.t is taken out by a correction
+    // growing linearly from zero at the start and held after end.t, which to first order blends the propagation
+    // forward from the start with the one backward from end. False, and nothing changed, if end.t is outside.
+    bool anchor(const OdomState &end);
+};
+
+struct DeskewEngineConfig
+{
+    bool organized = false;         // Keep the rings x columns layout of organized scans, NaN for missing returns
+    FusedFilterConfig filter;       // Crop box and downsampling of unorganized scans
+    int threads = 1;
+
+    // The output points rotate through a few buffers between the deskewing and whoever holds the results (the
+    // publisher thread), each reused once released. With reservePoints set they are sized for that many points
+    // and faulted in up front, otherwise they grow on first use.
+    int outputBuffers = 2;
+    size_t reservePoints = 0;
+};
+
+struct DeskewResult
+{
+    const PointCompact *data = nullptr;                 // The deskewed points, in points or in the acquired buffer
+    size_t size = 0;
+    bool inBuffer = false;                              // Written to the buffer handed out by acquire
+
+    std::shared_ptr<PointCompactVec> points;            // Null if inBuffer. Recycled once released.
+    std::shared_ptr<std::vector<uint32_t>> srcIdx;      // Input index of each output point, if filtered
+    std::shared_ptr<DeskewedRangeImage> rangeImage;     // Organized scans only, if asked for
+
+    bool organized = false;
+};
+
+// Deskews scans given the propagated trajectory. Not thread-safe, the column poses are kept between calls, and
+// the output buffers of the result are taken back for a later scan once the caller has released them.
+class DeskewEngine
+{
+public:
+
+    // Returns a buffer for N output points, or nullptr to have the engine allocate one
+    typedef std::function<PointCompact *(size_t N)> Acquire;
+
+    DeskewEngine(const DeskewEngineConfig &config = DeskewEngineConfig(), const mytf &tf_Bimu_Blidar = mytf());
+
+    const DeskewEngineConfig &getConfig() const { return config; }
+
+    const mytf &extrinsic() const { return tf_Bimu_Blidar; }
+    void setExtrinsic(const mytf &tf) { tf_Bimu_Blidar = tf; }
+
+    // Points of cloud to world, the scan starting at odom.t, the stamp the column times count from (see
+    // DeskewPipeline::process). traj must cover the scan. If wantImage the range and intensity images (relative
+    // to the lidar at scan start) are filled for organized scans.
+    DeskewResult deskew(const CloudCompact &cloud, const OdomState &odom, const ImuTrajectory &traj,
+                        bool wantImage = false, const Acquire &acquire = nullptr,
+                        std::pmr::memory_resource *scratch = std::pmr::get_default_resource());
+
+private:
+
+    DeskewEngineConfig config;
+    FusedFilter filter;
+    mytf tf_Bimu_Blidar;
+
+    std::vector<Eigen::Matrix3f> R_W_Lcol;
+    std::vector<Eigen::Vector3f> p_W_Lcol;
+
+    RecyclePool<PointCompactVec> pointsPool;
+    RecyclePool<std::vector<uint32_t>> srcIdxPool;
+    RecyclePool<DeskewedRangeImage> imagePool;
+};
+
+/* #endregion  Trajectory and engine ------------------------------------------------------------------------------*/
+
+#endif
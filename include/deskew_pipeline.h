@@ -0,0 +1,108 @@
+/**
+* This file is part of oblam_deskew.
+*
+* What the node does with each odometry/cloud pair, without ROS: cut the IMU window of the scan out of the store,
+* update the bias estimate from the previous odometry, propagate and deskew. The nodelet and the replay tool
+* both drive it, so a replayed capture goes through the same steps as live data. The temporaries of a scan are
+* on an arena that is reset at the start of the next one, the buffers that are kept are reused.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_DESKEW_PIPELINE_H_
+#define _OBLAM_DESKEW_PIPELINE_H_
+
+#include <deque>
+
+#include "deskew_core.h"
+#include "imu_bias_estimator.h"
+#include "scan_arena.h"
+
+struct DeskewPipelineConfig
+{
+    DeskewEngineConfig engine;
+    ImuBiasEstimatorConfig bias;
+    ImuDecimationConfig decimation;
+    bool biasEstimation = true;
+    bool anchorBoth = false;        // Correct the propagation onto the odometry after the cloud stamp too
+    size_t minImuSamples = 8;       // Scans with fewer IMU samples are not deskewed
+    size_t arenaBytes = 1 << 20;    // Initial size of the scan arena, it grows to the peak use
+};
+
+class DeskewPipeline
+{
+public:
+
+    enum Status { OK, EMPTY_CLOUD, ODOM_STAMP, IMU_WINDOW, SHORT_IMU };
+
+    static const char *statusName(Status status)
+    {
+        switch (status)
+        {
+            case OK:          return "ok";
+            case EMPTY_CLOUD: return "empty cloud";
+            case ODOM_STAMP:  return "odometry not at the cloud stamp";
+            case IMU_WINDOW:  return "outside of IMU buffer";
+            case SHORT_IMU:   return "short IMU sequence";
+        }
+        return "unknown";
+    }
+
+    DeskewPipeline(const DeskewPipelineConfig &config = DeskewPipelineConfig(), const mytf &tf_Bimu_Blidar = mytf())
+        : config(config), arena(config.arenaBytes), imuSeq(&arena), imuBiasEstimator(config.bias),
+          deskewEngine(config.engine, tf_Bimu_Blidar) {}
+
+    const DeskewPipelineConfig &getConfig() const { return config; }
+
+    ImuStore &imu() { return imuStore; }
+    const ImuStore &imu() const { return imuStore; }
+    DeskewEngine &engine() { return deskewEngine; }
+    const ImuBiasEstimator &biasEstimator() const { return imuBiasEstimator; }
+    const ScanArena &scanArena() const { return arena; }
+
+    // The IMU samples and the trajectory of the last scan that got that far
+    const ImuSeq &window() const { return imuSeq; }
+    const ImuTrajectory &trajectory() const { return imuTraj; }
+
+    // The odometry at the cloud stamp of the last scan that was not empty, where its propagation started
+    const OdomState &startOdom() const { return odomStart; }
+
+    // Deskew cloud, paired with the odometries right before and after cloudStamp, the stamp its column times count
+    // from. The propagation starts from the pose interpolated at cloudStamp, and is anchored to odomNext too if
+    // anchorBoth is set and it is within the IMU buffer. ODOM_STAMP if cloudStamp is not between the two.
+    Status process(const OdomState &odom, const OdomState &odomNext, double cloudStamp, const CloudCompact &cloud,
+                   DeskewResult &result, bool wantImage = false, const DeskewEngine::Acquire &acquire = nullptr)
+    {
+        return run(InterpolateOdom(odom, odomNext, cloudStamp), &odomNext, cloudStamp, cloud, result, wantImage,
+                   acquire);
+    }
+
+    // The same from the odometry at cloudStamp itself, ODOM_STAMP if odom.t is another time
+    Status process(const OdomState &odom, double cloudStamp, const CloudCompact &cloud, DeskewResult &result,
+                   bool wantImage = false, const DeskewEngine::Acquire &acquire = nullptr)
+    {
+        return run(odom, nullptr, cloudStamp, cloud, result, wantImage, acquire);
+    }
+
+private:
+
+    Status run(const OdomState &odom, const OdomState *odomNext, double cloudStamp, const CloudCompact &cloud,
+               DeskewResult &result, bool wantImage, const DeskewEngine::Acquire &acquire);
+
+    DeskewPipelineConfig config;
+
+    ImuStore imuStore;
+    ScanArena arena;
+    ImuSeq imuSeq;
+    ImuTrajectory imuTraj;
+    ImuTrajectory prevTraj;         // Samples since the previous odometry, for the bias estimator
+
+    ImuBiasEstimator imuBiasEstimator;
+    OdomState odomStart;
+    OdomState prevOdom;
+    bool hasPrevOdom = false;
+
+    DeskewEngine deskewEngine;
+};
+
+#endif
@@ -0,0 +1,191 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Quality of a deskewed scan, computed from the deskewed points alone so it can be tracked per scan online and
+* compared across versions offline. Two numbers, both lower is better:
+*
+*   seam:      a spinning lidar sees the same surfaces at the start and the end of a sweep. Points of the last
+*              columns are checked against planes fitted to nearby points of the first columns, residual motion
+*              shows up as a gap at this seam.
+*   thickness: the points are hashed into voxels, for voxels that look planar the spread along the normal is
+*              the thickness of the surface, smeared by motion when deskewing is off.
+*
+* Both use voxel hashes and small 3x3 eigen decompositions, one pass over the cloud. The hashes are kept across
+* scans, so a metric that has seen a scan computes the next one without allocating.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_DESKEW_QUALITY_H_
+#define _OBLAM_DESKEW_QUALITY_H_
+
+#include <cmath>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "fused_filter.h"
+#include "point_compact.h"
+#include "voxel_table.h"
+
+struct DeskewQualityConfig
+{
+    float seamRadius      = 1.0;    // Neighbourhood of a seam point [m]
+    int   seamColumns     = 0;      // Columns on each side of the seam, 0 for 1/64 of the scan
+    float voxelSize       = 1.0;    // Voxels for the plane thickness [m]
+    int   minVoxelPoints  = 10;
+    float planarity       = 0.05;   // A voxel is planar if its smallest eigenvalue is below this times the middle one
+};
+
+struct DeskewQuality
+{
+    double seamRms = 0;             // RMS point-to-plane distance across the seam [m]
+    int    seamPoints = 0;
+    double thickness = 0;           // Mean plane thickness (std. dev. along the normal) [m]
+    int    planes = 0;
+};
+
+class DeskewQualityMetric
+{
+public:
+
+    DeskewQualityMetric(const DeskewQualityConfig &config = DeskewQualityConfig()) : config(config) {}
+
+    // pts are the deskewed points, col their column index out of colsTotal in firing order. Non-finite points
+    // (missing returns of organized scans) are skipped.
+    DeskewQuality compute(const PointCompact *pts, size_t N, int colsTotal)
+    {
+        DeskewQuality q;
+        seam(pts, N, colsTotal, q);
+        thickness(pts, N, q);
+        return q;
+    }
+
+private:
+
+    struct Moments
+    {
+        int n = 0;
+        Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+        Eigen::Matrix3d sumSq = Eigen::Matrix3d::Zero();
+
+        void add(const Eigen::Vector3d &p) { n++; sum += p; sumSq += p*p.transpose(); }
+
+        // Eigenvalues ascending, the first eigenvector is the normal of a plane
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solve(Eigen::Vector3d &mean) const
+        {
+            mean = sum/n;
+            return Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>(sumSq/n - mean*mean.transpose());
+        }
+    };
+
+    static bool finite(const PointCompact &p) { return std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z); }
+
+    static Eigen::Vector3d vec(const PointCompact &p) { return Eigen::Vector3d(p.x, p.y, p.z); }
+
+    uint64_t key(const PointCompact &p, float invLeaf, int dx = 0, int dy = 0, int dz = 0) const
+    {
+        return FusedFilter::voxelKey(int64_t(std::floor(p.x*invLeaf)) + dx, int64_t(std::floor(p.y*invLeaf)) + dy,
+                                     int64_t(std::floor(p.z*invLeaf)) + dz);
+    }
+
+    void seam(const PointCompact *pts, size_t N, int colsTotal, DeskewQuality &q)
+    {
+        int band = config.seamColumns > 0 ? config.seamColumns : std::max(1, colsTotal/64);
+        if (2*band > colsTotal)
+            return;
+
+        // Points of the first columns, hashed at the neighbourhood size so the 27 voxels around cover it. Each
+        // voxel holds the last of its points, chained to the others through headNext.
+        float invLeaf = 1.0f/config.seamRadius;
+        head.clear();
+        headNext.resize(N);
+        for (size_t i = 0; i < N; i++)
+            if (pts[i].col < band && finite(pts[i]))
+            {
+                bool inserted;
+                int32_t &last = head.insert(key(pts[i], invLeaf), -1, inserted);
+                headNext[i] = last;
+                last = i;
+            }
+
+        if (head.empty())
+            return;
+
+        double r2 = config.seamRadius*config.seamRadius, sumSq = 0;
+        for (size_t i = 0; i < N; i++)
+        {
+            const PointCompact &p = pts[i];
+            if (p.col < colsTotal - band || !finite(p))
+                continue;
+
+            Moments m;
+            for (int dx = -1; dx <= 1; dx++)
+            for (int dy = -1; dy <= 1; dy++)
+            for (int dz = -1; dz <= 1; dz++)
+            {
+                const int32_t *last = head.find(key(p, invLeaf, dx, dy, dz));
+                if (!last)
+                    continue;
+                for (int32_t j = *last; j >= 0; j = headNext[j])
+                    if ((vec(pts[j]) - vec(p)).squaredNorm() < r2)
+                        m.add(vec(pts[j]));
+            }
+
+            if (m.n < 5)
+                continue;
+
+            Eigen::Vector3d mean;
+            auto eig = m.solve(mean);
+            if (eig.eigenvalues()(0) > config.planarity*eig.eigenvalues()(1))
+                continue;
+
+            double d = eig.eigenvectors().col(0).dot(vec(p) - mean);
+            sumSq += d*d;
+            q.seamPoints++;
+        }
+
+        if (q.seamPoints > 0)
+            q.seamRms = std::sqrt(sumSq/q.seamPoints);
+    }
+
+    void thickness(const PointCompact *pts, size_t N, DeskewQuality &q)
+    {
+        float invLeaf = 1.0f/config.voxelSize;
+        voxels.clear();
+        voxels.reserve(N/config.minVoxelPoints + 16);
+        bool inserted;
+        for (size_t i = 0; i < N; i++)
+            if (finite(pts[i]))
+                voxels.insert(key(pts[i], invLeaf), Moments(), inserted).add(vec(pts[i]));
+
+        double sum = 0;
+        for (size_t v = 0; v < voxels.size(); v++)
+        {
+            const Moments &m = voxels.value(v);
+            if (m.n < config.minVoxelPoints)
+                continue;
+
+            Eigen::Vector3d mean;
+            auto eig = m.solve(mean);
+            Eigen::Vector3d lambda = eig.eigenvalues().cwiseMax(0.0);
+            if (lambda(0) > config.planarity*lambda(1))
+                continue;
+
+            sum += std::sqrt(lambda(0));
+            q.planes++;
+        }
+
+        if (q.planes > 0)
+            q.thickness = sum/q.planes;
+    }
+
+    DeskewQualityConfig config;
+
+    // Voxel hashes kept across scans
+    VoxelTable<int32_t> head;
+    std::vector<int32_t> headNext;
+    VoxelTable<Moments> voxels;
+};
+
+#endif
@@ -0,0 +1,250 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Crop-box and voxel / uniform downsampling that run inside the deskew pass. Each point is cropped, transformed
+* and binned into a hashed voxel grid by the thread that deskews it, so the full-resolution deskewed cloud is
+* never materialized when only the downsampled one is wanted. The per-thread buffers and voxel tables are kept
+* across scans, so a filter that has seen a scan refills them without allocating.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_FUSED_FILTER_H_
+#define _OBLAM_FUSED_FILTER_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <omp.h>
+#include <Eigen/Dense>
+
+#include "point_compact.h"
+#include "voxel_table.h"
+
+struct FusedFilterConfig
+{
+    enum Downsample { NONE, VOXEL, UNIFORM };
+
+    // Crop box in the lidar frame, with crop_negative the points inside are removed (e.g. the vehicle itself)
+    bool crop = false;
+    bool cropNegative = true;
+    Eigen::Vector3f cropMin = Eigen::Vector3f::Zero();
+    Eigen::Vector3f cropMax = Eigen::Vector3f::Zero();
+
+    // VOXEL keeps the centroid of each voxel like pcl::VoxelGrid, UNIFORM the point nearest to the voxel center
+    // like pcl::UniformSampling
+    Downsample downsample = NONE;
+    float leafSize = 0.2;
+
+    bool enabled() const { return crop || downsample != NONE; }
+};
+
+class FusedFilter
+{
+public:
+
+    FusedFilter(const FusedFilterConfig &config = FusedFilterConfig()) : config(config) {}
+
+    const FusedFilterConfig &getConfig() const { return config; }
+
+    // Hash key of a voxel, 21 bits per axis, +/- 1M voxels
+    static uint64_t voxelKey(int64_t ix, int64_t iy, int64_t iz)
+    {
+        const int64_t offset = 1 << 20, mask = (1 << 21) - 1;
+        return (uint64_t((ix + offset) & mask) << 42) | (uint64_t((iy + offset) & mask) << 21) | uint64_t((iz + offset) & mask);
+    }
+
+    // Crop, transform and downsample the points of cloudIn in one parallel pass. transform maps a PointCompact
+    // to its output position as an Eigen::Vector3f. srcIdx receives the index of the input point each output
+    // point was taken from (for voxel centroids, the first point of the voxel), for looking up attributes.
+    template <typename Transform>
+    void apply(const PointCompactVec &cloudIn, const Transform &transform,
+               PointCompactVec &cloudOut, std::vector<uint32_t> &srcIdx, int threads)
+    {
+        cloudOut.clear(); srcIdx.clear();
+
+        if (config.downsample == FusedFilterConfig::NONE)
+            cropAndTransform(cloudIn, transform, cloudOut, srcIdx, threads);
+        else
+            voxelize(cloudIn, transform, cloudOut, srcIdx, threads);
+    }
+
+private:
+
+    struct Cell
+    {
+        float x, y, z;          // Sum of the points for VOXEL, the kept point for UNIFORM
+        float d2;               // Squared distance of the kept point to the voxel center, UNIFORM only
+        uint32_t count;
+        uint32_t rep;           // Representative input index
+        uint16_t col;
+    };
+
+    typedef VoxelTable<Cell> CellMap;
+
+    bool keep(const PointCompact &p) const
+    {
+        if (!config.crop)
+            return true;
+
+        bool inside = config.cropMin.x() <= p.x && p.x <= config.cropMax.x()
+                   && config.cropMin.y() <= p.y && p.y <= config.cropMax.y()
+                   && config.cropMin.z() <= p.z && p.z <= config.cropMax.z();
+
+        return inside != config.cropNegative;
+    }
+
+    template <typename Transform>
+    void cropAndTransform(const PointCompactVec &cloudIn, const Transform &transform,
+                          PointCompactVec &cloudOut, std::vector<uint32_t> &srcIdx, int threads)
+    {
+        int N = cloudIn.size();
+        if ((int)keptPts.size() < threads)
+        {
+            keptPts.resize(threads);
+            keptIdx.resize(threads);
+        }
+
+        // Static schedule, so concatenating the per-thread results in thread order keeps the input order
+        #pragma omp parallel num_threads(threads)
+        {
+            int tid = omp_get_thread_num();
+            std::vector<PointCompact> &pts = keptPts[tid];
+            std::vector<uint32_t> &idx = keptIdx[tid];
+            pts.clear(); idx.clear();
+
+            #pragma omp for schedule(static)
+            for (int i = 0; i < N; i++)
+            {
+                const PointCompact &pi = cloudIn[i];
+                if (!keep(pi))
+                    continue;
+
+                Eigen::Vector3f pt = transform(pi);
+                pts.push_back(PointCompact{pt.x(), pt.y(), pt.z(), pi.col, pi.pad});
+                idx.push_back(i);
+            }
+        }
+
+        size_t total = 0;
+        for (int k = 0; k < threads; k++)
+            total += keptPts[k].size();
+
+        cloudOut.reserve(total); srcIdx.reserve(total);
+        for (int k = 0; k < threads; k++)
+        {
+            cloudOut.insert(cloudOut.end(), keptPts[k].begin(), keptPts[k].end());
+            srcIdx.insert(srcIdx.end(), keptIdx[k].begin(), keptIdx[k].end());
+        }
+    }
+
+    template <typename Transform>
+    void voxelize(const PointCompactVec &cloudIn, const Transform &transform,
+                  PointCompactVec &cloudOut, std::vector<uint32_t> &srcIdx, int threads)
+    {
+        int N = cloudIn.size();
+        bool uniform = config.downsample == FusedFilterConfig::UNIFORM;
+        float invLeaf = 1.0f/config.leafSize;
+
+        if ((int)cellMaps.size() < threads)
+            cellMaps.resize(threads);
+
+        #pragma omp parallel num_threads(threads)
+        {
+            CellMap &cells = cellMaps[omp_get_thread_num()];
+            cells.clear();
+            cells.reserve(N/(8*threads) + 16);
+
+            #pragma omp for schedule(static)
+            for (int i = 0; i < N; i++)
+            {
+                const PointCompact &pi = cloudIn[i];
+                if (!keep(pi))
+                    continue;
+
+                Eigen::Vector3f pt = transform(pi);
+                if (!pt.allFinite())
+                    continue;
+
+                int64_t ix = std::floor(pt.x()*invLeaf), iy = std::floor(pt.y()*invLeaf), iz = std::floor(pt.z()*invLeaf);
+                bool inserted;
+                Cell &cell = cells.insert(voxelKey(ix, iy, iz),
+                                          Cell{0, 0, 0, std::numeric_limits<float>::max(), 0, (uint32_t)i, pi.col}, inserted);
+
+                if (uniform)
+                {
+                    Eigen::Vector3f center((ix + 0.5f)*config.leafSize, (iy + 0.5f)*config.leafSize, (iz + 0.5f)*config.leafSize);
+                    float d2 = (pt - center).squaredNorm();
+                    if (d2 < cell.d2)
+                    {
+                        cell.x = pt.x(); cell.y = pt.y(); cell.z = pt.z();
+                        cell.d2 = d2; cell.rep = i; cell.col = pi.col;
+                    }
+                }
+                else
+                {
+                    cell.x += pt.x(); cell.y += pt.y(); cell.z += pt.z();
+                }
+                cell.count++;
+            }
+        }
+
+        // Merge into the first map. Ties are broken by the input index so the result does not depend on threads.
+        CellMap &merged = cellMaps[0];
+        for (int k = 1; k < threads; k++)
+        {
+            const CellMap &cells = cellMaps[k];
+            for (size_t v = 0; v < cells.size(); v++)
+            {
+                const Cell &other = cells.value(v);
+                bool inserted;
+                Cell &cell = merged.insert(cells.key(v), other, inserted);
+                if (inserted)
+                    continue;
+
+                if (uniform)
+                {
+                    if (other.d2 < cell.d2 || (other.d2 == cell.d2 && other.rep < cell.rep))
+                        cell = Cell{other.x, other.y, other.z, other.d2, cell.count + other.count, other.rep, other.col};
+                    else
+                        cell.count += other.count;
+                }
+                else
+                {
+                    cell.x += other.x; cell.y += other.y; cell.z += other.z; cell.count += other.count;
+                    if (other.rep < cell.rep)
+                    {
+                        cell.rep = other.rep;
+                        cell.col = other.col;
+                    }
+                }
+            }
+        }
+
+        order.clear();
+        for (size_t v = 0; v < merged.size(); v++)
+            order.push_back(&merged.value(v));
+        std::sort(order.begin(), order.end(), [](const Cell *a, const Cell *b) { return a->rep < b->rep; });
+
+        cloudOut.resize(order.size()); srcIdx.resize(order.size());
+        for (size_t k = 0; k < order.size(); k++)
+        {
+            const Cell &cell = *order[k];
+            float w = uniform ? 1.0f : 1.0f/cell.count;
+            cloudOut[k] = PointCompact{cell.x*w, cell.y*w, cell.z*w, cell.col, 0};
+            srcIdx[k] = cell.rep;
+        }
+    }
+
+    FusedFilterConfig config;
+
+    // Scratch kept across scans
+    std::vector<std::vector<PointCompact>> keptPts;
+    std::vector<std::vector<uint32_t>> keptIdx;
+    std::vector<CellMap> cellMaps;
+    std::vector<const Cell *> order;
+};
+
+#endif
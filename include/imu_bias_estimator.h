@@ -0,0 +1,188 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Online estimate of the gyro bias, accelerometer bias and gravity used by the IMU propagation. Each pair of
+* consecutive odometry messages, with the IMU samples between them, gives one observation:
+*
+*   gyro:  log(q0^-1*q1) = sum(w_i*dt_i) - bg*T
+*   accel: v1 - v0       = sum(R_i*a_i*dt_i) - sum(R_i*dt_i)*ba - g*T
+*
+* with R_i the orientation integrated from q0 and g what the accelerometer reads at rest, in the world frame.
+* Both are accumulated into normal equations with exponential forgetting, the gravity norm is held fixed. The
+* work per observation is a pass over the few IMU samples of the interval and a 6x6 solve.
+*
+* The gravity is first leveled from a window of samples where the sensor is still, low gyro and accel spread.
+* Until such a window comes the level of each window is used, but no observation is taken.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_IMU_BIAS_ESTIMATOR_H_
+#define _OBLAM_IMU_BIAS_ESTIMATOR_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+struct ImuBiasEstimatorConfig
+{
+    double forgetting   = 0.98;     // Weight of the past per observation
+    double gravityNorm  = 9.81;     // [m/s^2]
+    double maxInterval  = 0.5;      // Longer odometry gaps are not used [s]
+    double maxGyroBias  = 0.1;      // Observations beyond these are rejected [rad/s], [m/s^2]
+    double maxAccBias   = 1.0;
+    double accBiasPrior = 1e-3;     // Information of the zero prior on the accel bias, keeps it bounded when unobservable
+    double initGyroStd  = 0.05;     // Largest spread over the leveling window for the sensor to count as still [rad/s]
+    double initAccStd   = 0.3;      // [m/s^2]
+    int    initSamples  = 5;
+};
+
+class ImuBiasEstimator
+{
+public:
+
+    ImuBiasEstimator(const ImuBiasEstimatorConfig &config = ImuBiasEstimatorConfig()) : config(config) {}
+
+    bool initialized() const { return isInitialized; }
+    int updates() const { return updateCount; }
+
+    const Eigen::Vector3d &gyroBias() const { return bg; }
+    const Eigen::Vector3d &accBias() const { return ba; }
+    const Eigen::Vector3d &gravity() const { return grav; }
+
+    // Level from the mean specific force of a window, assuming the biases are small. Returns true, and starts the
+    // estimation, only if the gyro and accel spreads (RMS of the deviations from the mean) show the sensor still.
+    // Otherwise the gravity is leveled from this window for the time being and the next window is tried.
+    bool initialize(const Eigen::Quaterniond &q_W_B, const std::vector<Eigen::Vector3d> &gyro,
+                    const std::vector<Eigen::Vector3d> &acce)
+    {
+        if (isInitialized)
+            return true;
+
+        int N = std::min(gyro.size(), acce.size());
+        if (N == 0)
+            return false;
+
+        Eigen::Vector3d gyroMean = Eigen::Vector3d::Zero(), accMean = Eigen::Vector3d::Zero();
+        for (int i = 0; i < N; i++)
+        {
+            gyroMean += gyro[i];
+            accMean += acce[i];
+        }
+        gyroMean /= N; accMean /= N;
+
+        if (accMean.norm() == 0)
+            return false;
+
+        grav = (q_W_B*accMean).normalized()*config.gravityNorm;
+        bg.setZero(); ba.setZero();
+
+        double gyroVar = 0, accVar = 0;
+        for (int i = 0; i < N; i++)
+        {
+            gyroVar += (gyro[i] - gyroMean).squaredNorm();
+            accVar += (acce[i] - accMean).squaredNorm();
+        }
+        gyroVar /= N; accVar /= N;
+
+        isInitialized = N >= config.initSamples && gyroVar <= config.initGyroStd*config.initGyroStd
+                        && accVar <= config.initAccStd*config.initAccStd;
+        return isInitialized;
+    }
+
+    // One observation from the odometry at t0 and t1 (orientation and world-frame velocity) and the IMU samples
+    // ts, gyro, acce spanning [t0, t1]. Returns false if the observation was not used.
+    bool update(const Eigen::Quaterniond &q0, const Eigen::Vector3d &v0,
+                const Eigen::Quaterniond &q1, const Eigen::Vector3d &v1,
+                const std::vector<double> &ts, const std::vector<Eigen::Vector3d> &gyro,
+                const std::vector<Eigen::Vector3d> &acce)
+    {
+        if (!isInitialized || ts.size() < 2)
+            return false;
+
+        double T = ts.back() - ts.front();
+        if (T <= 0 || T > config.maxInterval)
+            return false;
+
+        // Gyro bias, from the rotation left over after integrating the raw rates
+        Eigen::Vector3d sumW = Eigen::Vector3d::Zero();
+        for (size_t i = 1; i < ts.size(); i++)
+            sumW += gyro[i-1]*(ts[i] - ts[i-1]);
+
+        Eigen::AngleAxisd dR((q0.conjugate()*q1).normalized());
+        Eigen::Vector3d bgObs = (sumW - dR.angle()*dR.axis())/T;
+        if (bgObs.norm() > config.maxGyroBias)
+            return false;
+
+        // Kept aside until the accel part is accepted too, a rejected observation leaves the estimate as it was
+        double gyroInfoNew = config.forgetting*gyroInfo + T;
+        Eigen::Vector3d gyroSumNew = config.forgetting*gyroSum + T*bgObs;
+        Eigen::Vector3d bgNew = gyroSumNew/gyroInfoNew;
+
+        // Accel bias and gravity, with the orientation integrated using the updated gyro bias
+        Eigen::Matrix3d M = Eigen::Matrix3d::Zero();
+        Eigen::Vector3d s = Eigen::Vector3d::Zero();
+        Eigen::Quaterniond R = q0;
+        for (size_t i = 1; i < ts.size(); i++)
+        {
+            double dt = ts[i] - ts[i-1];
+            M += R.toRotationMatrix()*dt;
+            s += R*acce[i-1]*dt;
+
+            Eigen::Vector3d dtheta = (gyro[i-1] - bgNew)*dt;
+            double angle = dtheta.norm();
+            if (angle > 0)
+                R = (R*Eigen::Quaterniond(Eigen::AngleAxisd(angle, dtheta/angle))).normalized();
+        }
+
+        Eigen::Matrix<double, 3, 6> A; A << M, T*Eigen::Matrix3d::Identity();
+        Eigen::Vector3d b = s - (v1 - v0);
+
+        Eigen::Matrix<double, 6, 6> H = config.forgetting*info  + A.transpose()*A;
+        Eigen::Matrix<double, 6, 1> y = config.forgetting*infoVec + A.transpose()*b;
+
+        // Zero prior on the accel bias, the current gravity as a weak prior on the direction
+        Eigen::Matrix<double, 6, 6> P = Eigen::Matrix<double, 6, 6>::Zero();
+        P.topLeftCorner<3, 3>() = config.accBiasPrior*Eigen::Matrix3d::Identity();
+        P.bottomRightCorner<3, 3>() = 1e-3*Eigen::Matrix3d::Identity();
+        Eigen::Matrix<double, 6, 1> x0; x0 << Eigen::Vector3d::Zero(), grav;
+
+        Eigen::Matrix<double, 6, 1> x = (H + P).ldlt().solve(y + P*x0);
+        if (!x.allFinite() || x.tail<3>().norm() == 0)
+            return false;
+
+        // Hold the gravity norm and solve the accel bias again for that gravity
+        Eigen::Vector3d gravNew = x.tail<3>().normalized()*config.gravityNorm;
+        Eigen::Matrix3d Hbb = H.topLeftCorner<3, 3>() + P.topLeftCorner<3, 3>();
+        Eigen::Vector3d baNew = Hbb.ldlt().solve(y.head<3>() - H.topRightCorner<3, 3>()*gravNew);
+        if (!baNew.allFinite() || baNew.norm() > config.maxAccBias)
+            return false;
+
+        gyroInfo = gyroInfoNew; gyroSum = gyroSumNew; bg = bgNew;
+        info = H; infoVec = y;
+        ba = baNew; grav = gravNew;
+        updateCount++;
+        return true;
+    }
+
+private:
+
+    ImuBiasEstimatorConfig config;
+
+    bool isInitialized = false;
+    int updateCount = 0;
+
+    Eigen::Vector3d bg   = Eigen::Vector3d::Zero();
+    Eigen::Vector3d ba   = Eigen::Vector3d::Zero();
+    Eigen::Vector3d grav = Eigen::Vector3d::Zero();
+
+    double gyroInfo = 0;
+    Eigen::Vector3d gyroSum = Eigen::Vector3d::Zero();
+
+    Eigen::Matrix<double, 6, 6> info    = Eigen::Matrix<double, 6, 6>::Zero();
+    Eigen::Matrix<double, 6, 1> infoVec = Eigen::Matrix<double, 6, 1>::Zero();
+};
+
+#endif
@@ -0,0 +1,254 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Where the large buffers (clouds, deskewed points, the scan arena) live in memory:
+*
+*   Huge pages:   allocations of 2 MB and more are mapped on their own, with transparent huge pages requested
+*                 (madvise) or taken from the explicit hugetlb pool (falling back to the former if it is empty).
+*                 Fewer TLB misses on the multi-megabyte clouds. Set once at startup, before the buffers exist.
+*                 Off leaves every allocation to the default allocator, and the system THP setting with it.
+*   First touch:  Linux puts a page on the NUMA node of the thread that first writes it. Buffers sized ahead of
+*                 use are touched by the OpenMP threads that will work on them, with the same static schedule.
+*   Affinity:     bindToNode() keeps the calling thread, and the OpenMP threads it starts later, on the CPUs of
+*                 one NUMA node, so one pipeline per socket works on local memory only.
+*
+* Linux only, no libnuma needed (the topology is read from /sys/devices/system/node).
+*/
+
+#pragma once
+
+#ifndef _OBLAM_MEM_PLACEMENT_H_
+#define _OBLAM_MEM_PLACEMENT_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace mem_placement
+{
+
+enum HugePages { HUGE_OFF, HUGE_TRANSPARENT, HUGE_EXPLICIT };
+
+// With huge pages on, allocations of at least this size are mapped on their own, rounded up to whole huge pages
+static const size_t kLargeBytes = size_t(2) << 20;
+
+struct Stats
+{
+    std::atomic<uint64_t> mappings{0};          // Large allocations mapped so far
+    std::atomic<uint64_t> explicitFallbacks{0}; // HUGE_EXPLICIT mappings that had to use normal pages
+};
+
+// The mapped allocations, so they are unmapped whatever the mode is when they are freed
+struct Mappings
+{
+    std::mutex mtx;
+    std::unordered_set<void *> ptrs;
+};
+
+inline std::atomic<int> &hugePagesMode() { static std::atomic<int> mode{HUGE_OFF}; return mode; }
+inline Stats &stats() { static Stats s; return s; }
+inline Mappings &mappings() { static Mappings m; return m; }
+
+inline void setHugePages(HugePages mode) { hugePagesMode() = mode; }
+inline HugePages hugePages() { return HugePages(hugePagesMode().load()); }
+
+inline const char *hugePagesName(HugePages mode)
+{
+    switch (mode)
+    {
+        case HUGE_OFF:         return "off";
+        case HUGE_TRANSPARENT: return "transparent";
+        case HUGE_EXPLICIT:    return "explicit";
+    }
+    return "unknown";
+}
+
+// "off", "transparent" or "explicit", false if name is none of them
+inline bool parseHugePages(const std::string &name, HugePages &mode)
+{
+    for (HugePages m : {HUGE_OFF, HUGE_TRANSPARENT, HUGE_EXPLICIT})
+        if (name == hugePagesName(m))
+        {
+            mode = m;
+            return true;
+        }
+    return false;
+}
+
+/* #region  Allocation --------------------------------------------------------------------------------------------*/
+
+// Cache line aligned. With huge pages on, large ones are mapped page aligned. Mapped buffers are remembered, so a
+// buffer can be freed after the mode changed.
+inline void *allocate(size_t bytes)
+{
+    HugePages mode = hugePages();
+    if (bytes < kLargeBytes || mode == HUGE_OFF)
+        return ::operator new(bytes, std::align_val_t(64));
+
+    size_t length = (bytes + kLargeBytes - 1) & ~(kLargeBytes - 1);
+
+    void *ptr = MAP_FAILED;
+    if (mode == HUGE_EXPLICIT)
+    {
+        ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr == MAP_FAILED)
+            stats().explicitFallbacks++;
+    }
+
+    if (ptr == MAP_FAILED)
+    {
+        ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            throw std::bad_alloc();
+        madvise(ptr, length, MADV_HUGEPAGE);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mappings().mtx);
+        mappings().ptrs.insert(ptr);
+    }
+    stats().mappings++;
+    return ptr;
+}
+
+inline void deallocate(void *ptr, size_t bytes)
+{
+    if (!ptr)
+        return;
+
+    if (bytes >= kLargeBytes)
+    {
+        std::lock_guard<std::mutex> lock(mappings().mtx);
+        if (mappings().ptrs.erase(ptr))
+        {
+            munmap(ptr, (bytes + kLargeBytes - 1) & ~(kLargeBytes - 1));
+            return;
+        }
+    }
+    ::operator delete(ptr, std::align_val_t(64));
+}
+
+// Write every page of [data, data + N) from the OpenMP threads that will process it, element i from the thread
+// that gets i under a static schedule of N over threads
+template <typename T>
+inline void firstTouch(T *data, size_t N, int threads)
+{
+    static_assert(std::is_trivial<T>::value, "firstTouch writes zeros over the elements");
+
+    #pragma omp parallel for schedule(static) num_threads(threads) if(threads > 1)
+    for (size_t i = 0; i < N; i++)
+        memset(static_cast<void *>(&data[i]), 0, sizeof(T));
+}
+
+/* #endregion  Allocation -----------------------------------------------------------------------------------------*/
+
+/* #region  NUMA topology and affinity ----------------------------------------------------------------------------*/
+
+// CPUs of a list like "0-15,32-47"
+inline std::vector<int> parseCpuList(const std::string &list)
+{
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t end = list.find(',', pos);
+        std::string range = list.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+        int first, last;
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2)
+            for (int c = first; c <= last; c++)
+                cpus.push_back(c);
+        else if (sscanf(range.c_str(), "%d", &first) == 1)
+            cpus.push_back(first);
+        if (end == std::string::npos)
+            break;
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+// CPUs of a NUMA node, empty if there is no such node
+inline std::vector<int> nodeCpus(int node)
+{
+    std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+        return std::vector<int>();
+
+    char buf[4096] = {0};
+    size_t n = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[n] = 0;
+    return parseCpuList(buf);
+}
+
+// Nodes with CPUs, 1 on machines without NUMA information
+inline int nodeCount()
+{
+    int count = 0;
+    while (!nodeCpus(count).empty())
+        count++;
+    return count > 0 ? count : 1;
+}
+
+// Keep the calling thread on the CPUs of node. Threads it creates afterwards (the OpenMP team of its parallel
+// regions included, unless OMP_PROC_BIND says otherwise) inherit that, and their first touches are local.
+inline bool bindToNode(int node)
+{
+    std::vector<int> cpus = nodeCpus(node);
+    if (cpus.empty())
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus)
+        if (c < CPU_SETSIZE)
+            CPU_SET(c, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// bindToNode() for a scope, e.g. to set up buffers for a pipeline on another node from a thread that is not
+// otherwise bound. No-op for node < 0.
+class NodeBinding
+{
+public:
+
+    explicit NodeBinding(int node)
+    {
+        if (node >= 0 && sched_getaffinity(0, sizeof(saved), &saved) == 0)
+            isBound = bindToNode(node);
+    }
+
+    ~NodeBinding()
+    {
+        if (isBound)
+            sched_setaffinity(0, sizeof(saved), &saved);
+    }
+
+    NodeBinding(const NodeBinding &) = delete;
+    NodeBinding &operator=(const NodeBinding &) = delete;
+
+    bool bound() const { return isBound; }
+
+private:
+
+    cpu_set_t saved;
+    bool isBound = false;
+};
+
+/* #endregion  NUMA topology and affinity -------------------------------------------------------------------------*/
+
+} // namespace mem_placement
+
+#endif
@@ -0,0 +1,141 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Rigid transform as a quaternion and a translation. Composition and inversion are done in closed form on the
+* quaternion and translation, so no 4x4 matrix or matrix-to-quaternion conversion is involved. The header does
+* not depend on ROS; any pose message with a pose.pose field (e.g. nav_msgs::Odometry) can be converted.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_MYTF_H_
+#define _OBLAM_MYTF_H_
+
+#include <cmath>
+#include <ostream>
+#include <utility>
+
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+
+// Shortened typedef matching character length of Vector3d and Matrix3d
+typedef Eigen::Quaterniond Quaternd;
+typedef Eigen::Quaternionf Quaternf;
+
+template <typename T = double>
+struct myTf
+{
+    Eigen::Quaternion<T>   rot;
+    Eigen::Matrix<T, 3, 1> pos;
+
+    static myTf Identity()
+    {
+        return myTf();
+    }
+
+    myTf(const myTf<T> &other) = default;
+    myTf &operator=(const myTf<T> &other) = default;
+
+    myTf() : rot(1, 0, 0, 0), pos(0, 0, 0) {}
+
+    myTf(const Eigen::Quaternion<T> &rot_in, const Eigen::Matrix<T, 3, 1> &pos_in) : rot(rot_in), pos(pos_in) {}
+
+    myTf(const Eigen::Matrix<T, 3, 3> &rot_in, const Eigen::Matrix<T, 3, 1> &pos_in) : rot(rot_in), pos(pos_in) {}
+
+    template <typename Tin>
+    myTf(const Eigen::Matrix<Tin, 4, 4> &tfMat)
+    {
+        Eigen::Matrix<T, 3, 3> M = tfMat.block(0, 0, 3, 3).template cast<T>();
+        this->rot = Eigen::Quaternion<T>(M);
+        this->pos = tfMat.block(0, 3, 3, 1).template cast<T>();
+    }
+
+    // From a pose message, e.g. nav_msgs::Odometry or geometry_msgs::PoseWithCovarianceStamped. The quaternion is
+    // normalized, messages are not guaranteed to carry a unit one.
+    template <typename PoseMsg, typename = decltype(std::declval<PoseMsg>().pose.pose.orientation)>
+    myTf(const PoseMsg &msg)
+    {
+        this->rot = Eigen::Quaternion<T>(msg.pose.pose.orientation.w,
+                                         msg.pose.pose.orientation.x,
+                                         msg.pose.pose.orientation.y,
+                                         msg.pose.pose.orientation.z).normalized();
+
+        this->pos << msg.pose.pose.position.x,
+                     msg.pose.pose.position.y,
+                     msg.pose.pose.position.z;
+    }
+
+    myTf(const Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> &transform)
+    {
+        this->rot = Eigen::Quaternion<T>{transform.linear()}.normalized();
+        this->pos = transform.translation();
+    }
+
+    Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> transform() const
+    {
+        Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> transform;
+        transform.linear() = rot.normalized().toRotationMatrix();
+        transform.translation() = pos;
+        return transform;
+    }
+
+    Eigen::Matrix<T, 4, 4> tfMat() const
+    {
+        Eigen::Matrix<T, 4, 4> M = Eigen::Matrix<T, 4, 4>::Identity();
+        M.block(0, 0, 3, 3) = rot.normalized().toRotationMatrix();
+        M.block(0, 3, 3, 1) = pos;
+        return M;
+    }
+
+    // The rotation is assumed to be unit, as it is after any composition or inversion
+    myTf inverse() const
+    {
+        Eigen::Quaternion<T> rot_inv = rot.conjugate();
+        return myTf(rot_inv, -(rot_inv*pos));
+    }
+
+    // (q1, p1)*(q2, p2) = (q1*q2, q1*p2 + p1). The product is renormalized so chains of compositions do not drift.
+    myTf operator*(const myTf &other) const
+    {
+        return myTf((rot*other.rot).normalized(), rot*other.pos + pos);
+    }
+
+    Eigen::Matrix<T, 3, 1> operator*(const Eigen::Matrix<T, 3, 1> &point) const
+    {
+        return rot*point + pos;
+    }
+
+    template <typename NewType>
+    myTf<NewType> cast() const
+    {
+        myTf<NewType> tf_new{this->rot.template cast<NewType>(), this->pos.template cast<NewType>()};
+        return tf_new;
+    }
+
+    double roll() const
+    {
+        return atan2(rot.x()*rot.w() + rot.y()*rot.z(), 0.5 - (rot.x()*rot.x() + rot.y()*rot.y()))/M_PI*180.0;
+    }
+
+    double pitch() const
+    {
+        return asin(-2*(rot.x()*rot.z() - rot.w()*rot.y()))/M_PI*180.0;
+    }
+
+    double yaw() const
+    {
+        return atan2(rot.x()*rot.y() + rot.w()*rot.z(), 0.5 - (rot.y()*rot.y() + rot.z()*rot.z()))/M_PI*180.0;
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const myTf &tf)
+    {
+        os << tf.pos.x() << " " << tf.pos.y() << " " << tf.pos.z() << " " << tf.rot.w() << " "
+           << tf.rot.x() << " " << tf.rot.y() << " " << tf.rot.z();
+        return os;
+    }
+}; // class myTf
+
+typedef myTf<> mytf;
+typedef myTf<float> mytff;
+
+#endif
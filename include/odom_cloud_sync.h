@@ -0,0 +1,166 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Pairs each cloud with the odometries right before and after its stamp, between which DeskewPipeline::process
+* interpolates the pose at the stamp, and holds the pairs until the IMU buffer covers the whole scan. This is the
+* buffering behind the nodelet callbacks, kept free of ROS so that recorded arrival orders can be replayed through
+* the same logic (src/oblam_deskew_replay.cpp). Drops are counted:
+*
+*   skipped:     the first pairs after startup
+*   overwritten: a cloud replaced by the next one before an odometry after it arrived
+*   stale:       a pair whose cloud is older than the oldest IMU sample
+*/
+
+#pragma once
+
+#ifndef _OBLAM_ODOM_CLOUD_SYNC_H_
+#define _OBLAM_ODOM_CLOUD_SYNC_H_
+
+#include <deque>
+#include <mutex>
+
+#include "deskew_core.h"
+
+template <typename OdomPtr, typename CloudPtr>
+class OdomCloudSync
+{
+public:
+
+    enum Status { READY, NO_PAIR, NO_IMU, STALE, IMU_BEHIND };
+
+    struct Counters
+    {
+        uint64_t skipped = 0;
+        uint64_t overwritten = 0;
+        uint64_t stale = 0;
+        uint64_t paired = 0;
+    };
+
+    // skip: pairs dropped at startup. imuMargin: how far past the cloud stamp the IMU must reach [s], a 10 Hz scan
+    // and one interval of a 100 Hz IMU.
+    OdomCloudSync(int skip = 10, double imuMargin = 0.11) : skip(skip), imuMargin(imuMargin) {}
+
+    void pushOdom(double t, const OdomPtr &odom)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        odomBuf.push_back(Stamped<OdomPtr>{t, odom});
+        if (cloudHold.msg)
+            match();
+    }
+
+    // Returns false if the cloud waiting for its odometry had to be thrown away
+    bool pushCloud(double t, const CloudPtr &cloud)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        bool kept = !cloudHold.msg;
+        if (!kept)
+            count.overwritten++;
+        cloudHold = Stamped<CloudPtr>{t, cloud};
+        if (!odomBuf.empty())
+            match();
+        return kept;
+    }
+
+    // READY if the oldest pair can be processed. A pair whose cloud is older than the IMU buffer is dropped and STALE
+    // returned, the propagation starts at the cloud stamp.
+    Status check(const ImuStore &imu)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        if (pairs.empty())
+            return NO_PAIR;
+
+        if (imu.empty())
+            return NO_IMU;
+
+        if (pairs.front().cloud.t < imu.frontTime())
+        {
+            pairs.pop_front();
+            count.stale++;
+            return STALE;
+        }
+
+        if (pairs.front().cloud.t + imuMargin > imu.backTime())
+            return IMU_BEHIND;
+
+        return READY;
+    }
+
+    // The odometries before and after the cloud stamp, and the cloud
+    bool pop(OdomPtr &odom, OdomPtr &odomNext, CloudPtr &cloud)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (pairs.empty())
+            return false;
+        odom = pairs.front().odom.msg;
+        odomNext = pairs.front().odomNext.msg;
+        cloud = pairs.front().cloud.msg;
+        pairs.pop_front();
+        return true;
+    }
+
+    size_t pending() const
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return pairs.size();
+    }
+
+    Counters counters() const
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return count;
+    }
+
+private:
+
+    template <typename Ptr>
+    struct Stamped
+    {
+        double t;
+        Ptr msg;
+    };
+
+    struct Pair
+    {
+        Stamped<OdomPtr> odom, odomNext;
+        Stamped<CloudPtr> cloud;
+    };
+
+    // Find the odometries around the held cloud, remove older ones as we go
+    void match()
+    {
+        double t = cloudHold.t;
+
+        // Prune while odomBuf[1] <= t
+        while (2 <= odomBuf.size() && odomBuf[1].t <= t)
+            odomBuf.pop_front();
+
+        // We have a pair if the first odom is before t and the next odom is beyond t
+        if (2 <= odomBuf.size() && odomBuf[0].t <= t && t <= odomBuf[1].t)
+        {
+            if (skip > 0)
+            {
+                skip--;
+                count.skipped++;
+            }
+            else
+            {
+                pairs.push_back(Pair{odomBuf[0], odomBuf[1], cloudHold});
+                count.paired++;
+            }
+            cloudHold = Stamped<CloudPtr>{0, CloudPtr()};
+        }
+    }
+
+    mutable std::mutex mtx;
+
+    std::deque<Stamped<OdomPtr>> odomBuf;
+    Stamped<CloudPtr> cloudHold{0, CloudPtr()};
+    std::deque<Pair> pairs;
+
+    int skip;
+    double imuMargin;
+    Counters count;
+};
+
+#endif
@@ -0,0 +1,90 @@
+/**
+* This file is part of oblam_deskew.
+*
+* The compact point and scan layouts used internally and in the shared-memory output. Kept free of ROS and PCL so that
+* non-ROS consumers can include it.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_POINT_COMPACT_H_
+#define _OBLAM_POINT_COMPACT_H_
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "mem_placement.h"
+
+// What the deskew kernel actually touches: packed xyz and the column (firing) index the point belongs to.
+// PointOuster is 48 bytes after alignment, this is 16.
+struct PointCompact
+{
+    float x, y, z;
+    uint16_t col;
+    uint16_t pad;
+};
+static_assert(sizeof(PointCompact) == 16, "PointCompact is expected to be 16 bytes");
+
+// std::allocator that default-initializes the elements added by resize(). Point buffers are always overwritten
+// right after they are sized, so they are not zeroed first, and a fresh buffer is faulted in by its writers,
+// on their NUMA nodes. Large buffers get huge pages if mem_placement is set up for them.
+template <typename T>
+struct DefaultInitAllocator : std::allocator<T>
+{
+    template <typename U>
+    struct rebind { typedef DefaultInitAllocator<U> other; };
+
+    DefaultInitAllocator() noexcept {}
+
+    template <typename U>
+    DefaultInitAllocator(const DefaultInitAllocator<U> &) noexcept {}
+
+    T *allocate(size_t n) { return static_cast<T *>(mem_placement::allocate(n*sizeof(T))); }
+    void deallocate(T *p, size_t n) noexcept { mem_placement::deallocate(p, n*sizeof(T)); }
+
+    template <typename U>
+    void construct(U *p) noexcept(std::is_nothrow_default_constructible<U>::value) { ::new(static_cast<void *>(p)) U; }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&... args) { ::new(static_cast<void *>(p)) U(std::forward<Args>(args)...); }
+};
+
+template <typename T>
+using DefaultInitVector = std::vector<T, DefaultInitAllocator<T>>;
+
+typedef DefaultInitVector<PointCompact> PointCompactVec;
+
+// A scan split into the hot xyz+column array and cold per-point attributes. The side arrays are only read
+// when a full PointOuster cloud has to be materialized, i.e. when someone subscribes to the output.
+struct CloudCompact
+{
+    uint32_t height = 0, width = 0;
+
+    PointCompactVec points;             // xyz and column index
+    std::vector<uint32_t> col_t;        // Time offset of each column from the header stamp [ns]
+
+    DefaultInitVector<float>    intensity;  // Side arrays, indexed like points. Not initialized by resize().
+    DefaultInitVector<uint32_t> t;
+    DefaultInitVector<uint16_t> reflectivity;
+    DefaultInitVector<uint8_t>  ring;
+    DefaultInitVector<uint32_t> range;
+
+    size_t size() const { return points.size(); }
+    bool empty() const { return points.empty(); }
+
+    void resize(size_t N)
+    {
+        points.resize(N);
+        intensity.resize(N);
+        t.resize(N);
+        reflectivity.resize(N);
+        ring.resize(N);
+        range.resize(N);
+    }
+};
+typedef std::shared_ptr<CloudCompact> CloudCompactPtr;
+
+#endif
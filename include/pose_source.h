@@ -0,0 +1,138 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Odometry for the pairing from sources that only have poses, without running an EKF to get velocities:
+*
+*   PoseDifferencer: poses as they arrive (PoseStamped, PoseWithCovarianceStamped, TF), each one handed out once
+*                    the next is in, with the central difference of its neighbours as velocity.
+*   PoseFile:        a ground-truth file, TUM (t x y z qx qy qz qw, space separated) or the same columns comma
+*                    separated (CSV). Lines starting with # and header lines are skipped, times in seconds or, if
+*                    too large for that, in nanoseconds.
+*
+* The ROS sources built on them are in pose_source_ros.h.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_POSE_SOURCE_H_
+#define _OBLAM_POSE_SOURCE_H_
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "deskew_core.h"
+
+class PoseDifferencer
+{
+public:
+
+    // True with the odometry of the previous pose once this one is in
+    bool push(double t, const mytf &tf, OdomState &odom)
+    {
+        if (!poses.empty() && t <= poses.back().t)
+            return false;
+
+        poses.push_back(Pose{t, tf});
+        if (poses.size() > 3)
+            poses.pop_front();
+        return poses.size() >= 2 && emit(poses.size() - 2, odom);
+    }
+
+    // The last pose, with the backward difference
+    bool flush(OdomState &odom)
+    {
+        bool ok = poses.size() >= 2 && emit(poses.size() - 1, odom);
+        poses.clear();
+        return ok;
+    }
+
+private:
+
+    struct Pose
+    {
+        double t;
+        mytf tf;
+    };
+
+    bool emit(size_t k, OdomState &odom) const
+    {
+        const Pose &a = poses[k > 0 ? k - 1 : k];
+        const Pose &b = poses[k + 1 < poses.size() ? k + 1 : k];
+        odom = OdomState{poses[k].t, poses[k].tf.rot, poses[k].tf.pos, (b.tf.pos - a.tf.pos)/(b.t - a.t)};
+        return true;
+    }
+
+    std::deque<Pose> poses;
+};
+
+class PoseFile
+{
+public:
+
+    // Throws if the file cannot be read or has fewer than two poses
+    explicit PoseFile(const std::string &path)
+    {
+        FILE *file = fopen(path.c_str(), "r");
+        if (!file)
+            throw std::runtime_error("PoseFile: cannot open " + path + ": " + strerror(errno));
+
+        PoseDifferencer differencer;
+        OdomState odom;
+        char line[1024];
+        while (fgets(line, sizeof(line), file))
+        {
+            if (line[0] == '#')
+                continue;
+            std::replace(line, line + strlen(line), ',', ' ');
+
+            double t, x, y, z, qx, qy, qz, qw;
+            if (sscanf(line, "%lf %lf %lf %lf %lf %lf %lf %lf", &t, &x, &y, &z, &qx, &qy, &qz, &qw) != 8)
+                continue;
+            if (t > 1e12)
+                t *= 1e-9;
+
+            if (differencer.push(t, mytf(Quaternd(qw, qx, qy, qz).normalized(), Eigen::Vector3d(x, y, z)), odom))
+                states.push_back(odom);
+        }
+        fclose(file);
+
+        if (differencer.flush(odom))
+            states.push_back(odom);
+        if (states.size() < 2)
+            throw std::runtime_error("PoseFile: " + path + " has fewer than two poses in increasing time");
+    }
+
+    const std::vector<OdomState> &poses() const { return states; }
+
+    // The poses up to and including time t that were not handed out yet, in order
+    template <typename Sink>
+    void until(double t, Sink sink)
+    {
+        for (; cursor < states.size() && states[cursor].t <= t; cursor++)
+            sink(states[cursor]);
+    }
+
+    bool done() const { return cursor >= states.size(); }
+
+private:
+
+    std::vector<OdomState> states;
+    size_t cursor = 0;
+};
+
+// Whether path looks like a pose file rather than a bag
+inline bool isPoseFile(const std::string &path)
+{
+    for (const char *ext : {".txt", ".csv", ".tum"})
+        if (path.size() >= strlen(ext) && path.compare(path.size() - strlen(ext), strlen(ext), ext) == 0)
+            return true;
+    return false;
+}
+
+#endif
@@ -0,0 +1,264 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Where the nodelet gets the odometry it pairs the clouds with, set by the pose_source param:
+*
+*   odometry:  nav_msgs/Odometry on pose_topic, e.g. /odometry/filtered from the EKF of run_deskew.launch
+*   pose:      geometry_msgs/PoseStamped on pose_topic
+*   pose_cov:  geometry_msgs/PoseWithCovarianceStamped on pose_topic, e.g. the /pose_gt of the Newer College bags
+*   tf:        the world_frame -> body_frame transforms on /tf, published directly between the two
+*   file:      a TUM or CSV ground-truth file, pose_file (see pose_source.h)
+*
+* All but odometry have no velocity, it is differenced from the neighbouring poses, so each pose comes out when
+* the next one is in. The file is read ahead of the clouds rather than by a subscriber. The messages are decoded
+* by PoseDecoder, which oblam_deskew_batch also reads bags with.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_POSE_SOURCE_ROS_H_
+#define _OBLAM_POSE_SOURCE_ROS_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <ros/ros.h>
+#include <nav_msgs/Odometry.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <geometry_msgs/PoseWithCovarianceStamped.h>
+#include <tf2_msgs/TFMessage.h>
+
+#include "utility.h"
+#include "pose_source.h"
+
+// Pose messages to odometry, differencing the velocity of those without. Quaternions are normalized, the
+// messages may carry slightly off-unit ones.
+class PoseDecoder
+{
+public:
+
+    // With the frames, only the worldFrame -> bodyFrame transforms of TF messages are taken
+    PoseDecoder(const std::string &worldFrame = "", const std::string &bodyFrame = "")
+        : worldFrame(worldFrame), bodyFrame(bodyFrame) {}
+
+    static mytf toTf(const geometry_msgs::Pose &p)
+    {
+        return mytf(Quaternd(p.orientation.w, p.orientation.x, p.orientation.y, p.orientation.z).normalized(),
+                    Eigen::Vector3d(p.position.x, p.position.y, p.position.z));
+    }
+
+    static mytf toTf(const geometry_msgs::Transform &tr)
+    {
+        return mytf(Quaternd(tr.rotation.w, tr.rotation.x, tr.rotation.y, tr.rotation.z).normalized(),
+                    Eigen::Vector3d(tr.translation.x, tr.translation.y, tr.translation.z));
+    }
+
+    // Each decode hands the odometry that became available to sink, in time order
+    template <typename Sink>
+    void decode(const nav_msgs::Odometry &msg, Sink &&sink) { sink(Util::toOdomState(msg)); }
+
+    template <typename Sink>
+    void decode(const geometry_msgs::PoseStamped &msg, Sink &&sink)
+    {
+        push(msg.header.stamp.toSec(), toTf(msg.pose), sink);
+    }
+
+    template <typename Sink>
+    void decode(const geometry_msgs::PoseWithCovarianceStamped &msg, Sink &&sink)
+    {
+        push(msg.header.stamp.toSec(), toTf(msg.pose.pose), sink);
+    }
+
+    template <typename Sink>
+    void decode(const tf2_msgs::TFMessage &msg, Sink &&sink)
+    {
+        for (const geometry_msgs::TransformStamped &T : msg.transforms)
+            if (T.header.frame_id == worldFrame && T.child_frame_id == bodyFrame)
+                push(T.header.stamp.toSec(), toTf(T.transform), sink);
+    }
+
+    // The last differenced pose, at the end of the stream
+    bool flush(OdomState &odom) { return differencer.flush(odom); }
+
+private:
+
+    template <typename Sink>
+    void push(double t, const mytf &tf, Sink &sink)
+    {
+        OdomState odom;
+        if (differencer.push(t, tf, odom))
+            sink(odom);
+    }
+
+    std::string worldFrame, bodyFrame;
+    PoseDifferencer differencer;
+};
+
+class PoseSource
+{
+public:
+
+    enum Type { ODOMETRY, POSE, POSE_COV, TF, FILE };
+
+    // Gets the odometry, in time order, on the callback threads
+    typedef std::function<void(const OdomState &)> Sink;
+
+    static const char *typeName(Type type)
+    {
+        switch (type)
+        {
+            case ODOMETRY: return "odometry";
+            case POSE:     return "pose";
+            case POSE_COV: return "pose_cov";
+            case TF:       return "tf";
+            case FILE:     return "file";
+        }
+        return "unknown";
+    }
+
+    static bool parseType(const std::string &name, Type &type)
+    {
+        for (Type t : {ODOMETRY, POSE, POSE_COV, TF, FILE})
+            if (name == typeName(t))
+            {
+                type = t;
+                return true;
+            }
+        return false;
+    }
+
+    // The source of the given type, set up from the pose_topic, world_frame, body_frame and pose_file params.
+    // Throws if the pose file cannot be read.
+    static std::unique_ptr<PoseSource> create(Type type, ros::NodeHandle &nh, ros::NodeHandle &nh_private, Sink sink);
+
+    virtual ~PoseSource() {}
+
+    // A cloud with this stamp arrived. Sources that are not subscribed to hand out the poses it needs.
+    virtual void onCloud(double) {}
+
+    virtual std::string describe() const = 0;
+
+protected:
+
+    explicit PoseSource(Sink sink) : sink(sink) {}
+
+    Sink sink;
+};
+
+class OdometryPoseSource : public PoseSource
+{
+public:
+
+    OdometryPoseSource(ros::NodeHandle &nh, const std::string &topic, Sink sink) : PoseSource(sink), topic(topic)
+    {
+        sub = nh.subscribe(topic, 100, &OdometryPoseSource::callback, this);
+    }
+
+    std::string describe() const override { return "nav_msgs/Odometry on " + topic; }
+
+private:
+
+    void callback(const nav_msgs::Odometry::ConstPtr &msg) { decoder.decode(*msg, sink); }
+
+    std::string topic;
+    ros::Subscriber sub;
+    PoseDecoder decoder;
+};
+
+// PoseStamped or PoseWithCovarianceStamped, PoseMsg
+template <typename PoseMsg>
+class StampedPoseSource : public PoseSource
+{
+public:
+
+    StampedPoseSource(ros::NodeHandle &nh, const std::string &topic, Sink sink) : PoseSource(sink), topic(topic)
+    {
+        sub = nh.subscribe(topic, 100, &StampedPoseSource::callback, this);
+    }
+
+    std::string describe() const override
+    {
+        return std::string(std::is_same<PoseMsg, geometry_msgs::PoseStamped>::value
+                           ? "geometry_msgs/PoseStamped" : "geometry_msgs/PoseWithCovarianceStamped") + " on " + topic;
+    }
+
+private:
+
+    void callback(const typename PoseMsg::ConstPtr &msg) { decoder.decode(*msg, sink); }
+
+    std::string topic;
+    ros::Subscriber sub;
+    PoseDecoder decoder;
+};
+
+class TfPoseSource : public PoseSource
+{
+public:
+
+    TfPoseSource(ros::NodeHandle &nh, const std::string &worldFrame, const std::string &bodyFrame, Sink sink)
+        : PoseSource(sink), worldFrame(worldFrame), bodyFrame(bodyFrame), decoder(worldFrame, bodyFrame)
+    {
+        sub = nh.subscribe("/tf", 1000, &TfPoseSource::callback, this);
+    }
+
+    std::string describe() const override { return "/tf " + worldFrame + " -> " + bodyFrame; }
+
+private:
+
+    void callback(const tf2_msgs::TFMessage::ConstPtr &msg) { decoder.decode(*msg, sink); }
+
+    std::string worldFrame, bodyFrame;
+    ros::Subscriber sub;
+    PoseDecoder decoder;
+};
+
+class FilePoseSource : public PoseSource
+{
+public:
+
+    FilePoseSource(const std::string &path, Sink sink) : PoseSource(sink), path(path), file(path) {}
+
+    // The pairing needs the poses around the cloud, they are handed out a little past its stamp
+    void onCloud(double t) override
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        file.until(t + kLead, sink);
+    }
+
+    std::string describe() const override
+    {
+        return path + " (" + std::to_string(file.poses().size()) + " poses)";
+    }
+
+private:
+
+    static constexpr double kLead = 0.5;    // [s]
+
+    std::string path;
+    mutable std::mutex mtx;
+    PoseFile file;
+};
+
+inline std::unique_ptr<PoseSource> PoseSource::create(Type type, ros::NodeHandle &nh, ros::NodeHandle &nh_private,
+                                                      Sink sink)
+{
+    std::string topic, worldFrame, bodyFrame, poseFile;
+    nh_private.param("pose_topic", topic, std::string(type == ODOMETRY ? "/odometry/filtered" : "/pose_gt"));
+    nh_private.param("world_frame", worldFrame, std::string("world"));
+    nh_private.param("body_frame", bodyFrame, std::string("os1_imu"));
+    nh_private.param("pose_file", poseFile, std::string(""));
+
+    switch (type)
+    {
+        case ODOMETRY: return std::unique_ptr<PoseSource>(new OdometryPoseSource(nh, topic, sink));
+        case POSE:     return std::unique_ptr<PoseSource>(new StampedPoseSource<geometry_msgs::PoseStamped>(nh, topic, sink));
+        case POSE_COV: return std::unique_ptr<PoseSource>(new StampedPoseSource<geometry_msgs::PoseWithCovarianceStamped>(nh, topic, sink));
+        case TF:       return std::unique_ptr<PoseSource>(new TfPoseSource(nh, worldFrame, bodyFrame, sink));
+        case FILE:     return std::unique_ptr<PoseSource>(new FilePoseSource(poseFile, sink));
+    }
+    return nullptr;
+}
+
+#endif
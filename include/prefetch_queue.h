@@ -0,0 +1,95 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Bounded queue between a reading thread and the processing thread. Unlike AsyncPublisher nothing is dropped: the
+* reader blocks once it is capacity items ahead, which bounds the memory of what was read ahead, and the time each
+* side spent blocked tells whether the input or the processing is the bottleneck.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_PREFETCH_QUEUE_H_
+#define _OBLAM_PREFETCH_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+template <typename T>
+class PrefetchQueue
+{
+public:
+
+    explicit PrefetchQueue(size_t capacity = 4) : capacity(capacity) {}
+
+    PrefetchQueue(const PrefetchQueue &) = delete;
+    PrefetchQueue &operator=(const PrefetchQueue &) = delete;
+
+    // Blocks while the queue is full. False if the queue was closed, the item is not taken then.
+    bool push(T &&item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!closed && items.size() >= capacity)
+        {
+            auto tic = std::chrono::steady_clock::now();
+            notFull.wait(lock, [this]{ return closed || items.size() < capacity; });
+            pushWait += std::chrono::steady_clock::now() - tic;
+        }
+        if (closed)
+            return false;
+
+        items.push_back(std::move(item));
+        lock.unlock();
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty. False once it is closed and empty.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!closed && items.empty())
+        {
+            auto tic = std::chrono::steady_clock::now();
+            notEmpty.wait(lock, [this]{ return closed || !items.empty(); });
+            popWait += std::chrono::steady_clock::now() - tic;
+        }
+        if (items.empty())
+            return false;
+
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        notFull.notify_one();
+        return true;
+    }
+
+    // By the reader at its end (what is queued can still be popped), or by the consumer to stop the reader
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+    // Time the reader waited for room and the consumer waited for items [s]
+    double pushWaitSeconds() const { std::lock_guard<std::mutex> lock(mtx); return pushWait.count(); }
+    double popWaitSeconds() const { std::lock_guard<std::mutex> lock(mtx); return popWait.count(); }
+
+private:
+
+    size_t capacity;
+    bool closed = false;
+
+    mutable std::mutex mtx;
+    std::condition_variable notFull, notEmpty;
+    std::deque<T> items;
+
+    std::chrono::duration<double> pushWait{0}, popWait{0};
+};
+
+#endif
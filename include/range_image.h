@@ -0,0 +1,49 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Deskewed range and intensity images of an organized (rings x columns) Ouster scan. Images are stored
+* column-major, so the pixels of one firing are contiguous. The cloud itself stays row-major, the deskewing
+* transposes into the images a block of columns at a time.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_RANGE_IMAGE_H_
+#define _OBLAM_RANGE_IMAGE_H_
+
+#include <vector>
+
+// Pixel (ring, col) is data[col*rings + ring]
+template <typename T>
+struct ColumnMajorImage
+{
+    int rings = 0, cols = 0;
+    std::vector<T> data;
+
+    void resize(int rings_, int cols_)
+    {
+        rings = rings_; cols = cols_;
+        data.resize(size_t(rings)*cols);
+    }
+
+    T &at(int ring, int col) { return data[size_t(col)*rings + ring]; }
+    const T &at(int ring, int col) const { return data[size_t(col)*rings + ring]; }
+
+    // Pixels of one column, rings apart
+    T *column(int col) { return &data[size_t(col)*rings]; }
+    const T *column(int col) const { return &data[size_t(col)*rings]; }
+};
+
+struct DeskewedRangeImage
+{
+    ColumnMajorImage<float> range;          // Distance of the deskewed point from the sensor at scan start [m], 0 if no return
+    ColumnMajorImage<float> intensity;
+
+    void resize(int rings, int cols)
+    {
+        range.resize(rings, cols);
+        intensity.resize(rings, cols);
+    }
+};
+
+#endif
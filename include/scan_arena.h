@@ -0,0 +1,172 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Memory for what one scan needs and the next one needs again, so the processing loop stops going to the heap
+* once it has seen a few scans:
+*
+*   ScanArena:   bump allocator for the temporaries of a scan (IMU windows, batch SO(3) arrays, column tables),
+*                handed to std::pmr containers. reset() at the start of a scan takes all of it back at once. What
+*                does not fit the buffer goes to the heap, and the buffer is grown to the peak at the next reset.
+*   RecyclePool: objects handed out as shared pointers (clouds, deskewed points, messages) that are taken back
+*                once nobody else holds them, so their buffers keep their capacity from scan to scan.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_SCAN_ARENA_H_
+#define _OBLAM_SCAN_ARENA_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+#include "mem_placement.h"
+
+// The buffer comes from mem_placement (cache line aligned, huge pages once it is large)
+class ScanArena : public std::pmr::memory_resource
+{
+public:
+
+    explicit ScanArena(size_t bytes = 1 << 20) : bufferSize(bytes)
+    {
+        buffer = static_cast<char *>(mem_placement::allocate(bufferSize));
+        spills.reserve(64);
+    }
+
+    ~ScanArena()
+    {
+        releaseSpills();
+        mem_placement::deallocate(buffer, bufferSize);
+    }
+
+    ScanArena(const ScanArena &) = delete;
+    ScanArena &operator=(const ScanArena &) = delete;
+
+    // Everything handed out before is free again. Containers using the arena must be gone or emptied by then.
+    void reset()
+    {
+        size_t peak = offset + spilled;
+        peakBytes = std::max(peakBytes, peak);
+        releaseSpills();
+
+        if (peak > bufferSize)
+        {
+            mem_placement::deallocate(buffer, bufferSize);
+            bufferSize = std::max(peak + peak/4, 2*bufferSize);
+            buffer = static_cast<char *>(mem_placement::allocate(bufferSize));
+        }
+        offset = 0;
+    }
+
+    size_t capacity() const { return bufferSize; }
+    size_t used() const { return offset + spilled; }
+    size_t peak() const { return std::max(peakBytes, used()); }
+
+    // Heap allocations made because the buffer was full, since the arena was created
+    uint64_t spillCount() const { return spillTotal; }
+
+private:
+
+    static const size_t kAlign = 64;
+
+    struct Spill
+    {
+        void *ptr;
+        size_t bytes, alignment;
+    };
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        size_t start = (offset + alignment - 1) & ~(alignment - 1);
+        if (alignment <= kAlign && start + bytes <= bufferSize)
+        {
+            offset = start + bytes;
+            return buffer + start;
+        }
+
+        void *ptr = ::operator new(bytes, std::align_val_t(std::max(alignment, alignof(std::max_align_t))));
+        spills.push_back(Spill{ptr, bytes, alignment});
+        spilled += bytes;
+        spillTotal++;
+        return ptr;
+    }
+
+    // Memory is only taken back by reset()
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+    void releaseSpills()
+    {
+        for (const Spill &s : spills)
+            ::operator delete(s.ptr, std::align_val_t(std::max(s.alignment, alignof(std::max_align_t))));
+        spills.clear();
+        spilled = 0;
+    }
+
+    char *buffer;
+    size_t bufferSize;
+    size_t offset = 0;
+
+    std::vector<Spill> spills;
+    size_t spilled = 0;
+    size_t peakBytes = 0;
+    uint64_t spillTotal = 0;
+};
+
+// Ptr is std::shared_ptr<T> or boost::shared_ptr<T> (ROS messages). acquire() is for one thread, the objects it
+// hands out can be released on any thread. An object comes back with whatever its last user left in it.
+template <typename T, typename Ptr = std::shared_ptr<T>>
+class RecyclePool
+{
+public:
+
+    // At most maxSize objects are kept, beyond that acquire() hands out objects that are not taken back
+    explicit RecyclePool(size_t maxSize = 8) : maxSize(maxSize) { pool.reserve(maxSize); }
+
+    Ptr acquire()
+    {
+        for (const Ptr &obj : pool)
+            if (obj.use_count() == 1)
+            {
+                // Pairs with the release of the last other owner, its writes to the object are visible here
+                std::atomic_thread_fence(std::memory_order_acquire);
+                return obj;
+            }
+
+        misses++;
+        Ptr obj(new T());
+        if (pool.size() < maxSize)
+            pool.push_back(obj);
+        return obj;
+    }
+
+    // Create up to count objects ahead of use, init sets each one up (e.g. sizes and touches its buffers)
+    template <typename Init>
+    void prefill(size_t count, Init init)
+    {
+        while (pool.size() < std::min(count, maxSize))
+        {
+            Ptr obj(new T());
+            init(*obj);
+            pool.push_back(obj);
+        }
+    }
+
+    size_t size() const { return pool.size(); }
+
+    // Objects that had to be created because all were in use
+    uint64_t created() const { return misses; }
+
+private:
+
+    size_t maxSize;
+    std::vector<Ptr> pool;
+    uint64_t misses = 0;
+};
+
+#endif
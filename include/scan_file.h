@@ -0,0 +1,173 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Columnar file of deskewed scans, for analytics that want the points without going through bags or PCD. Written
+* by oblam_deskew_batch, read through a memory map: scans are found by time from the index without parsing, and
+* the columns of a raw scan are used in place.
+*
+* File layout, little endian, every block 64-byte aligned:
+*
+*   FileHeader
+*   scans:  [ ScanHeader | xyz float[N][3] | intensity float[N] | ring uint8[N] | t uint32[N] ]
+*   index:  ScanHeader[scans], in the order written, at FileHeader::indexOffset
+*
+* The points are in world frame. t is the time of each point after the scan stamp [ns], pose the body pose in world
+* the scan was deskewed from (the odometry paired with it, at or before the stamp). Columns can be
+* compressed (byte shuffle and deflate, lossless), then bytes[c] is their stored size and they are unpacked on read.
+* The index is written on close. If the writer did not get there, the reader walks the inline headers instead.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_SCAN_FILE_H_
+#define _OBLAM_SCAN_FILE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "mytf.h"
+#include "point_compact.h"
+
+namespace scan_file
+{
+
+static const uint64_t kMagic     = 0x4e4143534d414c42ull;    // "BLAMSCAN"
+static const uint32_t kVersion   = 1;
+static const uint32_t kScanMagic = 0x4e435342u;              // "BSCN"
+static const size_t   kAlign     = 64;
+
+enum Codec : uint8_t { RAW = 0, DEFLATE = 1 };
+enum Column { XYZ = 0, INTENSITY, RING, T, COLUMNS };
+
+// Size of one element of each column
+static const size_t kElemBytes[COLUMNS] = {3*sizeof(float), sizeof(float), sizeof(uint8_t), sizeof(uint32_t)};
+
+struct FileHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t scans;                 // 0 until the index is written
+    uint64_t indexOffset;           // 0 until the index is written
+    uint8_t  pad[32];
+};
+static_assert(sizeof(FileHeader) == kAlign, "FileHeader is expected to be 64 bytes");
+
+struct ScanHeader
+{
+    uint32_t magic;
+    uint32_t points;
+    uint8_t  codec;
+    uint8_t  reserved[7];
+    double   stamp;                 // [s]
+    double   pose[7];               // x y z qx qy qz qw
+    uint64_t offset[COLUMNS];       // From the start of the file
+    uint64_t bytes[COLUMNS];        // Stored size
+    uint8_t  pad[48];
+};
+static_assert(sizeof(ScanHeader) % kAlign == 0, "ScanHeader is expected to be a multiple of 64 bytes");
+
+// Whether this build can write and read DEFLATE columns
+bool deflateAvailable();
+
+} // namespace scan_file
+
+// A scan as read, the columns point into the mapping (raw) or into the buffer the scan was unpacked to
+struct ScanView
+{
+    double stamp = 0;
+    mytf pose;
+    size_t size = 0;
+
+    const float *xyz = nullptr;     // x, y, z of each point
+    const float *intensity = nullptr;
+    const uint8_t *ring = nullptr;
+    const uint32_t *t = nullptr;
+};
+
+class ScanFileWriter
+{
+public:
+
+    // compressLevel 0 stores the columns raw, 1-9 is the deflate level. Throws if compression is asked for in a
+    // build without zlib.
+    ScanFileWriter(const std::string &path, int compressLevel = 0);
+    ~ScanFileWriter();
+
+    ScanFileWriter(const ScanFileWriter &) = delete;
+    ScanFileWriter &operator=(const ScanFileWriter &) = delete;
+
+    // The N deskewed points, their attributes taken from the input cloud through srcIdx (or at the same index if
+    // it is null) and their times from the columns they were deskewed at
+    void write(double stamp, const mytf &pose, const PointCompact *points, size_t N, const CloudCompact &attr,
+               const std::vector<uint32_t> *srcIdx);
+
+    // Writes the index, also done by the destructor
+    void close();
+
+    uint64_t scans() const { return index.size(); }
+
+private:
+
+    void put(const void *data, size_t bytes);
+    void align();
+
+    std::string path;
+    FILE *file = nullptr;
+    uint64_t offset = 0;
+    int level;
+
+    std::vector<scan_file::ScanHeader> index;
+
+    // Columns of the scan being written, and their compressed form
+    DefaultInitVector<uint8_t> column[scan_file::COLUMNS];
+    DefaultInitVector<uint8_t> packed[scan_file::COLUMNS];
+};
+
+class ScanFileReader
+{
+public:
+
+    ScanFileReader(const std::string &path);
+    ~ScanFileReader();
+
+    ScanFileReader(const ScanFileReader &) = delete;
+    ScanFileReader &operator=(const ScanFileReader &) = delete;
+
+    size_t size() const { return count; }
+    const scan_file::ScanHeader &header(size_t k) const { return headers[k]; }
+
+    // Whether the index was there, false if it was rebuilt from the inline headers
+    bool indexed() const { return hasIndex; }
+
+    // First scan with a stamp at or after t, size() if there is none. Scans are expected in stamp order.
+    size_t lowerBound(double t) const;
+
+    // Scans [first, last) with stamps in [tstart, tend)
+    void range(double tstart, double tend, size_t &first, size_t &last) const;
+
+    // Unpacked buffers of compressed scans, reusable from scan to scan
+    struct Buffer
+    {
+        DefaultInitVector<uint8_t> column[scan_file::COLUMNS];
+        DefaultInitVector<uint8_t> packed;
+    };
+
+    // Scan k. Raw columns are used in place, compressed ones unpacked into buffer, valid until its next use.
+    ScanView scan(size_t k, Buffer &buffer) const;
+
+private:
+
+    std::string path;
+    const uint8_t *data = nullptr;
+    size_t bytes = 0;
+
+    const scan_file::ScanHeader *headers = nullptr;
+    size_t count = 0;
+    bool hasIndex = false;
+    std::vector<scan_file::ScanHeader> rebuilt;
+};
+
+#endif
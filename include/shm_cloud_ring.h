@@ -0,0 +1,312 @@
+/**
+* This file is part of oblam_deskew.
+*
+* A POSIX shared-memory ring of deskewed clouds for consumers on the same host. One writer fills fixed-capacity
+* slots in place, each slot is guarded by a seqlock, and readers map the segment read-only and use the points
+* where they lie.
+*
+* Segment layout:
+*   ShmRingHeader
+*   slotCount x [ ShmSlotHeader | PointCompact[slotCapacity] | float intensity[slotCapacity] ]
+*
+* Reading a frame without copying:
+*
+*   ShmCloudReader reader("/oblam_deskew");
+*   ShmCloudReader::Frame frame;
+*   if (reader.latest(frame))
+*   {
+*       consume(frame.points, frame.intensity, frame.numPoints);
+*       if (!frame.valid())
+*           ; // The writer lapped us while consuming, drop the result
+*   }
+*/
+
+#pragma once
+
+#ifndef _OBLAM_SHM_CLOUD_RING_H_
+#define _OBLAM_SHM_CLOUD_RING_H_
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "point_compact.h"
+
+namespace shm_ring
+{
+
+static const uint64_t kMagic   = 0x52484d414c424f31ull;    // "1OBLAMHR"
+static const uint32_t kVersion = 1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The seqlock needs lock-free 64-bit atomics");
+
+struct alignas(64) ShmRingHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t slotCapacity;                  // Max points per slot
+    uint32_t reserved;
+    uint64_t slotBytes;                     // Stride between slots, including the slot header
+    std::atomic<uint64_t> frameCount;       // Frames committed so far, the latest is in slot (frameCount - 1) % slotCount
+};
+
+struct alignas(64) ShmSlotHeader
+{
+    std::atomic<uint64_t> seq;              // Odd while the writer is filling the slot
+    uint64_t frameIndex;
+    int64_t  stampNs;                       // Scan start time [ns]
+    char     frameId[64];                   // Frame the points are expressed in
+    double   pose[7];                       // Body pose at scan start in frameId: x, y, z, qx, qy, qz, qw
+    uint32_t numPoints;
+    uint32_t reserved;
+};
+
+inline size_t slotBytes(uint32_t slotCapacity)
+{
+    size_t bytes = sizeof(ShmSlotHeader) + size_t(slotCapacity)*(sizeof(PointCompact) + sizeof(float));
+    return (bytes + 63) & ~size_t(63);
+}
+
+inline PointCompact *slotPoints(ShmSlotHeader *slot)
+{
+    return reinterpret_cast<PointCompact *>(reinterpret_cast<uint8_t *>(slot) + sizeof(ShmSlotHeader));
+}
+
+inline float *slotIntensity(ShmSlotHeader *slot, uint32_t slotCapacity)
+{
+    return reinterpret_cast<float *>(slotPoints(slot) + slotCapacity);
+}
+
+} // namespace shm_ring
+
+class ShmCloudWriter
+{
+public:
+
+    // Slot handed out by begin(), filled in place and published by commit()
+    struct Frame
+    {
+        PointCompact *points = nullptr;
+        float *intensity = nullptr;
+        uint32_t capacity = 0;
+    };
+
+    ShmCloudWriter(const std::string &name, uint32_t slotCount, uint32_t slotCapacity) : name(name)
+    {
+        using namespace shm_ring;
+
+        if (slotCount == 0 || slotCapacity == 0)
+            throw std::runtime_error("ShmCloudWriter: slot count and capacity must be positive");
+
+        mapBytes = sizeof(ShmRingHeader) + slotCount*shm_ring::slotBytes(slotCapacity);
+
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0)
+            throw std::runtime_error("ShmCloudWriter: shm_open(" + name + ") failed: " + strerror(errno));
+
+        if (ftruncate(fd, mapBytes) != 0)
+        {
+            int err = errno; close(fd);
+            throw std::runtime_error("ShmCloudWriter: ftruncate(" + name + ") failed: " + strerror(err));
+        }
+
+        void *addr = mmap(nullptr, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("ShmCloudWriter: mmap(" + name + ") failed: " + strerror(errno));
+
+        base = static_cast<uint8_t *>(addr);
+        header = new (base) ShmRingHeader();
+        header->version = kVersion;
+        header->slotCount = slotCount;
+        header->slotCapacity = slotCapacity;
+        header->reserved = 0;
+        header->slotBytes = shm_ring::slotBytes(slotCapacity);
+        header->frameCount.store(0, std::memory_order_relaxed);
+
+        for (uint32_t k = 0; k < slotCount; k++)
+            new (slot(k)) ShmSlotHeader();
+
+        // Readers check the magic last
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = kMagic;
+    }
+
+    ~ShmCloudWriter()
+    {
+        munmap(base, mapBytes);
+        shm_unlink(name.c_str());
+    }
+
+    ShmCloudWriter(const ShmCloudWriter &) = delete;
+    ShmCloudWriter &operator=(const ShmCloudWriter &) = delete;
+
+    uint32_t capacity() const { return header->slotCapacity; }
+
+    // Open the next slot for writing. Readers holding a view into it will see it invalidated.
+    Frame begin()
+    {
+        current = slot(header->frameCount.load(std::memory_order_relaxed) % header->slotCount);
+
+        uint64_t seq = current->seq.load(std::memory_order_relaxed);
+        current->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        Frame frame;
+        frame.points = shm_ring::slotPoints(current);
+        frame.intensity = shm_ring::slotIntensity(current, header->slotCapacity);
+        frame.capacity = header->slotCapacity;
+        return frame;
+    }
+
+    // Fill in the metadata of the slot opened by begin() and make it visible to readers
+    void commit(uint32_t numPoints, int64_t stampNs, const std::string &frameId, const double pose[7])
+    {
+        uint64_t frameIndex = header->frameCount.load(std::memory_order_relaxed);
+
+        current->frameIndex = frameIndex;
+        current->stampNs = stampNs;
+        strncpy(current->frameId, frameId.c_str(), sizeof(current->frameId) - 1);
+        current->frameId[sizeof(current->frameId) - 1] = '\0';
+        memcpy(current->pose, pose, sizeof(current->pose));
+        current->numPoints = numPoints < header->slotCapacity ? numPoints : header->slotCapacity;
+
+        current->seq.store(current->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        header->frameCount.store(frameIndex + 1, std::memory_order_release);
+        current = nullptr;
+    }
+
+private:
+
+    shm_ring::ShmSlotHeader *slot(uint32_t k)
+    {
+        return reinterpret_cast<shm_ring::ShmSlotHeader *>(base + sizeof(shm_ring::ShmRingHeader) + k*header->slotBytes);
+    }
+
+    std::string name;
+    size_t mapBytes = 0;
+    uint8_t *base = nullptr;
+    shm_ring::ShmRingHeader *header = nullptr;
+    shm_ring::ShmSlotHeader *current = nullptr;
+};
+
+class ShmCloudReader
+{
+public:
+
+    // A frame as it lies in shared memory. Nothing is copied, so the writer may reuse the slot at any time;
+    // check valid() after consuming the data.
+    struct Frame
+    {
+        const shm_ring::ShmSlotHeader *slot = nullptr;
+        uint64_t seq = 0;
+
+        uint64_t frameIndex = 0;
+        int64_t stampNs = 0;
+        std::string frameId;
+        double pose[7];
+
+        const PointCompact *points = nullptr;
+        const float *intensity = nullptr;
+        uint32_t numPoints = 0;
+
+        bool valid() const
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return slot != nullptr && slot->seq.load(std::memory_order_relaxed) == seq;
+        }
+    };
+
+    explicit ShmCloudReader(const std::string &name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            throw std::runtime_error("ShmCloudReader: shm_open(" + name + ") failed: " + strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(shm_ring::ShmRingHeader))
+        {
+            close(fd);
+            throw std::runtime_error("ShmCloudReader: " + name + " is not a cloud ring");
+        }
+
+        mapBytes = st.st_size;
+        void *addr = mmap(nullptr, mapBytes, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            throw std::runtime_error("ShmCloudReader: mmap(" + name + ") failed: " + strerror(errno));
+
+        base = static_cast<const uint8_t *>(addr);
+        header = reinterpret_cast<const shm_ring::ShmRingHeader *>(base);
+
+        if (header->magic != shm_ring::kMagic || header->version != shm_ring::kVersion
+            || mapBytes < sizeof(shm_ring::ShmRingHeader) + header->slotCount*header->slotBytes)
+        {
+            munmap(const_cast<uint8_t *>(base), mapBytes);
+            throw std::runtime_error("ShmCloudReader: " + name + " is not a compatible cloud ring");
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    ~ShmCloudReader()
+    {
+        munmap(const_cast<uint8_t *>(base), mapBytes);
+    }
+
+    ShmCloudReader(const ShmCloudReader &) = delete;
+    ShmCloudReader &operator=(const ShmCloudReader &) = delete;
+
+    uint64_t frameCount() const { return header->frameCount.load(std::memory_order_acquire); }
+
+    // Latest committed frame. Returns false if nothing was written yet or the slot is being rewritten.
+    bool latest(Frame &frame) const
+    {
+        uint64_t count = frameCount();
+        if (count == 0)
+            return false;
+        return get(count - 1, frame);
+    }
+
+    // A specific frame, if it is still in the ring
+    bool get(uint64_t frameIndex, Frame &frame) const
+    {
+        const shm_ring::ShmSlotHeader *slot = reinterpret_cast<const shm_ring::ShmSlotHeader *>(
+            base + sizeof(shm_ring::ShmRingHeader) + (frameIndex % header->slotCount)*header->slotBytes);
+
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            return false;
+
+        frame.slot = slot;
+        frame.seq = seq;
+        frame.frameIndex = slot->frameIndex;
+        frame.stampNs = slot->stampNs;
+        frame.frameId.assign(slot->frameId, strnlen(slot->frameId, sizeof(slot->frameId)));
+        memcpy(frame.pose, slot->pose, sizeof(frame.pose));
+        frame.numPoints = slot->numPoints;
+
+        uint8_t *slotBase = reinterpret_cast<uint8_t *>(const_cast<shm_ring::ShmSlotHeader *>(slot));
+        frame.points = shm_ring::slotPoints(reinterpret_cast<shm_ring::ShmSlotHeader *>(slotBase));
+        frame.intensity = shm_ring::slotIntensity(reinterpret_cast<shm_ring::ShmSlotHeader *>(slotBase), header->slotCapacity);
+
+        // The metadata must belong to the same generation of the slot, and be the frame that was asked for
+        return frame.valid() && frame.frameIndex == frameIndex && frame.numPoints <= header->slotCapacity;
+    }
+
+private:
+
+    size_t mapBytes = 0;
+    const uint8_t *base = nullptr;
+    const shm_ring::ShmRingHeader *header = nullptr;
+};
+
+#endif
@@ -43,6 +43,7 @@
 #include <ctime>
 #include <cfloat>
 #include <iterator>
+#include <cstring>
 #include <sstream>
 #include <string>
 #include <limits>
@@ -58,6 +59,8 @@
 #include <std_msgs/Float64MultiArray.h>
 #include <sensor_msgs/Imu.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
 #include <sensor_msgs/NavSatFix.h>
 #include <nav_msgs/Odometry.h>
 #include <nav_msgs/Path.h>
@@ -77,6 +80,10 @@
 #include <tf/transform_broadcaster.h>
 
 #include "glob.h"
+#include "mytf.h"
+#include "point_compact.h"
+#include "range_image.h"
+#include "deskew_core.h"
 
 // #include <sophus/se3.hpp>
 
@@ -139,164 +146,313 @@ typedef pcl::PointCloud<PointXYZIT>::Ptr CloudXYZITPtr;
 
 /* #endregion  Custom point type definition -----------------------------------------------------*/
 
-
-// Shortened typedef matching character length of Vector3d and Matrix3d
-typedef Eigen::Quaterniond Quaternd;
-typedef Eigen::Quaterniond Quaternf;
-
-template <typename T = double>
-struct myTf
+namespace Util
 {
-    Eigen::Quaternion<T>   rot;
-    Eigen::Matrix<T, 3, 1> pos;
-
-    myTf Identity()
-    {
-        return myTf();
-    }
-    
-    myTf(const myTf<T> &other)
+    inline void ComputeCeresCost(vector<ceres::internal::ResidualBlock *> &res_ids,
+                                 double &cost, ceres::Problem &problem)
     {
-        rot = other.rot;
-        pos = other.pos;
-    }
+        if (res_ids.size() == 0)
+        {
+            cost = -1;
+            return;
+        }
 
-    myTf()
-    {
-        rot = Quaternd(1, 0, 0, 0);
-        pos = Vector3d(0, 0, 0);
+        ceres::Problem::EvaluateOptions e_option;
+        e_option.residual_blocks = res_ids;
+        e_option.num_threads = omp_get_max_threads();
+        problem.Evaluate(e_option, &cost, NULL, NULL, NULL);
     }
 
-    myTf(Eigen::Quaternion<T> rot_in, Eigen::Matrix<T, 3, 1> pos_in)
+    // Published by shared pointer, so subscribers in the same nodelet manager get the message without serialization
+    template <typename PointType>
+    sensor_msgs::PointCloud2::Ptr publishCloud(ros::Publisher &thisPub,
+                                               pcl::PointCloud<PointType> &thisCloud,
+                                               ros::Time thisStamp, std::string thisFrame)
     {
-        this->rot = rot_in;
-        this->pos = pos_in;
+        sensor_msgs::PointCloud2::Ptr tempCloud(new sensor_msgs::PointCloud2());
+        if (thisPub.getNumSubscribers() == 0)
+            return tempCloud;
+
+        pcl::toROSMsg(thisCloud, *tempCloud);
+        tempCloud->header.stamp = thisStamp;
+        tempCloud->header.frame_id = thisFrame;
+        thisPub.publish(tempCloud);
+        return tempCloud;
     }
 
-    myTf(Eigen::Matrix<T, 3, 3> rot_in, Eigen::Matrix<T, 3, 1> pos_in)
+    // Column-major rings x columns image, published as a row-major columns x rings 32FC1 image
+    inline sensor_msgs::Image::Ptr publishImage(ros::Publisher &thisPub, const ColumnMajorImage<float> &thisImage,
+                                                ros::Time thisStamp, std::string thisFrame)
     {
-        this->rot = Quaternion<T>(rot_in);
-        this->pos = pos_in;
+        sensor_msgs::Image::Ptr tempImage(new sensor_msgs::Image());
+        if (thisPub.getNumSubscribers() == 0)
+            return tempImage;
+
+        tempImage->header.stamp = thisStamp;
+        tempImage->header.frame_id = thisFrame;
+        tempImage->height = thisImage.cols;
+        tempImage->width = thisImage.rings;
+        tempImage->encoding = sensor_msgs::image_encodings::TYPE_32FC1;
+        tempImage->is_bigendian = false;
+        tempImage->step = thisImage.rings*sizeof(float);
+        tempImage->data.resize(thisImage.data.size()*sizeof(float));
+        memcpy(tempImage->data.data(), thisImage.data.data(), tempImage->data.size());
+        thisPub.publish(tempImage);
+        return tempImage;
     }
 
-    template <typename Tin>
-    myTf(Eigen::Matrix<Tin, 4, 4> tfMat)
+    // Assign each point of a compact cloud to a column. Ouster clouds are organized rings x columns with one
+    // timestamp per column, anything else is grouped by its distinct timestamps.
+    inline void assignColumns(CloudCompact &cloud)
     {
-        Eigen::Matrix<T, 3, 3> M = tfMat.block(0, 0, 3, 3).template cast<T>();
-        this->rot = Quaternion<T>(M);
-        this->pos = tfMat.block(0, 3, 3, 1).template cast<T>();
-    }
+        size_t N = cloud.size();
+        cloud.col_t.clear();
+        if (N == 0)
+            return;
 
-    myTf(nav_msgs::Odometry odom)
-    {
-        this->rot = Quaternion<T>(odom.pose.pose.orientation.w,
-                                    odom.pose.pose.orientation.x,
-                                    odom.pose.pose.orientation.y,
-                                    odom.pose.pose.orientation.z);
-                                    
-        this->pos << odom.pose.pose.position.x,
-                     odom.pose.pose.position.y,
-                     odom.pose.pose.position.z;
-    }
+        if (cloud.height > 1 && cloud.width <= 65536 && size_t(cloud.height)*cloud.width == N)
+        {
+            cloud.col_t.assign(cloud.t.begin(), cloud.t.begin() + cloud.width);
+            for (size_t i = 0; i < N; i++)
+                cloud.points[i].col = i % cloud.width;
+            return;
+        }
 
-    myTf(Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> transform)
-    {
-        this->rot = Eigen::Quaternion<T>{transform.linear()}.normalized();
-        this->pos = transform.translation();
-    }
+        vector<uint32_t> ut(cloud.t.begin(), cloud.t.end());
+        std::sort(ut.begin(), ut.end());
+        ut.erase(std::unique(ut.begin(), ut.end()), ut.end());
 
-    Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> transform() const
-    {
-        Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> transform;
-        transform.linear() = rot.normalized().toRotationMatrix();
-        transform.translation() = pos;
-        return transform;
+        if (ut.size() <= 65536)
+        {
+            for (size_t i = 0; i < N; i++)
+                cloud.points[i].col = std::lower_bound(ut.begin(), ut.end(), cloud.t[i]) - ut.begin();
+            cloud.col_t.swap(ut);
+        }
+        else
+        {
+            // Too many distinct stamps to index with 16 bits, quantize them into uniform slots
+            uint32_t tmin = ut.front(); double scale = 65535.0/(ut.back() - tmin);
+            cloud.col_t.resize(65536);
+            for (int c = 0; c < 65536; c++)
+                cloud.col_t[c] = tmin + (uint32_t)round(c/scale);
+            for (size_t i = 0; i < N; i++)
+                cloud.points[i].col = (uint16_t)round((cloud.t[i] - tmin)*scale);
+        }
     }
 
-    Eigen::Matrix<T, 4, 4> tfMat() const
+    inline void fromCloudOuster(const CloudOuster &cloudIn, CloudCompact &cloudOut)
     {
-        Eigen::Matrix<T, 4, 4> M = Matrix<T, 4, 4>::Identity();
-        M.block(0, 0, 3, 3) = rot.normalized().toRotationMatrix();
-        M.block(0, 3, 3, 1) = pos;
-        return M;
-    }
+        size_t N = cloudIn.size();
+        cloudOut.height = cloudIn.height; cloudOut.width = cloudIn.width;
+        cloudOut.resize(N);
 
-    myTf inverse() const
-    {
-        Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> transform_inv = this->transform().inverse();
-        myTf tf_inv;
-        tf_inv.rot = transform_inv.linear();
-        tf_inv.pos = transform_inv.translation();
-        return tf_inv;
+        for (size_t i = 0; i < N; i++)
+        {
+            const PointOuster &pi = cloudIn.points[i];
+            PointCompact &po = cloudOut.points[i];
+            po.x = pi.x; po.y = pi.y; po.z = pi.z;
+            cloudOut.intensity[i] = pi.intensity;
+            cloudOut.t[i] = pi.t;
+            cloudOut.reflectivity[i] = pi.reflectivity;
+            cloudOut.ring[i] = pi.ring;
+            cloudOut.range[i] = pi.range;
+        }
+
+        assignColumns(cloudOut);
     }
 
-    myTf operator*(const myTf &other) const
+    // Frame of the deskewed clouds on ROS, in the bags and in shared memory. The points are in world, run_deskew.launch
+    // shifts this frame so that RViz shows them beside the distorted cloud.
+    static const char *const kDeskewedFrame = "world_shifted";
+
+    // Lidar-to-IMU transform of the Ouster OS1 in the Newer College data, the one run_deskew.launch puts on /tf_static
+    inline mytf defaultExtrinsic()
     {
-        Eigen::Transform<T, 3, Eigen::TransformTraits::Affine> transform_out = this->transform() * other.transform();
-        return myTf(transform_out);
+        Matrix4d tfm_Bimu_Blidar;
+        tfm_Bimu_Blidar << -1.0, 0,   0,  -0.006253,
+                            0,  -1.0, 0,   0.011775,
+                            0,   0,   1.0, 0.028535,
+                            0,   0,   0,   1.000000;
+        return myTf(tfm_Bimu_Blidar);
     }
 
-    template <typename NewType>
-    myTf<NewType> cast() const
+    // Messages to the inputs of the deskew core
+    inline ImuSample toImuSample(const sensor_msgs::Imu &msg)
     {
-        myTf<NewType> tf_new{this->rot.template cast<NewType>(), this->pos.template cast<NewType>()};
-        return tf_new;
+        return ImuSample{msg.header.stamp.toSec(),
+                         Vector3d(msg.angular_velocity.x, msg.angular_velocity.y, msg.angular_velocity.z),
+                         Vector3d(msg.linear_acceleration.x, msg.linear_acceleration.y, msg.linear_acceleration.z)};
     }
 
-    double roll() const
+    // The twist of the odometry is in the child frame, OdomState has the velocity in world frame
+    inline OdomState toOdomState(const nav_msgs::Odometry &msg)
     {
-        return atan2(rot.x()*rot.w() + rot.y()*rot.z(), 0.5 - (rot.x()*rot.x() + rot.y()*rot.y()))/M_PI*180.0;
+        mytf tf(msg);
+        Vector3d vel(msg.twist.twist.linear.x, msg.twist.twist.linear.y, msg.twist.twist.linear.z);
+        return OdomState{msg.header.stamp.toSec(), tf.rot, tf.pos, tf.rot*vel};
     }
 
-    double pitch() const
+    // Unpack an Ouster PointCloud2 straight into the compact format, without going through a PointOuster cloud
+    inline void fromROSMsg(const sensor_msgs::PointCloud2 &msg, CloudCompact &cloud, int threads = MAX_THREADS)
     {
-        return asin(-2*(rot.x()*rot.z() - rot.w()*rot.y()))/M_PI*180.0;
+        typedef sensor_msgs::PointField PF;
+
+        auto offsetOf = [&msg](const string &name, uint8_t datatype) -> int
+        {
+            for (const auto &field : msg.fields)
+                if (field.name == name && field.datatype == datatype && field.count == 1)
+                    return field.offset;
+            return -1;
+        };
+
+        int ox = offsetOf("x", PF::FLOAT32), oy = offsetOf("y", PF::FLOAT32), oz = offsetOf("z", PF::FLOAT32);
+        int oi = offsetOf("intensity", PF::FLOAT32), ot = offsetOf("t", PF::UINT32);
+        int of = offsetOf("reflectivity", PF::UINT16), og = offsetOf("ring", PF::UINT8);
+        int orr = offsetOf("range", PF::UINT32);
+
+        // Unexpected layout, let pcl sort out the field mapping
+        if (msg.is_bigendian || ox < 0 || oy < 0 || oz < 0 || oi < 0 || ot < 0 || of < 0 || og < 0 || orr < 0)
+        {
+            CloudOuster cloudOuster;
+            pcl::fromROSMsg(msg, cloudOuster);
+            fromCloudOuster(cloudOuster, cloud);
+            return;
+        }
+
+        size_t N = size_t(msg.width)*msg.height;
+        cloud.height = msg.height; cloud.width = msg.width;
+        cloud.resize(N);
+
+        #pragma omp parallel for num_threads(threads) if(threads > 1)
+        for (size_t i = 0; i < N; i++)
+        {
+            const uint8_t *src = &msg.data[(i / msg.width)*msg.row_step + (i % msg.width)*msg.point_step];
+            PointCompact &po = cloud.points[i];
+            memcpy(&po.x, src + ox, sizeof(float));
+            memcpy(&po.y, src + oy, sizeof(float));
+            memcpy(&po.z, src + oz, sizeof(float));
+            memcpy(&cloud.intensity[i], src + oi, sizeof(float));
+            memcpy(&cloud.t[i], src + ot, sizeof(uint32_t));
+            memcpy(&cloud.reflectivity[i], src + of, sizeof(uint16_t));
+            memcpy(&cloud.ring[i], src + og, sizeof(uint8_t));
+            memcpy(&cloud.range[i], src + orr, sizeof(uint32_t));
+        }
+
+        assignColumns(cloud);
     }
 
-    double yaw() const
+    // Materialize a full PointOuster cloud from compact xyz and the attributes of the scan they came from
+    inline void toCloudOuster(const PointCompactVec &xyz, const CloudCompact &attr, CloudOuster &cloudOut)
     {
-        return atan2(rot.x()*rot.y() + rot.w()*rot.z(), 0.5 - (rot.y()*rot.y() + rot.z()*rot.z()))/M_PI*180.0;
+        size_t N = xyz.size();
+        ROS_ASSERT(N == attr.size());
+
+        cloudOut.resize(N);
+        if (size_t(attr.height)*attr.width == N)
+        {
+            cloudOut.height = attr.height;
+            cloudOut.width  = attr.width;
+        }
+
+        for (size_t i = 0; i < N; i++)
+        {
+            PointOuster &po = cloudOut.points[i];
+            po.x = xyz[i].x; po.y = xyz[i].y; po.z = xyz[i].z; po.data[3] = 1.0f;
+            po.intensity = attr.intensity[i];
+            po.t = attr.t[i];
+            po.reflectivity = attr.reflectivity[i];
+            po.ring = attr.ring[i];
+            po.range = attr.range[i];
+        }
     }
 
-    friend std::ostream &operator<<(std::ostream &os, const myTf &tf)
+    // Same for a filtered cloud, where output point i takes the attributes of input point srcIdx[i]
+    inline void toCloudOuster(const PointCompactVec &xyz, const CloudCompact &attr, const vector<uint32_t> &srcIdx,
+                              CloudOuster &cloudOut)
     {
-        os << tf.pos.x() << " " << tf.pos.y() << " " << tf.pos.z() << " " << tf.rot.w() << " "
-           << tf.rot.x() << " " << tf.rot.y() << " " << tf.rot.z();
-        return os;
-    }
-}; // class myTf
+        size_t N = xyz.size();
+        ROS_ASSERT(N == srcIdx.size());
 
-typedef myTf<> mytf;
+        cloudOut.resize(N);
+        for (size_t i = 0; i < N; i++)
+        {
+            PointOuster &po = cloudOut.points[i];
+            uint32_t j = srcIdx[i];
+            po.x = xyz[i].x; po.y = xyz[i].y; po.z = xyz[i].z; po.data[3] = 1.0f;
+            po.intensity = attr.intensity[j];
+            po.t = attr.t[j];
+            po.reflectivity = attr.reflectivity[j];
+            po.ring = attr.ring[j];
+            po.range = attr.range[j];
+        }
+    }
 
-namespace Util
-{
-    void ComputeCeresCost(vector<ceres::internal::ResidualBlock *> &res_ids,
-                          double &cost, ceres::Problem &problem)
+    // What toCloudOuster and pcl::toROSMsg give together, written straight into the message: the PointOuster
+    // layout, output point i with the attributes of input point srcIdx[i] (of point i without srcIdx). The buffers
+    // of msg are reused, so a recycled message is filled without allocating. The header is left to the caller.
+    inline void toROSMsg(const PointCompact *xyz, size_t N, const CloudCompact &attr, const vector<uint32_t> *srcIdx,
+                         sensor_msgs::PointCloud2 &msg)
     {
-        if (res_ids.size() == 0)
+        typedef sensor_msgs::PointField PF;
+
+        if (msg.fields.size() != 8 || msg.point_step != sizeof(PointOuster))
         {
-            cost = -1;
-            return;
+            auto field = [](const char *name, size_t offset, uint8_t datatype)
+            {
+                PF f; f.name = name; f.offset = offset; f.datatype = datatype; f.count = 1;
+                return f;
+            };
+            msg.fields = {field("x", offsetof(PointOuster, x), PF::FLOAT32),
+                          field("y", offsetof(PointOuster, y), PF::FLOAT32),
+                          field("z", offsetof(PointOuster, z), PF::FLOAT32),
+                          field("intensity", offsetof(PointOuster, intensity), PF::FLOAT32),
+                          field("t", offsetof(PointOuster, t), PF::UINT32),
+                          field("reflectivity", offsetof(PointOuster, reflectivity), PF::UINT16),
+                          field("ring", offsetof(PointOuster, ring), PF::UINT8),
+                          field("range", offsetof(PointOuster, range), PF::UINT32)};
         }
 
-        ceres::Problem::EvaluateOptions e_option;
-        e_option.residual_blocks = res_ids;
-        e_option.num_threads = omp_get_max_threads();
-        problem.Evaluate(e_option, &cost, NULL, NULL, NULL);
+        bool organized = !srcIdx && size_t(attr.height)*attr.width == N;
+        msg.height = organized ? attr.height : 1;
+        msg.width = organized ? attr.width : N;
+        msg.is_bigendian = false;
+        msg.point_step = sizeof(PointOuster);
+        msg.row_step = msg.point_step*msg.width;
+        msg.data.resize(N*sizeof(PointOuster));
+
+        PointOuster po;
+        memset(&po, 0, sizeof(po));
+        po.data[3] = 1.0f;
+        uint8_t *dst = msg.data.data();
+        for (size_t i = 0; i < N; i++, dst += sizeof(PointOuster))
+        {
+            size_t j = srcIdx ? (*srcIdx)[i] : i;
+            po.x = xyz[i].x; po.y = xyz[i].y; po.z = xyz[i].z;
+            po.intensity = attr.intensity[j];
+            po.t = attr.t[j];
+            po.reflectivity = attr.reflectivity[j];
+            po.ring = attr.ring[j];
+            po.range = attr.range[j];
+            memcpy(dst, &po, sizeof(PointOuster));
+        }
     }
 
-    template <typename PointType>
-    sensor_msgs::PointCloud2 publishCloud(ros::Publisher &thisPub,
-                                          pcl::PointCloud<PointType> &thisCloud,
-                                          ros::Time thisStamp, std::string thisFrame)
+    inline void transformCloud(const PointCompactVec &cloudIn, PointCompactVec &cloudOut, const Eigen::Matrix4f &tfm)
     {
-        sensor_msgs::PointCloud2 tempCloud;
-        pcl::toROSMsg(thisCloud, tempCloud);
-        tempCloud.header.stamp = thisStamp;
-        tempCloud.header.frame_id = thisFrame;
-        // if (thisPub.getNumSubscribers() != 0)
-            thisPub.publish(tempCloud);
-        return tempCloud;
+        size_t N = cloudIn.size();
+        if (&cloudIn != &cloudOut)
+            cloudOut.resize(N);
+
+        Eigen::Matrix3f R = tfm.block<3, 3>(0, 0); Eigen::Vector3f p = tfm.block<3, 1>(0, 3);
+
+        #pragma omp parallel for num_threads(MAX_THREADS)
+        for (size_t i = 0; i < N; i++)
+        {
+            const PointCompact &pi = cloudIn[i];
+            PointCompact &po = cloudOut[i];
+            Eigen::Vector3f pt = R*Eigen::Vector3f(pi.x, pi.y, pi.z) + p;
+            po.x = pt.x(); po.y = pt.y(); po.z = pt.z(); po.col = pi.col; po.pad = pi.pad;
+        }
     }
 
     // template <typename Derived>
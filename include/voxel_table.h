@@ -0,0 +1,111 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Open-addressing hash table from voxel keys (FusedFilter::voxelKey) to T, for the per-scan voxel grids. clear()
+* only resets the slots that were used and keeps the capacity, so once it has grown to the size of a scan the
+* table is refilled every scan without allocating.
+*/
+
+#pragma once
+
+#ifndef _OBLAM_VOXEL_TABLE_H_
+#define _OBLAM_VOXEL_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+template <typename T>
+class VoxelTable
+{
+public:
+
+    // Voxel keys use 63 bits, so this is never a key
+    static constexpr uint64_t kEmpty = ~uint64_t(0);
+
+    size_t size() const { return used.size(); }
+    bool empty() const { return used.empty(); }
+
+    void clear()
+    {
+        for (uint32_t s : used)
+            keys[s] = kEmpty;
+        used.clear();
+    }
+
+    // Room for n voxels without growing
+    void reserve(size_t n)
+    {
+        if (2*n > keys.size())
+            rehash(2*n);
+    }
+
+    // The value of key, set to init if it was not in the table
+    T &insert(uint64_t key, const T &init, bool &inserted)
+    {
+        if (2*(used.size() + 1) > keys.size())
+            rehash(2*(used.size() + 1));
+
+        uint32_t s = slot(key);
+        inserted = keys[s] == kEmpty;
+        if (inserted)
+        {
+            keys[s] = key;
+            values[s] = init;
+            used.push_back(s);
+        }
+        return values[s];
+    }
+
+    T *find(uint64_t key)
+    {
+        if (keys.empty())
+            return nullptr;
+        uint32_t s = slot(key);
+        return keys[s] == kEmpty ? nullptr : &values[s];
+    }
+
+    // The k-th voxel in insertion order, k < size()
+    uint64_t key(size_t k) const { return keys[used[k]]; }
+    T &value(size_t k) { return values[used[k]]; }
+    const T &value(size_t k) const { return values[used[k]]; }
+
+private:
+
+    // Slot of key, or the empty slot it goes in. Linear probing, the table is at most half full.
+    uint32_t slot(uint64_t key) const
+    {
+        uint32_t mask = keys.size() - 1;
+        uint32_t s = uint32_t((key*0x9E3779B97F4A7C15ull) >> 32) & mask;
+        while (keys[s] != kEmpty && keys[s] != key)
+            s = (s + 1) & mask;
+        return s;
+    }
+
+    void rehash(size_t capacity)
+    {
+        size_t n = 16;
+        while (n < capacity)
+            n *= 2;
+
+        std::vector<uint64_t> oldKeys(n, kEmpty);
+        std::vector<T> oldValues(n);
+        oldKeys.swap(keys); oldValues.swap(values);
+
+        std::vector<uint32_t> oldUsed; oldUsed.reserve(n/2);
+        oldUsed.swap(used);
+        for (uint32_t o : oldUsed)
+        {
+            uint32_t s = slot(oldKeys[o]);
+            keys[s] = oldKeys[o];
+            values[s] = oldValues[o];
+            used.push_back(s);
+        }
+    }
+
+    std::vector<uint64_t> keys;
+    std::vector<T> values;
+    std::vector<uint32_t> used;     // Occupied slots in insertion order
+};
+
+#endif
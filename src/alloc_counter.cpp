@@ -0,0 +1,85 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Counts the heap allocations of each thread by wrapping the glibc allocator, see alloc_counter.h. Symbols of an
+* executable take precedence over libc's, so this covers the allocations of the shared libraries loaded into it
+* too (the nodelet in the standalone node). free() is left to glibc.
+*/
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+extern "C"
+{
+void *__libc_malloc(size_t bytes);
+void *__libc_calloc(size_t count, size_t bytes);
+void *__libc_realloc(void *ptr, size_t bytes);
+void *__libc_memalign(size_t alignment, size_t bytes);
+void *__libc_valloc(size_t bytes);
+void *__libc_pvalloc(size_t bytes);
+}
+
+static thread_local uint64_t threadAllocations __attribute__((tls_model("initial-exec"))) = 0;
+
+extern "C"
+{
+
+uint64_t oblamThreadAllocations() { return threadAllocations; }
+
+void *malloc(size_t bytes)
+{
+    threadAllocations++;
+    return __libc_malloc(bytes);
+}
+
+void *calloc(size_t count, size_t bytes)
+{
+    threadAllocations++;
+    return __libc_calloc(count, bytes);
+}
+
+void *realloc(void *ptr, size_t bytes)
+{
+    threadAllocations++;
+    return __libc_realloc(ptr, bytes);
+}
+
+void *memalign(size_t alignment, size_t bytes)
+{
+    threadAllocations++;
+    return __libc_memalign(alignment, bytes);
+}
+
+void *aligned_alloc(size_t alignment, size_t bytes)
+{
+    threadAllocations++;
+    return __libc_memalign(alignment, bytes);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t bytes)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    threadAllocations++;
+    void *mem = __libc_memalign(alignment, bytes);
+    if (!mem)
+        return ENOMEM;
+    *ptr = mem;
+    return 0;
+}
+
+void *valloc(size_t bytes)
+{
+    threadAllocations++;
+    return __libc_valloc(bytes);
+}
+
+void *pvalloc(size_t bytes)
+{
+    threadAllocations++;
+    return __libc_pvalloc(bytes);
+}
+
+}
@@ -0,0 +1,515 @@
+/**
+* This file is part of oblam_deskew.
+*
+* The ROS-free deskewing: odometry interpolation, the IMU store, the propagation and deskew stages, and the
+* engine that runs them on a scan. See deskew_core.h.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <omp.h>
+
+#include "deskew_core.h"
+#include "mem_placement.h"
+#include "so3_batch.h"
+
+using namespace std;
+using namespace Eigen;
+
+/* #region  Odometry ----------------------------------------------------------------------------------------------*/
+
+OdomState InterpolateOdom(const OdomState &a, const OdomState &b, double t)
+{
+    double h = b.t - a.t;
+    if (!(h > 0))
+        return a;
+
+    double s = min(max((t - a.t)/h, 0.0), 1.0), s2 = s*s, s3 = s2*s;
+
+    // Hermite basis and its derivative in s
+    double h00 = 2*s3 - 3*s2 + 1, h10 = s3 - 2*s2 + s, h01 = -2*s3 + 3*s2, h11 = s3 - s2;
+    double d00 = 6*s2 - 6*s,      d10 = 3*s2 - 4*s + 1, d01 = -6*s2 + 6*s, d11 = 3*s2 - 2*s;
+
+    OdomState odom;
+    odom.t = min(max(t, a.t), b.t);
+    odom.q = a.q.slerp(s, b.q).normalized();
+    odom.p = h00*a.p + h10*h*a.v + h01*b.p + h11*h*b.v;
+    odom.v = (d00*a.p + d01*b.p)/h + d10*a.v + d11*b.v;
+    return odom;
+}
+
+/* #endregion  Odometry -------------------------------------------------------------------------------------------*/
+
+/* #region  ImuStore ----------------------------------------------------------------------------------------------*/
+
+bool ImuStore::push(const ImuSample &sample)
+{
+    lock_guard<mutex> lock(mtx);
+    if (!buf.empty() && !(sample.t > buf.back().t))
+    {
+        droppedCount++;
+        return false;
+    }
+    buf.push_back(sample);
+    return true;
+}
+
+uint64_t ImuStore::dropped() const
+{
+    lock_guard<mutex> lock(mtx);
+    return droppedCount;
+}
+
+bool ImuStore::empty() const
+{
+    lock_guard<mutex> lock(mtx);
+    return buf.empty();
+}
+
+size_t ImuStore::size() const
+{
+    lock_guard<mutex> lock(mtx);
+    return buf.size();
+}
+
+double ImuStore::frontTime() const
+{
+    lock_guard<mutex> lock(mtx);
+    return buf.empty() ? NAN : buf.front().t;
+}
+
+double ImuStore::backTime() const
+{
+    lock_guard<mutex> lock(mtx);
+    return buf.empty() ? NAN : buf.back().t;
+}
+
+size_t ImuStore::before(double t) const
+{
+    auto after = upper_bound(buf.begin(), buf.end(), t, [](double t, const ImuSample &s) { return t < s.t; });
+    return after == buf.begin() ? 0 : after - buf.begin() - 1;
+}
+
+void ImuStore::prune(double t)
+{
+    lock_guard<mutex> lock(mtx);
+    buf.erase(buf.begin(), buf.begin() + before(t));
+}
+
+ImuSeq ImuStore::window(double tstart, double tend, pmr::memory_resource *mr) const
+{
+    lock_guard<mutex> lock(mtx);
+
+    size_t first = before(tstart);
+    size_t last = first;
+    if (!buf.empty() && buf[first].t <= tend)
+        last = min(before(tend) + 1, buf.size() - 1);
+
+    ImuSeq seq(mr);
+    if (!buf.empty())
+        seq.assign(buf.begin() + first, buf.begin() + last + 1);
+    return seq;
+}
+
+/* #endregion  ImuStore -------------------------------------------------------------------------------------------*/
+
+/* #region  Stages ------------------------------------------------------------------------------------------------*/
+
+void ExtractImuData( vector<double> &ts, vector<Vector3d> &gyro, vector<Vector3d> &acce,
+                     double tstart, double tend, const ImuSeq &imuSeq)
+{
+    int Nend = imuSeq.size() - 2;
+    for(int i = 0; i <= Nend; i++)
+    {
+        if (i == 0 || i == Nend)
+        {
+            // Interpolate at the start of the first interval and at the end of the last one
+            const ImuSample &B = imuSeq[i], &E = imuSeq[i+1];
+            double t = i == 0 ? tstart : tend;
+            double s = (t - B.t)/(E.t - B.t);
+
+            ts.push_back(t);
+            gyro.push_back((1-s)*B.gyro + s*E.gyro);
+            acce.push_back((1-s)*B.acce + s*E.acce);
+        }
+        else
+        {
+            ts.push_back(imuSeq[i].t);
+            gyro.push_back(imuSeq[i].gyro);
+            acce.push_back(imuSeq[i].acce);
+        }
+    }
+}
+
+void PropagateIMU(const OdomState &odom,
+                  const vector<double> &ts, const vector<Vector3d> &gyro_, const vector<Vector3d> &acce_,
+                  const Vector3d &bg, const Vector3d &ba, const Vector3d &grav,
+                  vector<Quaternd> &q, vector<Vector3d> &p, vector<Vector3d> &v, pmr::memory_resource *scratch)
+{   
+    // Initial state
+    q.push_back(odom.q);
+    p.push_back(odom.p);
+    v.push_back(odom.v);
+
+    int N = ts.size();
+    if (N < 2)
+        return;
+
+    // Rotation increments of all IMU intervals in one batch, from the gyro at the start of each interval
+    so3_batch::Vec3Array<double> dtheta(scratch); dtheta.resize(N - 1);
+    for(int i = 1; i < N; i++)
+        dtheta.set(i - 1, (gyro_[i-1] - bg)*(ts[i] - ts[i-1]));
+
+    so3_batch::QuatArray<double> dq(scratch);
+    so3_batch::exp(dtheta, dq);
+
+    // Initial measurement
+    double to = ts.front(); Vector3d acco = acce_.front();
+    Quaternd Qo = q.back(); Vector3d Po = p.back(); Vector3d Vo = v.back();
+
+    // Propagation using euler method
+    for(int i = 1; i < N; i++)
+    {
+        double tn = ts[i]; Vector3d accn = acce_[i];
+        double dt = tn - to;
+
+        // Acceleration in world frame, grav being what the accelerometer reads at rest
+        Vector3d acc_W = Qo*(acco - ba) - grav;
+
+        Quaternd Qn = (Qo*dq.get(i - 1)).normalized();
+        Vector3d Vn = Vo + acc_W*dt;
+        Vector3d Pn = Po + Vo*dt + 0.5*acc_W*dt*dt;
+
+        // Store the data
+        q.push_back(Qn); p.push_back(Pn); v.push_back(Vn);
+        to = tn; acco = accn; Qo = q.back(); Po = p.back(); Vo = v.back();
+    }
+}
+
+void ColumnPoses(const vector<uint32_t> &col_t, double tstart, const mytf &tf_W_Bstart, const mytf &tf_Bimu_Blidar,
+                 const vector<double> &ts, const vector<Quaternd> &q_W_Bs, const vector<Vector3d> &p_W_Bs,
+                 vector<Matrix3f> &R_W_Lcol, vector<Vector3f> &p_W_Lcol, pmr::memory_resource *scratch)
+{
+    mytf tf_W_Lstart = tf_W_Bstart*tf_Bimu_Blidar;
+
+    int colsTotal = col_t.size();
+    R_W_Lcol.resize(colsTotal); p_W_Lcol.resize(colsTotal);
+
+    // Step 1: Find the j such that ts[j] <= ti <= ts[j+1], where ts[j] is the IMU sample time, -1 if outside
+    pmr::vector<int> colIdx(colsTotal, scratch); pmr::vector<double> colS(colsTotal, scratch);
+    so3_batch::QuatArray<double> q0(scratch), q1(scratch), q_ti(scratch);
+    q0.resize(colsTotal); q1.resize(colsTotal);
+    for(int c = 0; c < colsTotal; c++)
+    {
+        // Sample time of the column
+        double ti = tstart + col_t[c]/1.0e9;
+
+        int j = -1;
+        if (ts.size() >= 2 && ts.front() <= ti && ti <= ts.back())
+            j = min(int(upper_bound(ts.begin(), ts.end(), ti) - ts.begin()) - 1, int(ts.size()) - 2);
+
+        colIdx[c] = j;
+        colS[c] = j >= 0 ? (ti - ts[j])/(ts[j+1] - ts[j]) : 0.0;
+        q0.set(c, j >= 0 ? q_W_Bs[j] : tf_W_Bstart.rot);
+        q1.set(c, j >= 0 ? q_W_Bs[j+1] : tf_W_Bstart.rot);
+    }
+
+    // Step 2: Find the linear interpolated pose (q_ti, p_ti), the rotations of all columns in one batch
+    so3_batch::slerp(q0, q1, colS, q_ti);
+
+    for(int c = 0; c < colsTotal; c++)
+    {
+        int j = colIdx[c];
+        if (j >= 0)
+        {
+            double s = colS[c];
+            Vector3d p_ti = (1 - s)*p_W_Bs[j] + s*p_W_Bs[j+1];
+
+            mytf tf_W_Lcol = mytf(q_ti.get(c), p_ti)*tf_Bimu_Blidar;
+            R_W_Lcol[c] = tf_W_Lcol.rot.toRotationMatrix().cast<float>();
+            p_W_Lcol[c] = tf_W_Lcol.pos.cast<float>();
+        }
+        else
+        {
+            // Outside of the IMU window, leave the points where the start pose puts them
+            R_W_Lcol[c] = tf_W_Lstart.rot.normalized().toRotationMatrix().cast<float>();
+            p_W_Lcol[c] = tf_W_Lstart.pos.cast<float>();
+        }
+    }
+}
+
+void DeskewPoints(const PointCompact *in, PointCompact *out, size_t N,
+                  const vector<Matrix3f> &R_W_Lcol, const vector<Vector3f> &p_W_Lcol, int threads)
+{
+    auto deskewPoint = [&](size_t i)
+    {
+        const PointCompact &pi = in[i];
+        PointCompact &po = out[i];
+
+        Vector3f pt = R_W_Lcol[pi.col]*Vector3f(pi.x, pi.y, pi.z) + p_W_Lcol[pi.col];
+        po.x = pt.x(); po.y = pt.y(); po.z = pt.z(); po.col = pi.col; po.pad = pi.pad;
+    };
+
+    // libgomp allocates a new team for every single-thread parallel region, so one thread runs it plainly.
+    // Static, like mem_placement::firstTouch, so each thread writes the pages that were placed on its node.
+    if (threads > 1)
+    {
+        #pragma omp parallel for schedule(static) num_threads(threads)
+        for(size_t i = 0; i < N; i++)
+            deskewPoint(i);
+    }
+    else
+        for(size_t i = 0; i < N; i++)
+            deskewPoint(i);
+}
+
+/* #endregion  Stages ---------------------------------------------------------------------------------------------*/
+
+/* #region  Trajectory and engine ---------------------------------------------------------------------------------*/
+
+void ImuTrajectory::extract(const ImuSeq &imuSeq, double tstart, double tend)
+{
+    ts.clear(); gyro.clear(); acce.clear();
+    q.clear(); p.clear(); v.clear();
+    decimation = ImuDecimation();
+    anchorRot = anchorPos = 0;
+    ExtractImuData(ts, gyro, acce, tstart, tend, imuSeq);
+    decimation.samplesIn = decimation.samplesOut = ts.size();
+}
+
+void ImuTrajectory::decimate(const ImuDecimationConfig &config)
+{
+    size_t N = ts.size();
+    decimation = ImuDecimation();
+    decimation.samplesIn = decimation.samplesOut = N;
+    if (!config.enabled || N < 3)
+        return;
+
+    // Rotation, velocity and position bounds accumulated over the steps
+    double dtheta = 0, dvel = 0, dpos = 0;
+
+    // Steps are written in place, step k starting at sample i always has k <= i
+    size_t k = 0, i = 0;
+    while (i < N - 1)
+    {
+        size_t j = i + 1;
+        while (j < N - 1 && (gyro[j] - gyro[i]).norm() <= config.gyroThreshold
+               && (acce[j] - acce[i]).norm() <= config.accThreshold && ts[j+1] - ts[i] <= config.maxStep)
+            j++;
+
+        // The step covers the intervals i to j - 1
+        double T = ts[j] - ts[i], wmax = 0, amax = 0;
+        Vector3d gsum = Vector3d::Zero(), asum = Vector3d::Zero();
+        for (size_t m = i; m < j; m++)
+        {
+            double dt = ts[m+1] - ts[m];
+            gsum += gyro[m]*dt; asum += acce[m]*dt;
+            wmax = max(wmax, gyro[m].norm()); amax = max(amax, acce[m].norm());
+        }
+
+        Vector3d gmean = T > 0 ? Vector3d(gsum/T) : gyro[i];
+        Vector3d amean = T > 0 ? Vector3d(asum/T) : acce[i];
+
+        // Errors of this step, then the earlier ones carried through it
+        bool merged = j > i + 1;
+        double stepRot = merged ? 0.5*wmax*config.gyroThreshold*T*T : 0.0;
+        double stepVel = merged ? 0.5*amax*wmax*T*T : 0.0;
+        double stepPos = merged ? config.accThreshold*T*T + amax*wmax*T*T*T/6 : 0.0;
+
+        dpos  += dvel*T + 0.5*amax*dtheta*T*T + stepPos;
+        dvel  += amax*dtheta*T + stepVel;
+        dtheta += stepRot;
+
+        ts[k] = ts[i]; gyro[k] = gmean; acce[k] = amean;
+        k++;
+        i = j;
+    }
+
+    ts[k] = ts[N-1]; gyro[k] = gyro[N-1]; acce[k] = acce[N-1];
+    k++;
+
+    ts.resize(k); gyro.resize(k); acce.resize(k);
+    decimation.samplesOut = k;
+    decimation.rotBound = dtheta;
+    decimation.posBound = dpos;
+}
+
+void ImuTrajectory::propagate(const OdomState &odom, const Vector3d &bg, const Vector3d &ba, const Vector3d &grav,
+                              pmr::memory_resource *scratch)
+{
+    q.clear(); p.clear(); v.clear();
+    PropagateIMU(odom, ts, gyro, acce, bg, ba, grav, q, p, v, scratch);
+}
+
+bool ImuTrajectory::anchor(const OdomState &end)
+{
+    size_t N = q.size();
+    if (N < 2 || !(ts.front() < end.t && end.t <= ts.back()))
+        return false;
+
+    // The propagated pose at end.t
+    size_t j = min(size_t(upper_bound(ts.begin(), ts.end(), end.t) - ts.begin()) - 1, N - 2);
+    double s = (end.t - ts[j])/(ts[j+1] - ts[j]);
+    Quaternd q_end = q[j].slerp(s, q[j+1]);
+    Vector3d p_end = (1 - s)*p[j] + s*p[j+1];
+
+    // Its error, the rotation in world frame
+    AngleAxisd dR(end.q*q_end.inverse());
+    Vector3d dp = end.p - p_end;
+    double T = end.t - ts.front();
+
+    for (size_t i = 1; i < N; i++)
+    {
+        double w = min((ts[i] - ts.front())/T, 1.0);
+        q[i] = Quaternd(AngleAxisd(w*dR.angle(), dR.axis()))*q[i];
+        q[i].normalize();
+        p[i] += w*dp;
+        if (ts[i] <= end.t)
+            v[i] += dp/T;
+    }
+
+    anchorRot = dR.angle();
+    anchorPos = dp.norm();
+    return true;
+}
+
+DeskewEngine::DeskewEngine(const DeskewEngineConfig &config, const mytf &tf_Bimu_Blidar)
+    : config(config), filter(config.filter), tf_Bimu_Blidar(tf_Bimu_Blidar)
+{
+    if (config.reservePoints > 0)
+        pointsPool.prefill(config.outputBuffers, [&config](PointCompactVec &points)
+        {
+            // Faulted in by the threads that deskew into it, see DeskewPoints
+            points.resize(config.reservePoints);
+            mem_placement::firstTouch(points.data(), points.size(), config.threads);
+            points.clear();
+        });
+}
+
+DeskewResult DeskewEngine::deskew(const CloudCompact &cloud, const OdomState &odom, const ImuTrajectory &traj,
+                                  bool wantImage, const Acquire &acquire, pmr::memory_resource *scratch)
+{
+    DeskewResult result;
+
+    mytf tf_W_Bstart = odom.tf();
+    mytf tf_W_Lstart = tf_W_Bstart*tf_Bimu_Blidar;
+
+    // All points of a column are fired at the same time, so the pose is interpolated once per column. The
+    // lidar-to-IMU extrinsic is folded into the column poses, the points stay in the lidar frame until deskewed.
+    int colsTotal = cloud.col_t.size();
+    ColumnPoses(cloud.col_t, odom.t, tf_W_Bstart, tf_Bimu_Blidar, traj.ts, traj.q, traj.p, R_W_Lcol, p_W_Lcol, scratch);
+
+    // Transform the points (which are in the L_ti frame) to world frame
+    auto deskewPoint = [this](const PointCompact &pi) -> Vector3f
+    {
+        return R_W_Lcol[pi.col]*Vector3f(pi.x, pi.y, pi.z) + p_W_Lcol[pi.col];
+    };
+
+    int pointsTotal = cloud.size();
+
+    // Organized scans can be deskewed as a rings x columns range image, keeping the organization of the cloud
+    int ringsTotal = cloud.height;
+    result.organized = config.organized && ringsTotal > 1 && (int)cloud.width == colsTotal
+                       && ringsTotal*colsTotal == pointsTotal;
+
+    if (filter.getConfig().enabled() && !result.organized)
+    {
+        // Crop and downsample in the same pass, the full resolution deskewed cloud is never put together
+        result.points = pointsPool.acquire();
+        result.srcIdx = srcIdxPool.acquire();
+        filter.apply(cloud.points, deskewPoint, *result.points, *result.srcIdx, config.threads);
+        result.size = result.points->size();
+        result.data = result.points->data();
+
+        PointCompact *buffer = acquire ? acquire(result.size) : nullptr;
+        if (buffer)
+        {
+            memcpy(buffer, result.points->data(), result.size*sizeof(PointCompact));
+            result.data = buffer;
+            result.inBuffer = true;
+        }
+        return result;
+    }
+
+    // Deskewing the points, straight into the acquired buffer if there is one
+    PointCompact *deskewed = acquire ? acquire(pointsTotal) : nullptr;
+    result.inBuffer = deskewed != nullptr;
+    if (!deskewed)
+    {
+        result.points = pointsPool.acquire();
+        result.points->resize(pointsTotal);
+        deskewed = result.points->data();
+    }
+    result.data = deskewed;
+    result.size = pointsTotal;
+
+    if (!result.organized)
+    {
+        DeskewPoints(cloud.points.data(), deskewed, pointsTotal, R_W_Lcol, p_W_Lcol, config.threads);
+        return result;
+    }
+
+    // The image ranges are from the lidar at scan start, rotating into its frame does not change them
+    Vector3f p_W_Lstart = tf_W_Lstart.pos.cast<float>();
+
+    if (wantImage)
+    {
+        result.rangeImage = imagePool.acquire();
+        result.rangeImage->resize(ringsTotal, colsTotal);
+    }
+    DeskewedRangeImage *rangeImage = result.rangeImage.get();
+
+    // The cloud is row-major and the images column-major. A block of columns is walked row by row, so the cloud
+    // is read and written in runs of kBlockCols points while the block's image columns are each filled in order.
+    const int kBlockCols = 32;
+    int blocksTotal = (colsTotal + kBlockCols - 1)/kBlockCols;
+
+    auto deskewBlock = [&](int b)
+    {
+        int cBegin = b*kBlockCols, cEnd = min(cBegin + kBlockCols, colsTotal);
+
+        for(int r = 0; r < ringsTotal; r++)
+        {
+            for(int c = cBegin; c < cEnd; c++)
+            {
+                int i = r*colsTotal + c;
+                const PointCompact &pi = cloud.points[i];
+                PointCompact &po = deskewed[i];
+
+                // No return, keep the slot in the organized cloud but mark it invalid
+                if (cloud.range[i] == 0)
+                {
+                    po.x = po.y = po.z = numeric_limits<float>::quiet_NaN(); po.col = pi.col; po.pad = pi.pad;
+                    if (wantImage) { rangeImage->range.column(c)[r] = 0; rangeImage->intensity.column(c)[r] = 0; }
+                    continue;
+                }
+
+                Vector3f pt = deskewPoint(pi);
+                po.x = pt.x(); po.y = pt.y(); po.z = pt.z(); po.col = pi.col; po.pad = pi.pad;
+
+                if (wantImage)
+                {
+                    rangeImage->range.column(c)[r] = (pt - p_W_Lstart).norm();
+                    rangeImage->intensity.column(c)[r] = cloud.intensity[i];
+                }
+            }
+        }
+    };
+
+    if (config.threads > 1)
+    {
+        #pragma omp parallel for num_threads(config.threads)
+        for(int b = 0; b < blocksTotal; b++)
+            deskewBlock(b);
+    }
+    else
+        for(int b = 0; b < blocksTotal; b++)
+            deskewBlock(b);
+
+    return result;
+}
+
+/* #endregion  Trajectory and engine ------------------------------------------------------------------------------*/
@@ -0,0 +1,81 @@
+/**
+* This file is part of oblam_deskew.
+*
+* One odometry/cloud pair through the pipeline: IMU window, bias estimate, propagation and deskewing. See
+* deskew_pipeline.h.
+*/
+
+#include <algorithm>
+
+#include "deskew_pipeline.h"
+
+using namespace std;
+using namespace Eigen;
+
+DeskewPipeline::Status DeskewPipeline::run(const OdomState &odom, const OdomState *odomNext, double cloudStamp,
+                                           const CloudCompact &cloud, DeskewResult &result, bool wantImage,
+                                           const DeskewEngine::Acquire &acquire)
+{
+    if (cloud.empty())
+        return EMPTY_CLOUD;
+
+    // The column times count from the cloud stamp, so the propagation and the deskewing have to start there
+    odomStart = odom;
+    if (odom.t != cloudStamp)
+        return ODOM_STAMP;
+
+    double start_time = odom.t;
+    double end_time = cloudStamp + *max_element(cloud.col_t.begin(), cloud.col_t.end())/1.0e9;
+
+    // The later anchor can be past the end of the scan, the window reaches it if the IMU already does
+    const OdomState *anchor = config.anchorBoth && odomNext && odomNext->t > start_time ? odomNext : nullptr;
+    double window_end = end_time;
+    if (anchor && anchor->t > end_time && anchor->t <= imuStore.backTime())
+        window_end = anchor->t;
+
+    // The window of the last scan goes with the arena
+    ImuSeq(&arena).swap(imuSeq);
+    arena.reset();
+
+    // Samples since the previous odometry for the bias estimator, the pruning below drops them
+    ImuSeq imuSeqSincePrev(&arena);
+    if (config.biasEstimation && hasPrevOdom)
+        imuSeqSincePrev = imuStore.window(prevOdom.t, start_time, &arena);
+
+    imuStore.prune(start_time);
+    imuSeq = imuStore.window(start_time, window_end, &arena);
+
+    if (imuSeq.size() < 2 || imuSeq.back().t < start_time)
+        return IMU_WINDOW;
+
+    // Extract IMU measurements from buffer and interpolate at the ends
+    imuTraj.extract(imuSeq, start_time, window_end);
+
+    // Gravity and biases, leveled on the first scan the sensor is still and then updated from each pair of
+    // consecutive odometry
+    if (!imuBiasEstimator.initialized())
+        imuBiasEstimator.initialize(odom.q, imuTraj.gyro, imuTraj.acce);
+    else if (imuSeqSincePrev.size() >= 3 && imuSeqSincePrev.front().t <= prevOdom.t
+             && start_time <= imuSeqSincePrev.back().t)
+    {
+        prevTraj.extract(imuSeqSincePrev, prevOdom.t, start_time);
+        imuBiasEstimator.update(prevOdom.q, prevOdom.v, odom.q, odom.v, prevTraj.ts, prevTraj.gyro, prevTraj.acce);
+    }
+    prevOdom = odom;
+    hasPrevOdom = true;
+
+    // Fewer, longer integration steps where the motion is smooth, the bias update above uses the full rate
+    imuTraj.decimate(config.decimation);
+
+    // Propagate the pose estimate using IMU
+    imuTraj.propagate(odom, imuBiasEstimator.gyroBias(), imuBiasEstimator.accBias(), imuBiasEstimator.gravity(), &arena);
+    if (anchor)
+        imuTraj.anchor(*anchor);
+
+    // Skip if the number of IMU samples is low
+    if (imuTraj.decimation.samplesIn < config.minImuSamples)
+        return SHORT_IMU;
+
+    result = deskewEngine.deskew(cloud, odom, imuTraj, wantImage, acquire, &arena);
+    return OK;
+}
@@ -2,6 +2,7 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <thread>
@@ -17,11 +18,6 @@
 #include <pcl/impl/pcl_base.hpp>
 #include <pcl/filters/filter.h>
 #include <pcl/filters/impl/filter.hpp>
-#include <pcl/filters/uniform_sampling.h>
-#include <pcl/filters/impl/uniform_sampling.hpp>
-#include <pcl/filters/impl/voxel_grid.hpp>
-#include <pcl/filters/crop_box.h>
-#include <pcl/filters/impl/crop_box.hpp>
 /* All needed for pointcloud manipulation -------------*/
 
 #include "std_msgs/Header.h"
@@ -36,8 +32,27 @@
 #include <message_filters/time_synchronizer.h>
 #include <message_filters/sync_policies/approximate_time.h>
 
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
 // Custom for package
 #include "utility.h"
+#include "async_publisher.h"
+#include "shm_cloud_ring.h"
+#include "fused_filter.h"
+#include "deskew_core.h"
+#include "deskew_pipeline.h"
+#include "odom_cloud_sync.h"
+#include "capture_file.h"
+#include "deskew_quality.h"
+#include "range_image.h"
+#include "scan_arena.h"
+#include "alloc_counter.h"
+#include "mem_placement.h"
+#include "pose_source_ros.h"
 
 /* #endregion HEADERS -----------------------------------------------------------------------------------------------*/
 
@@ -46,269 +61,283 @@ using namespace pcl;
 using namespace Eigen;
 using namespace message_filters;
 
-ros::NodeHandlePtr nh_ptr;
-
 typedef lock_guard<mutex> mylg;
 typedef sensor_msgs::Imu ImuMsg;
 typedef nav_msgs::Odometry OdomMsg;
 typedef sensor_msgs::PointCloud2 CloudMsg;
 typedef sensor_msgs::Imu::ConstPtr ImuMsgPtr;
 typedef nav_msgs::Odometry::ConstPtr OdomMsgPtr;
+typedef std::shared_ptr<OdomState> OdomStatePtr;
 typedef sensor_msgs::PointCloud2::ConstPtr CloudMsgPtr;
 
-mutex imu_mtx;
-deque<ImuMsgPtr> imu_buf;
-
-mutex oc_mtx;
-deque<pair<OdomMsgPtr, CloudMsgPtr>> oc_buf;
-
-std::deque<OdomMsgPtr> odom_buf;
-CloudMsgPtr cloud_hold;
-
-// An intrinsic
-myTf tf_Bimu_Blidar;
-
-// Publishers
-ros::Publisher distortedCloudPub;          // Publishing the distorted pointcloud in world
-ros::Publisher imuPropDeskewedCloudPub;    // Publishing the deskewed pointcloud from imu propagation
-
 template<typename T>
 double msgTimestamp(T msg) { return msg->header.stamp.toSec(); }
 
-void imuCallback(const ImuMsgPtr &imuMsg)
+namespace oblam_deskew
 {
-    mylg lock(imu_mtx);
-    imu_buf.push_back(imuMsg);
-}
 
-void odomCloudCallback(const OdomMsgPtr odomMsg, const CloudMsgPtr cloudMsg)
+// The deskew node as a nodelet. Loaded into the same manager as the Ouster driver and the downstream consumers,
+// clouds are passed around as shared pointers and never serialized. The standalone oblam_deskew_node loads it too.
+// The deskewing itself is done by the ROS-free core (deskew_core.h), this class pairs the messages, converts them
+// and publishes the results.
+class OblamDeskewNodelet : public nodelet::Nodelet
 {
-    static int skip = 10; // Skip a few pointclouds
-    if (skip > 0) { skip--; return; }
-    ROS_ASSERT(msgTimestamp(odomMsg) <= msgTimestamp(cloudMsg));
-    //ROS_INFO("Received odom/cloud pair (skip=%d)", skip);
-    oc_buf.push_back(make_pair(odomMsg, cloudMsg));    
-}
+public:
 
-void matchOdomCloud() {
-    mylg lock(oc_mtx); 
+    ~OblamDeskewNodelet();
 
-    // Find odometry message right before cloud, remove as you go
-    double t = msgTimestamp(cloud_hold);
+private:
 
-    // Prune while odom_buf[1] <= t.
-    while ((2 <= odom_buf.size()) && (msgTimestamp(odom_buf[1]) <= t))
-        odom_buf.pop_front();
+    void onInit() override;
 
-    // We have a pair if the first odom is before t and the next odom is beyond t.
-    if ((2 <= odom_buf.size()) && (msgTimestamp(odom_buf[0]) <= t) && (t <= msgTimestamp(odom_buf[1]))) {
-        odomCloudCallback(odom_buf.front(), cloud_hold);
-        cloud_hold = nullptr;
-    }
-}
+    void imuCallback(const ImuMsgPtr &imuMsg);
+    void poseCallback(const OdomState &odom);
+    void cloudCallback(const CloudMsgPtr &msg);
+    void warnCaptureDrop();
+    bool hasData();
 
-void odomCallback(const OdomMsg &msg){
-    //printf("odom %.3f\n", msgTimestamp(&msg));
-    odom_buf.push_back(OdomMsgPtr(new OdomMsg(msg)));
-    if (cloud_hold)
-        matchOdomCloud();
-}
+    void publishDeskewed(const CloudCompactPtr &cloudSkewed, const OdomState &odom_W_Bstart, const ros::Time &stamp,
+                         const DeskewResult &deskewed, const ShmCloudWriter::Frame &shmFrame);
+    void loadExtrinsic();
+    void processData();
 
-void cloudCallback(const CloudMsg &msg){
-    if (cloud_hold)
-        ROS_WARN("Throwing away a pointcloud");
-    cloud_hold = CloudMsgPtr(new CloudMsg(msg));
-    if (!odom_buf.empty())
-        matchOdomCloud();
-}
+    // Pairs each cloud with the odometry before it, skipping a few pointclouds at startup
+    OdomCloudSync<OdomStatePtr, CloudMsgPtr> odomCloudSync;
 
-bool hasData()
-{
-    if (oc_buf.empty()) {
-        ROS_WARN_THROTTLE(1.0, "hasData: Odom/Cloud buffer empty");
-        return false;
-    }
+    // The odometry from the EKF, a ground-truth pose topic, TF or file, see pose_source_ros.h
+    std::unique_ptr<PoseSource> poseSource;
 
-    if (imu_buf.empty()) {
-        ROS_WARN_THROTTLE(1.0, "hasData: IMU buffer empty");
-        return false;
-    }
+    int cloudCount = -1;
 
+    // The lidar-to-IMU extrinsic of the engine, from /tf_static if available
+    string imuFrame, lidarFrame;
 
-    if (msgTimestamp(oc_buf.front().first) < msgTimestamp(imu_buf.front()))
-    {
-        mylg lock(oc_mtx);
-        oc_buf.pop_front();
-        ROS_WARN("Deleting stale odom/cloud pair");
-        return false;
-    }
+    // Frame the deskewed clouds are published in, on ROS and in shared memory alike
+    string deskewedFrame;
+    bool extrinsicFromTf = true;
+    double extrinsicTimeout = 5.0;
 
-    if (msgTimestamp(oc_buf.front().second) + 0.125 > msgTimestamp(imu_buf.back())) {
-        ROS_WARN_THROTTLE(1.0, "hasData: IMU buffer doesn't propagate far enough to cover entire point cloud");
-        return false;
-    }
+    // IMU store, bias estimation, propagation and deskewing, see deskew_pipeline.h
+    std::unique_ptr<DeskewPipeline> pipeline;
 
-    return true;
-}
+    // NUMA node the processing thread and its OpenMP threads run on, -1 for no binding
+    int numaNode = -1;
 
-void ExtractImuData( vector<double> &ts, vector<Vector3d> &gyro, vector<Vector3d> &acce,
-                     double tstart, double tend, const deque<ImuMsgPtr> &imuSeq)
-{
-    int Nend = imuSeq.size() - 2;
-    for(int i = 0; i <= Nend; i++)
-    {
-        if (i == 0)
-        {
-            Vector3d gyro_tB(imuSeq[i]->angular_velocity.x, imuSeq[i]->angular_velocity.y, imuSeq[i]->angular_velocity.z);
-            Vector3d gyro_tE(imuSeq[i+1]->angular_velocity.x, imuSeq[i+1]->angular_velocity.y, imuSeq[i+1]->angular_velocity.z);
-            
-            Vector3d acce_tB(imuSeq[i]->linear_acceleration.x, imuSeq[i]->linear_acceleration.y, imuSeq[i]->linear_acceleration.z);
-            Vector3d acce_tE(imuSeq[i+1]->linear_acceleration.x, imuSeq[i+1]->linear_acceleration.y, imuSeq[i+1]->linear_acceleration.z);
+    // Subscribers
+    ros::Subscriber imuSub;
+    ros::Subscriber cloudSub;
 
-            double tB = imuSeq[i]->header.stamp.toSec(); double tE = imuSeq[i+1]->header.stamp.toSec();
-            double s  = (tstart - tB)/(tE - tB);
+    // Publishers
+    ros::Publisher distortedCloudPub;          // Publishing the distorted pointcloud in world
+    ros::Publisher imuPropDeskewedCloudPub;    // Publishing the deskewed pointcloud from imu propagation
+    ros::Publisher rangeImagePub;              // Deskewed range image, organized mode only
+    ros::Publisher intensityImagePub;          // Deskewed intensity image, organized mode only
+    ros::Publisher qualityPub;                 // Seam RMS, seam points, plane thickness, planes of each scan
 
-            Vector3d gyro_ts = (1-s)*gyro_tB + s*gyro_tE;
-            Vector3d acce_ts = (1-s)*acce_tB + s*acce_tE;
+    // Buffers recycled from scan to scan: the unpacked clouds and the ROS copies of the deskewed points are taken
+    // on the processing thread, the outgoing messages and the distorted cloud on the publisher thread. Declared
+    // before cloudPublisher, whose queued jobs use them until it is gone.
+    RecyclePool<CloudCompact> cloudPool{16};
+    RecyclePool<PointCompactVec> rosCopyPool{8};
+    RecyclePool<CloudMsg, CloudMsg::Ptr> cloudMsgPool{8};
+    PointCompactVec distortedScratch;
 
-            ts.push_back(tstart);
-            gyro.push_back(gyro_ts);
-            acce.push_back(acce_ts);
-        }
-        else if (i == Nend)
-        {
-            Vector3d gyro_tB(imuSeq[i]->angular_velocity.x, imuSeq[i]->angular_velocity.y, imuSeq[i]->angular_velocity.z);
-            Vector3d gyro_tE(imuSeq[i+1]->angular_velocity.x, imuSeq[i+1]->angular_velocity.y, imuSeq[i+1]->angular_velocity.z);
+    // Serialization and publishing of the clouds happens here, off the processing thread
+    AsyncPublisher cloudPublisher;
 
-            Vector3d acce_tB(imuSeq[i]->linear_acceleration.x, imuSeq[i]->linear_acceleration.y, imuSeq[i]->linear_acceleration.z);
-            Vector3d acce_tE(imuSeq[i+1]->linear_acceleration.x, imuSeq[i+1]->linear_acceleration.y, imuSeq[i+1]->linear_acceleration.z);
+    // Quality of each deskewed scan, computed if quality_metric is set or /deskew_quality has a subscriber
+    DeskewQualityMetric qualityMetric;
+    bool qualityMetricOn = false;
 
-            double tB = imuSeq[i]->header.stamp.toSec(); double tE = imuSeq[i+1]->header.stamp.toSec();
-            double s  = (tend - tB)/(tE - tB);
+    // Optional shared-memory output for co-located non-ROS consumers
+    string shmName;
+    std::unique_ptr<ShmCloudWriter> shmWriter;
 
-            Vector3d gyro_ts = (1-s)*gyro_tB + s*gyro_tE;
-            Vector3d acce_ts = (1-s)*acce_tB + s*acce_tE;
+    // Optional capture of the inputs with their arrival times, for oblam_deskew_replay
+    std::unique_ptr<CaptureWriter> captureWriter;
 
-            ts.push_back(tend);
-            gyro.push_back(gyro_ts);
-            acce.push_back(acce_ts);
-        }
-        else
-        {
-            Vector3d gyro_ts(imuSeq[i]->angular_velocity.x, imuSeq[i]->angular_velocity.y, imuSeq[i]->angular_velocity.z);
-            Vector3d acce_ts(imuSeq[i]->linear_acceleration.x, imuSeq[i]->linear_acceleration.y, imuSeq[i]->linear_acceleration.z);
+    atomic<bool> running{false};
+    thread processDataThread;
+};
 
-            ts.push_back(imuSeq[i]->header.stamp.toSec());
-            gyro.push_back(gyro_ts);
-            acce.push_back(acce_ts);
-        }
-    }
+void OblamDeskewNodelet::imuCallback(const ImuMsgPtr &imuMsg)
+{
+    ImuSample sample = Util::toImuSample(*imuMsg);
+    if (captureWriter && !captureWriter->imu(sample))
+        warnCaptureDrop();
+    if (!pipeline->imu().push(sample))
+        ROS_WARN_THROTTLE(1.0, "IMU sample at %.3f is not after the last one, dropped. %lu so far.",
+                          sample.t, pipeline->imu().dropped());
+}
+
+void OblamDeskewNodelet::poseCallback(const OdomState &odom){
+    //printf("odom %.3f\n", odom.t);
+    if (captureWriter && !captureWriter->odom(odom))
+        warnCaptureDrop();
+    odomCloudSync.pushOdom(odom.t, std::make_shared<OdomState>(odom));
 }
 
-void PropagateIMU(const OdomMsgPtr &odom,
-                  const vector<double> &ts, const vector<Vector3d> &gyro_, const vector<Vector3d> &acce_,
-                  vector<Quaternd> &q, vector<Vector3d> &p, vector<Vector3d> &v)
-{   
-    // Some constant guestimated from SLICT experiment
-    static Vector3d grav(9.82, 0, 0); static Vector3d bg(-0.022, -0.033, 0.004); static Vector3d ba(0.0, 0, 0.1);
-
-    // Initial state
-    q.push_back(Quaternd(odom->pose.pose.orientation.w,
-                         odom->pose.pose.orientation.x, odom->pose.pose.orientation.y, odom->pose.pose.orientation.z));
-    p.push_back(Vector3d(odom->pose.pose.position.x, odom->pose.pose.position.y, odom->pose.pose.position.z));
-    v.push_back(q.back()*Vector3d(odom->twist.twist.linear.x, odom->twist.twist.linear.y, odom->twist.twist.linear.z));
-
-    // Initial measurement
-    double to = ts.front(); Vector3d gyro = gyro_.front(); Vector3d acco = acce_.front();
-    Quaternd Qo = q.back(); Vector3d Po = p.back(); Vector3d Vo = v.back();
-
-    // Propagation using euler method
-    for(int i = 1; i < ts.size(); i++)
+void OblamDeskewNodelet::cloudCallback(const CloudMsgPtr &msg){
+    // Stamped with its arrival here, unpacked and written on the capture thread
+    if (captureWriter && !captureWriter->cloud(msgTimestamp(msg), msg->data.size(),
+                                               [msg](CloudCompact &cloud) { Util::fromROSMsg(*msg, cloud, 1); }))
+        warnCaptureDrop();
+    poseSource->onCloud(msgTimestamp(msg));
+    if (!odomCloudSync.pushCloud(msgTimestamp(msg), msg))
+        ROS_WARN("Throwing away a pointcloud");
+}
+
+void OblamDeskewNodelet::warnCaptureDrop()
+{
+    ROS_WARN_THROTTLE(1.0, "Capture writer behind, input records dropped from the capture. %lu so far.",
+                      captureWriter->dropped());
+}
+
+bool OblamDeskewNodelet::hasData()
+{
+    switch (odomCloudSync.check(pipeline->imu()))
     {
-        double tn = ts[i]; Vector3d gyrn = gyro_[i]; Vector3d accn = acce_[i];
-        
-        /* ASSIGNMENT BLOCK START -----------------------------------------------------------------------------------*/
-        
-        // Propagate the poses by updating Qn, Vn, Pn below.
-        // NOTE: you may need to use the function deltaQ(theta) in file include/utility.h to update quaternion.
-
-        Quaternd Qn = Qo;   // Change Qn to the IMU propagated quaternion
-        Vector3d Vn = Vo;   // Change Vn to the IMU propagated velocity
-        Vector3d Pn = Po;   // Change Pn to the IMU propagated position
-
-        /* ASSIGNMENT BLOCK END -------------------------------------------------------------------------------------*/
-
-        // Store the data
-        q.push_back(Qn); p.push_back(Pn); v.push_back(Vn);
-        to = tn; gyro = gyrn; acco = accn; Qo = q.back(); Po = p.back(); Vo = v.back();
+        case OdomCloudSync<OdomStatePtr, CloudMsgPtr>::READY:
+            return true;
+        case OdomCloudSync<OdomStatePtr, CloudMsgPtr>::NO_PAIR:
+            ROS_WARN_THROTTLE(1.0, "hasData: Odom/Cloud buffer empty");
+            return false;
+        case OdomCloudSync<OdomStatePtr, CloudMsgPtr>::NO_IMU:
+            ROS_WARN_THROTTLE(1.0, "hasData: IMU buffer empty");
+            return false;
+        case OdomCloudSync<OdomStatePtr, CloudMsgPtr>::STALE:
+            ROS_WARN("Deleting stale odom/cloud pair");
+            return false;
+        case OdomCloudSync<OdomStatePtr, CloudMsgPtr>::IMU_BEHIND:
+            ROS_WARN_THROTTLE(1.0, "hasData: IMU buffer doesn't propagate far enough to cover entire point cloud");
+            return false;
     }
+    return false;
 }
 
-void DeskewByImuPropagation(const CloudOusterPtr &cloudSkewed, const OdomMsgPtr &odom_W_Bstart,
-                            vector<double> &ts, vector<Quaternd> &q_W_Bs, vector<Vector3d> &p_W_Bs)
+void OblamDeskewNodelet::publishDeskewed(const CloudCompactPtr &cloudSkewed, const OdomState &odom_W_Bstart,
+                                         const ros::Time &stamp, const DeskewResult &deskewed,
+                                         const ShmCloudWriter::Frame &shmFrame)
 {
-    // Skip if the number of IMU samples is low
-    if (ts.size() < 8) {
-        ROS_WARN("Short/empty IMU sequence, ignoring");
-        return;
-    }
+    mytf tf_W_Bstart = odom_W_Bstart.tf();
+    int colsTotal = cloudSkewed->col_t.size();
 
-    double tstart = odom_W_Bstart->header.stamp.toSec();
-    double tend = tstart + cloudSkewed->points.back().t*1e-9;
-    ROS_ASSERT(ts[0] <= tstart);
-    ROS_ASSERT(tend <= ts[ts.size()-1]);
-
-    mytf tf_W_Bstart(*odom_W_Bstart);
-    
-    // Skewed cloud in world frame
-    CloudOusterPtr cloudSkewedInWorld(new CloudOuster());
-    pcl::transformPointCloud(*cloudSkewed, *cloudSkewedInWorld, tf_W_Bstart.cast<float>().tfMat());
-    
-    // Deskewing the points
-    CloudOusterPtr cloudDeskewedInWorld(new CloudOuster());
-
-    // Pre-allocate the elements of clouDeskewed
-    int pointsTotal = cloudSkewed->size(); cloudDeskewedInWorld->resize(pointsTotal);
-
-    // Convert points into world frame
-    #pragma omp parallel for num_threads(MAX_THREADS)
-    for(int i = 0; i < pointsTotal; i++)
-    {
-        PointOuster &pi = cloudSkewed->points[i];
-        PointOuster &po = cloudDeskewedInWorld->points[i];
+    bool toRos = imuPropDeskewedCloudPub.getNumSubscribers() != 0;
 
-        po = cloudSkewedInWorld->points[i]; // Initialize the output point with skewed pointcloud for visualization
+    int pointsTotal = deskewed.size;
+    bool organized = deskewed.organized;
+    bool toShm = deskewed.inBuffer;
+    std::shared_ptr<PointCompactVec> cloudDeskewedInWorld = deskewed.points;
+    std::shared_ptr<vector<uint32_t>> srcIdx = deskewed.srcIdx;
+    std::shared_ptr<DeskewedRangeImage> rangeImage = deskewed.rangeImage;
+    const PointCompact *deskewedOut = deskewed.data;
 
-        // Sample time of the point
-        double ti = tstart + pi.t/1.0e9;
-        
-        /* ASSIGNMENT BLOCK START -----------------------------------------------------------------------------------*/
+    if (toShm)
+    {
+        if (srcIdx)
+            for(int i = 0; i < pointsTotal; i++)
+                shmFrame.intensity[i] = cloudSkewed->intensity[(*srcIdx)[i]];
+        else
+            memcpy(shmFrame.intensity, cloudSkewed->intensity.data(), pointsTotal*sizeof(float));
 
-            // Step 1: Find the j such that ts[j] < ti < ts[j+1], where ti is the point sample time, ts[j] is the IMU sample time
-            int j = -1; // Change j
+        // The slot is only reused after slotCount more scans, but the ROS output must not depend on that
+        if (toRos && !cloudDeskewedInWorld)
+        {
+            cloudDeskewedInWorld = rosCopyPool.acquire();
+            cloudDeskewedInWorld->assign(deskewedOut, deskewedOut + pointsTotal);
+        }
+    }
 
-            if (j >= 0)
-            {
-                // Step 2: Find the linear interpolated pose (q_ti, p_ti)
-                // Note: look up https://eigen.tuxfamily.org/dox/classEigen_1_1QuaternionBase.html#ac840bde67d22f2deca330561c65d144e
+    // Quality of the deskewed scan, on the output points before the shared-memory slot is handed over
+    if (qualityMetricOn || qualityPub.getNumSubscribers() != 0)
+    {
+        auto tic = chrono::steady_clock::now();
+        DeskewQuality quality = qualityMetric.compute(deskewedOut, pointsTotal, colsTotal);
+        double qualityMs = chrono::duration<double, milli>(chrono::steady_clock::now() - tic).count();
 
-                // Step 3: Transform the point pi (which is in B_ti frame) to world frame. Assign the value to the variable po
-                // Note: Eigen supports the operation Vector3d = Quaternion*Vector.
+        std_msgs::Float64MultiArray::Ptr qualityMsg(new std_msgs::Float64MultiArray());
+        qualityMsg->data = {quality.seamRms, double(quality.seamPoints), quality.thickness, double(quality.planes)};
+        qualityPub.publish(qualityMsg);
 
-            }
+        printf("Deskew quality. Seam: %.4f m (%d pts). Thickness: %.4f m (%d planes). Time: %.3f ms\n",
+               quality.seamRms, quality.seamPoints, quality.thickness, quality.planes, qualityMs);
+    }
 
-        /* ASSIGNMENT BLOCK END -------------------------------------------------------------------------------------*/
+    if (toShm)
+    {
+        double pose[7] = {tf_W_Bstart.pos.x(), tf_W_Bstart.pos.y(), tf_W_Bstart.pos.z(),
+                          tf_W_Bstart.rot.x(), tf_W_Bstart.rot.y(), tf_W_Bstart.rot.z(), tf_W_Bstart.rot.w()};
+        shmWriter->commit(pointsTotal, stamp.toNSec(), deskewedFrame, pose);
+    }
+    else if (shmWriter)
+        ROS_WARN_THROTTLE(1.0, "Scan of %d points exceeds the shared-memory slot capacity %u, not written to %s",
+                          pointsTotal, shmWriter->capacity(), shmName.c_str());
 
-        po.intensity = pi.intensity; po.t = pi.t; po.reflectivity = pi.reflectivity;
+    // Publish the pointcloud, the full point type is only put together if someone is listening
+    if (toRos)
+    {
+        cloudPublisher.post([this, cloudDeskewedInWorld, srcIdx, cloudSkewed, stamp, organized]()
+        {
+            CloudMsg::Ptr msg = cloudMsgPool.acquire();
+            Util::toROSMsg(cloudDeskewedInWorld->data(), cloudDeskewedInWorld->size(), *cloudSkewed, srcIdx.get(), *msg);
+            msg->is_dense = !organized;     // Organized clouds carry NaNs for the missing returns
+            msg->header.stamp = stamp;
+            msg->header.frame_id = deskewedFrame;
+            imuPropDeskewedCloudPub.publish(msg);
+        });
     }
 
-    // Publish the pointcloud
-    Util::publishCloud(imuPropDeskewedCloudPub, *cloudDeskewedInWorld, odom_W_Bstart->header.stamp, "world_shifted");
+    // Range and intensity images, in the frame of the lidar at scan start
+    if (rangeImage)
+    {
+        string frame = lidarFrame;
+        cloudPublisher.post([rpub = rangeImagePub, ipub = intensityImagePub, rangeImage, stamp, frame]() mutable
+        {
+            Util::publishImage(rpub, rangeImage->range, stamp, frame);
+            Util::publishImage(ipub, rangeImage->intensity, stamp, frame);
+        });
+    }
 }
 
-void processData()
+void OblamDeskewNodelet::loadExtrinsic()
 {
-    while(ros::ok())
+    if (!extrinsicFromTf)
+        return;
+
+    // Static transforms are latched, so waiting a little for them is enough
+    tf2_ros::Buffer tfBuffer;
+    tf2_ros::TransformListener tfListener(tfBuffer);
+    try
+    {
+        geometry_msgs::TransformStamped tf_msg
+            = tfBuffer.lookupTransform(imuFrame, lidarFrame, ros::Time(0), ros::Duration(extrinsicTimeout));
+        const geometry_msgs::Transform &T = tf_msg.transform;
+        mytf tf_Bimu_Blidar(Quaternd(T.rotation.w, T.rotation.x, T.rotation.y, T.rotation.z).normalized(),
+                            Vector3d(T.translation.x, T.translation.y, T.translation.z));
+        pipeline->engine().setExtrinsic(tf_Bimu_Blidar);
+        printf("Extrinsic %s -> %s from tf. XYZ: %.3f, %.3f, %.3f. YPR: %.2f, %.2f, %.2f\n",
+               imuFrame.c_str(), lidarFrame.c_str(),
+               tf_Bimu_Blidar.pos.x(), tf_Bimu_Blidar.pos.y(), tf_Bimu_Blidar.pos.z(),
+               tf_Bimu_Blidar.yaw(), tf_Bimu_Blidar.pitch(), tf_Bimu_Blidar.roll());
+    }
+    catch (const tf2::TransformException &ex)
+    {
+        ROS_WARN("No transform %s -> %s on tf (%s), using the default extrinsic", imuFrame.c_str(), lidarFrame.c_str(), ex.what());
+    }
+}
+
+void OblamDeskewNodelet::processData()
+{
+    // Before the first parallel region, the OpenMP threads of this thread inherit the binding
+    if (numaNode >= 0 && !mem_placement::bindToNode(numaNode))
+        ROS_ERROR("Cannot bind the processing thread to NUMA node %d", numaNode);
+
+    // Done here rather than in onInit, which should not block the nodelet manager
+    loadExtrinsic();
+    if (captureWriter)
+        captureWriter->extrinsic(pipeline->engine().extrinsic());
+
+    while(ros::ok() && running)
     {
         // Check if there is data
         if(!hasData())
@@ -318,146 +347,349 @@ void processData()
             continue;
         }
 
-        OdomMsgPtr odom;
-        CloudMsgPtr cloudMsg;
         // Pop the data
-        { mylg lock(oc_mtx);
-          std::tie(odom, cloudMsg) = oc_buf.front();
-          oc_buf.pop_front(); }
-
-        CloudOusterPtr cloud(new CloudOuster());
-        pcl::fromROSMsg(*cloudMsg, *cloud);
-
-        // Convert cloud to body frame
-        pcl::transformPointCloud(*cloud, *cloud, tf_Bimu_Blidar.cast<float>().tfMat());
-
-        double start_time = odom->header.stamp.toSec();
-        double end_time = cloudMsg->header.stamp.toSec() + cloud->points.back().t/1.0e9;
+        OdomStatePtr odom, odomNext;
+        CloudMsgPtr cloudMsg;
+        if (!odomCloudSync.pop(odom, odomNext, cloudMsg))
+            continue;
 
-        //for(unsigned int i = 1; i < imu_buf.size(); i++)
-        //    ROS_ASSERT(imu_buf[i]->header.stamp.toSec() > imu_buf[i-1]->header.stamp.toSec());
+        uint64_t allocStart = AllocCounter::thread();
 
+        CloudCompactPtr cloud = cloudPool.acquire();
+        Util::fromROSMsg(*cloudMsg, *cloud);
 
-        deque<ImuMsgPtr> imuSeq;
+        // Deskewing the points straight into the shared-memory ring when it is enabled and the scan fits a slot
+        ShmCloudWriter::Frame shmFrame;
+        auto acquireShm = [this, &shmFrame](size_t N) -> PointCompact *
         {
-            mylg lock(imu_mtx); 
-            while (2 <= imu_buf.size() && msgTimestamp(imu_buf[1]) <= start_time)
-                imu_buf.pop_front();
+            if (!shmWriter || N > shmWriter->capacity())
+                return nullptr;
+            shmFrame = shmWriter->begin();
+            return shmFrame.points;
+        };
+        bool toImage = rangeImagePub.getNumSubscribers() != 0 || intensityImagePub.getNumSubscribers() != 0;
+
+        DeskewResult deskewed;
+        DeskewPipeline::Status status
+            = pipeline->process(*odom, *odomNext, msgTimestamp(cloudMsg), *cloud, deskewed, toImage, acquireShm);
+
+        if (status == DeskewPipeline::EMPTY_CLOUD) {
+            ROS_WARN("Empty pointcloud, ignoring");
+            continue;
+        }
 
-            for (const auto& sample : imu_buf)
-            {
-                imuSeq.push_back(sample);
-                if (end_time < msgTimestamp(sample))
-                    break;
-            }
+        // The pose at the cloud stamp, interpolated between the odometries around it
+        const OdomState &odomState = pipeline->startOdom();
+
+        if (status == DeskewPipeline::ODOM_STAMP) {
+            ROS_WARN("Cloud at %.3f is not between the odometry at %.3f and %.3f, ignoring",
+                     msgTimestamp(cloudMsg), odom->t, odomNext->t);
+            continue;
         }
 
-        if ((imuSeq.size() < 2) || imuSeq.back()->header.stamp.toSec() < start_time) {
+        double start_time = odomState.t;
+        double end_time = msgTimestamp(cloudMsg) + *max_element(cloud->col_t.begin(), cloud->col_t.end())/1.0e9;
+        const ImuSeq &imuSeq = pipeline->window();
+        const ImuStore &imuStore = pipeline->imu();
+
+        if (status == DeskewPipeline::IMU_WINDOW) {
             ROS_WARN_THROTTLE(1.0,
                               ("Pointcloud timestamp outside of IMU buffer "
                                "window. Cloud: %.3f -> %.3f, IMU buffer: %.3f "
-                               "-> %.3f, imu_buf.size() = %lu, imuSeq.size() = "
+                               "-> %.3f, imuStore.size() = %lu, imuSeq.size() = "
                                "%lu"),
                              start_time,
                              end_time,
-                             imu_buf.front()->header.stamp.toSec(),
-                             imu_buf.back()->header.stamp.toSec(),
-                             imu_buf.size(),
+                             imuStore.frontTime(),
+                             imuStore.backTime(),
+                             imuStore.size(),
                              imuSeq.size());
             continue;
         }
 
-        // Check ordering consistency
-        ROS_ASSERT(imuSeq.size() > 1);
-        for(unsigned int i = 1; i < imuSeq.size(); i++)
-            ROS_ASSERT(imuSeq[i]->header.stamp.toSec() > imuSeq[i-1]->header.stamp.toSec());
-
         // Write a report
-        static int cloudCount = -1; cloudCount++;
+        cloudCount++;
         printf(("Count %3d, %3d. Odom: %.3f. "
                 "Cloud: %.3f -> %.3f. "
                 "Imu: %lu, %.3f -> %.3f. "
                 "Buf: OC: %3lu. Imu: %lu\n"),
-                cloudCount, cloudMsg->header.seq, odom->header.stamp.toSec(),
+                cloudCount, cloudMsg->header.seq, odom->t,
                 start_time, end_time,
-                imuSeq.size(), imuSeq.front()->header.stamp.toSec(), imuSeq.back()->header.stamp.toSec(),
-                oc_buf.size(), imu_buf.size());
-        int imuCount = -1; imuCount++;
-        // for (auto &imuSample : imuSeq)
-        //     printf("IMU %d. Time: %.3f\n", imuCount++, imuSample->header.stamp.toSec());        
-
-        // Transform the pointcloud to world frame
-        myTf tf_W_Blidar(*odom);
-        CloudOusterPtr distortedCloudInW(new CloudOuster());
-        pcl::transformPointCloud(*cloud, *distortedCloudInW, tf_W_Blidar.cast<float>().tfMat());
-
-        // Publish the distorted pointcloud for vizualization
-        Util::publishCloud(distortedCloudPub, *distortedCloudInW, ros::Time(start_time), "world");
-
-        // Extract IMU measurements from buffer and interpolate at the ends
-        vector<double> ts; vector<Vector3d> gyro, acce;
-        ExtractImuData(ts, gyro, acce, start_time, end_time, imuSeq);
-
-        // Propagate the pose estimate using IMU
-        vector<Quaternd> q_W_Bs; vector<Vector3d> p_W_Bs, v_W_Bs;
-        PropagateIMU(odom, ts, gyro, acce, q_W_Bs, p_W_Bs, v_W_Bs);
+                imuSeq.size(), imuSeq.front().t, imuSeq.back().t,
+                odomCloudSync.pending(), imuStore.size());
+
+        // The distorted pointcloud in world is only for vizualization, it is not even computed without a subscriber
+        if (distortedCloudPub.getNumSubscribers() != 0)
+        {
+            Matrix4f tfm_W_Blidar = (odomState.tf()*pipeline->engine().extrinsic()).cast<float>().tfMat();
+            cloudPublisher.post([this, cloud, tfm_W_Blidar, start_time]()
+            {
+                // Transform the pointcloud to world frame
+                Util::transformCloud(cloud->points, distortedScratch, tfm_W_Blidar);
+
+                CloudMsg::Ptr msg = cloudMsgPool.acquire();
+                Util::toROSMsg(distortedScratch.data(), distortedScratch.size(), *cloud, nullptr, *msg);
+                msg->is_dense = true;
+                msg->header.stamp = ros::Time(start_time);
+                msg->header.frame_id = "world";
+                distortedCloudPub.publish(msg);
+            });
+        }
+
+        const ImuBiasEstimator &imuBiasEstimator = pipeline->biasEstimator();
+        const Vector3d &bg = imuBiasEstimator.gyroBias(), &ba = imuBiasEstimator.accBias(), &grav = imuBiasEstimator.gravity();
+        if (!imuBiasEstimator.initialized())
+            ROS_WARN_THROTTLE(5.0, "IMU bias estimation waiting for the sensor to be still. Grav: %.3f, %.3f, %.3f",
+                              grav.x(), grav.y(), grav.z());
+        else
+            ROS_INFO_THROTTLE(5.0, "IMU bias estimate, %d updates. Gyro: %.4f, %.4f, %.4f. Acc: %.3f, %.3f, %.3f. Grav: %.3f, %.3f, %.3f",
+                              imuBiasEstimator.updates(), bg.x(), bg.y(), bg.z(), ba.x(), ba.y(), ba.z(), grav.x(), grav.y(), grav.z());
+
         // Report on the propagated pose
-        for (int i = 0; i < ts.size(); i++)
+        const ImuTrajectory &imuTraj = pipeline->trajectory();
+        const ImuDecimation &dec = imuTraj.decimation;
+        if (pipeline->getConfig().decimation.enabled)
+            ROS_INFO_THROTTLE(5.0, "IMU decimation: %lu of %lu samples integrated. Error bound: %.2e rad, %.2e m",
+                              dec.samplesOut, dec.samplesIn, dec.rotBound, dec.posBound);
+        if (pipeline->getConfig().anchorBoth)
+            ROS_INFO_THROTTLE(5.0, "Anchored at the next odometry, correction: %.2e rad, %.2e m",
+                              imuTraj.anchorRot, imuTraj.anchorPos);
+        for (int i = 0; i < imuTraj.size(); i++)
         {
-            myTf tf_W_Bs(q_W_Bs[i], p_W_Bs[i]);
+            myTf tf_W_Bs(imuTraj.q[i], imuTraj.p[i]);
             printf("IMU prop %2d. Time: %.3f. YPR: %8.3f, %8.3f, %8.3f. XYZ: %.3f, %.3f, %.3f.\n",
-                    i, ts[i],
+                    i, imuTraj.ts[i],
                     tf_W_Bs.yaw(), tf_W_Bs.pitch(), tf_W_Bs.roll(),
                     tf_W_Bs.pos.x(), tf_W_Bs.pos.y(), tf_W_Bs.pos.z());
         }
-        
-        // Deskew by IMU propagation
-        DeskewByImuPropagation(cloud, odom, ts, q_W_Bs, p_W_Bs);
+
+        if (status == DeskewPipeline::SHORT_IMU) {
+            ROS_WARN("Short/empty IMU sequence, ignoring");
+            continue;
+        }
+
+        if (pipeline->engine().getConfig().organized && !deskewed.organized)
+            ROS_WARN_THROTTLE(1.0, "Pointcloud is not organized, deskewing it point by point");
+
+        // Publish the cloud deskewed by IMU propagation
+        publishDeskewed(cloud, odomState, ros::Time(odomState.t), deskewed, shmFrame);
+
+        // Heap allocations of this scan on the processing thread, none once the buffers have grown
+        const ScanArena &arena = pipeline->scanArena();
+        if (AllocCounter::available())
+            printf("Allocations: %lu. Scan arena: %lu of %lu kB, %lu spills\n", AllocCounter::thread() - allocStart,
+                   arena.peak() >> 10, arena.capacity() >> 10, arena.spillCount());
+
+        if (mem_placement::stats().explicitFallbacks > 0)
+            ROS_WARN_ONCE("huge_pages is explicit but the hugetlb pool is exhausted, some buffers use normal pages. "
+                          "Reserve more with vm.nr_hugepages.");
     }
 }
 
-int main(int argc, char **argv)
+OblamDeskewNodelet::~OblamDeskewNodelet()
 {
-    ros::init(argc, argv, "oblam_deskew");
-    ros::NodeHandle nh("~");
-    nh_ptr = boost::make_shared<ros::NodeHandle>(nh);
+    running = false;
+    if (processDataThread.joinable())
+        processDataThread.join();
+}
+
+void OblamDeskewNodelet::onInit()
+{
+    ros::NodeHandle &nh = getNodeHandle();
+    ros::NodeHandle &nh_private = getPrivateNodeHandle();
 
     printf(KGRN "OBLAM Deskew Started\n" RESET);
 
-    // Initialize a transform
-    Matrix4d tfm_Bimu_Blidar;
-    tfm_Bimu_Blidar << -1.0, 0,   0,  -0.006253,
-                        0,  -1.0, 0,   0.011775,
-                        0,   0,   1.0, 0.028535,
-                        0,   0,   0,   1.000000;
-    tf_Bimu_Blidar = myTf(tfm_Bimu_Blidar);
+    // Huge pages for the large buffers (off, transparent or explicit) and the NUMA node to process on. Set before
+    // any buffer is created. The callbacks run on the threads of the nodelet manager, for their buffers to be
+    // on the node as well run it under numactl --cpunodebind.
+    string hugePages;
+    nh_private.param("huge_pages", hugePages, string("off"));
+    nh_private.param("numa_node", numaNode, -1);
+    mem_placement::HugePages hugePagesMode;
+    if (!mem_placement::parseHugePages(hugePages, hugePagesMode))
+    {
+        ROS_ERROR("Unknown huge_pages mode %s, use off, transparent or explicit", hugePages.c_str());
+        hugePagesMode = mem_placement::HUGE_OFF;
+    }
+    mem_placement::setHugePages(hugePagesMode);
+    if (numaNode >= mem_placement::nodeCount())
+    {
+        ROS_ERROR("numa_node %d does not exist, there are %d nodes", numaNode, mem_placement::nodeCount());
+        numaNode = -1;
+    }
+    printf("Huge pages: %s. NUMA node: %d of %d\n", mem_placement::hugePagesName(hugePagesMode), numaNode,
+           mem_placement::nodeCount());
+
+    // Organized output: keep the rings x columns layout and publish deskewed range and intensity images
+    DeskewEngineConfig engineCfg;
+    engineCfg.threads = MAX_THREADS;
+    nh_private.param("organized_output", engineCfg.organized, false);
+
+    // Crop box (in the lidar frame) and downsampling of the deskewed cloud, done in the deskew pass
+    FusedFilterConfig filterCfg;
+    vector<double> cropMin, cropMax;
+    string downsample; double leafSize;
+    nh_private.param("crop_box", filterCfg.crop, false);
+    nh_private.param("crop_negative", filterCfg.cropNegative, true);
+    nh_private.param("crop_min", cropMin, vector<double>{-1.0, -1.0, -1.0});
+    nh_private.param("crop_max", cropMax, vector<double>{ 1.0,  1.0,  1.0});
+    nh_private.param("downsample", downsample, string("none"));
+    nh_private.param("leaf_size", leafSize, 0.2);
+    if (filterCfg.crop && (cropMin.size() != 3 || cropMax.size() != 3))
+    {
+        ROS_ERROR("crop_min and crop_max must have 3 elements, crop box disabled");
+        filterCfg.crop = false;
+    }
+    else if (filterCfg.crop)
+    {
+        filterCfg.cropMin << cropMin[0], cropMin[1], cropMin[2];
+        filterCfg.cropMax << cropMax[0], cropMax[1], cropMax[2];
+    }
+    if (downsample == "voxel")
+        filterCfg.downsample = FusedFilterConfig::VOXEL;
+    else if (downsample == "uniform")
+        filterCfg.downsample = FusedFilterConfig::UNIFORM;
+    else if (downsample != "none")
+        ROS_ERROR("Unknown downsample mode %s, use none, voxel or uniform", downsample.c_str());
+    if (filterCfg.downsample != FusedFilterConfig::NONE && leafSize <= 0)
+    {
+        ROS_ERROR("leaf_size must be positive, downsampling disabled");
+        filterCfg.downsample = FusedFilterConfig::NONE;
+    }
+    filterCfg.leafSize = leafSize;
+    engineCfg.filter = filterCfg;
+    if (engineCfg.organized && filterCfg.enabled())
+        ROS_WARN("organized_output is set, crop box and downsampling only apply to unorganized scans");
+
+    // Output buffers rotated between deskewing and publishing, sized up front if output_reserve_points is set
+    // (131072 for a 128 x 1024 scan)
+    int outputBuffers, outputReservePoints;
+    nh_private.param("output_buffers", outputBuffers, 2);
+    nh_private.param("output_reserve_points", outputReservePoints, 0);
+    engineCfg.outputBuffers = outputBuffers;
+    engineCfg.reservePoints = max(outputReservePoints, 0);
+    mem_placement::NodeBinding setupBinding(numaNode);
+    if (outputReservePoints > 0)
+        rosCopyPool.prefill(outputBuffers, [outputReservePoints](PointCompactVec &points)
+        {
+            points.assign(outputReservePoints, PointCompact());
+            points.clear();
+        });
+
+    // Shared-memory output of the deskewed clouds, e.g. shm_output:=/oblam_deskew. Disabled if empty.
+    int shmSlots, shmSlotCapacity;
+    nh_private.param("shm_output", shmName, string(""));
+    nh_private.param("shm_slots", shmSlots, 4);
+    nh_private.param("shm_slot_capacity", shmSlotCapacity, 131072);
+    nh_private.param("deskewed_frame", deskewedFrame, string(Util::kDeskewedFrame));
+    if (!shmName.empty() && (shmSlots <= 0 || shmSlotCapacity <= 0))
+        ROS_ERROR("shm_slots and shm_slot_capacity must be positive, got %d and %d. Shared-memory output disabled.",
+                  shmSlots, shmSlotCapacity);
+    else if (!shmName.empty())
+    {
+        try
+        {
+            shmWriter.reset(new ShmCloudWriter(shmName, shmSlots, shmSlotCapacity));
+            printf("Writing deskewed clouds to shared memory %s, %d slots of %d points\n",
+                   shmName.c_str(), shmSlots, shmSlotCapacity);
+        }
+        catch (const std::exception &e)
+        {
+            ROS_ERROR("%s", e.what());
+        }
+    }
+
+    // Capture of the inputs and their arrival times for oblam_deskew_replay, e.g. capture_file:=/tmp/run.ocap
+    // At most capture_queue_mb is held waiting for the disk, beyond that the inputs are dropped from the capture
+    string captureFile;
+    int captureQueueMb;
+    nh_private.param("capture_file", captureFile, string(""));
+    nh_private.param("capture_queue_mb", captureQueueMb, 256);
+    if (!captureFile.empty())
+    {
+        try
+        {
+            captureWriter.reset(new CaptureWriter(captureFile, size_t(max(captureQueueMb, 1)) << 20));
+            printf("Capturing the inputs to %s\n", captureFile.c_str());
+        }
+        catch (const std::exception &e)
+        {
+            ROS_ERROR("%s", e.what());
+        }
+    }
+
+    // Deskew quality metric, always computed if set, otherwise only when /deskew_quality is subscribed to
+    nh_private.param("quality_metric", qualityMetricOn, false);
+
+    // Online estimation of the IMU biases and gravity, with it off the biases stay zero
+    DeskewPipelineConfig pipelineCfg;
+    pipelineCfg.engine = engineCfg;
+    nh_private.param("bias_estimation", pipelineCfg.biasEstimation, true);
+    nh_private.param("bias_forgetting", pipelineCfg.bias.forgetting, 0.98);
+    nh_private.param("gravity_norm", pipelineCfg.bias.gravityNorm, 9.81);
+    // The estimation starts on a scan where the IMU spread shows the sensor still
+    nh_private.param("bias_init_gyro_std", pipelineCfg.bias.initGyroStd, 0.05);
+    nh_private.param("bias_init_acc_std", pipelineCfg.bias.initAccStd, 0.3);
+
+    // Merge IMU samples into longer integration steps while the gyro and accel stay within the thresholds
+    nh_private.param("imu_decimation", pipelineCfg.decimation.enabled, false);
+    nh_private.param("decimation_gyro_threshold", pipelineCfg.decimation.gyroThreshold, 0.02);
+    nh_private.param("decimation_acc_threshold", pipelineCfg.decimation.accThreshold, 0.2);
+    nh_private.param("decimation_max_step", pipelineCfg.decimation.maxStep, 0.02);
+
+    // Pull the propagation onto the odometry after the cloud stamp as well as the one at it
+    nh_private.param("bidirectional_propagation", pipelineCfg.anchorBoth, false);
+
+    // Initialize a transform, used unless /tf_static has the one between imu_frame and lidar_frame. The buffers
+    // of the pipeline are faulted in while this thread is bound to numa_node, see setupBinding.
+    pipeline.reset(new DeskewPipeline(pipelineCfg, Util::defaultExtrinsic()));
+    if (captureWriter)
+        captureWriter->config(pipelineCfg);
+    nh_private.param("extrinsic_from_tf", extrinsicFromTf, true);
+    nh_private.param("extrinsic_timeout", extrinsicTimeout, 5.0);
+    nh_private.param("imu_frame", imuFrame, string("os1_imu"));
+    nh_private.param("lidar_frame", lidarFrame, string("os1_lidar"));
 
     // Subscribe to IMU topic
-    ros::Subscriber imuSub = nh.subscribe("/os1_cloud_node/imu", 1000, imuCallback);
+    imuSub = nh.subscribe("/os1_cloud_node/imu", 1000, &OblamDeskewNodelet::imuCallback, this);
+
+    // The odometry, odometry from the EKF by default. The others are ground truth with differenced velocities,
+    // e.g. pose_source:=pose_cov pose_topic:=/pose_gt, pose_source:=tf world_frame:=world body_frame:=os1_imu or
+    // pose_source:=file pose_file:=/data/gt.txt.
+    string poseSourceName;
+    nh_private.param("pose_source", poseSourceName, string("odometry"));
+    PoseSource::Type poseType = PoseSource::ODOMETRY;
+    if (!PoseSource::parseType(poseSourceName, poseType))
+        ROS_ERROR("Unknown pose_source %s, use odometry, pose, pose_cov, tf or file. Using odometry.",
+                  poseSourceName.c_str());
+    try
+    {
+        poseSource = PoseSource::create(poseType, nh, nh_private, [this](const OdomState &odom) { poseCallback(odom); });
+    }
+    catch (const std::exception &e)
+    {
+        ROS_ERROR("%s. Using odometry.", e.what());
+        poseSource = PoseSource::create(PoseSource::ODOMETRY, nh, nh_private,
+                                        [this](const OdomState &odom) { poseCallback(odom); });
+    }
+    printf("Odometry from %s\n", poseSource->describe().c_str());
 
-    // Subscribe to the odometry and pointcloud topics
-    ros::Subscriber odomSub = nh.subscribe("/odometry/filtered", 100, odomCallback);
-    ros::Subscriber cloudSub = nh.subscribe("/os1_cloud_node/points", 100, cloudCallback);
+    // Subscribe to the pointcloud topic
+    cloudSub = nh.subscribe("/os1_cloud_node/points", 100, &OblamDeskewNodelet::cloudCallback, this);
 
     // Advertise the pointclouds
     distortedCloudPub = nh.advertise<CloudMsg>("/distorted_cloud", 100);
     imuPropDeskewedCloudPub = nh.advertise<CloudMsg>("/imu_propagated_deskewed_cloud", 100);
-
-    // Create synchronized callback of two topics
-    //typedef sync_policies::ApproximateTime<OdomMsg, CloudMsg> MySyncPolicy;
-    //Synchronizer<MySyncPolicy> sync(MySyncPolicy(sync_time),
-    //                                odomSub, cloudSub);
-    //sync.registerCallback(boost::bind(&odomCloudCallback, _1, _2));
+    rangeImagePub = nh.advertise<sensor_msgs::Image>("/deskewed_range_image", 10);
+    intensityImagePub = nh.advertise<sensor_msgs::Image>("/deskewed_intensity_image", 10);
+    qualityPub = nh.advertise<std_msgs::Float64MultiArray>("/deskew_quality", 100);
 
     // Process the data
-    thread processDataThread(processData); // For processing the image
-
-    ros::spin();
-
-    //ros::MultiThreadedSpinner spinner(0);
-    //spinner.spin();
+    running = true;
+    processDataThread = thread(&OblamDeskewNodelet::processData, this);
+}
 
-    ROS_ERROR("Reached end!");
+} // namespace oblam_deskew
 
-    return 0;
-}
+PLUGINLIB_EXPORT_CLASS(oblam_deskew::OblamDeskewNodelet, nodelet::Nodelet)
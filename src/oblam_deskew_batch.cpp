@@ -0,0 +1,691 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Deskews recorded bags offline, many at a time, without roscore, the EKF or RViz. A manifest lists one bag pair per
+* line, the pose bag (or - if the data bag has the poses too) and the data bag with the IMU and clouds:
+*
+*   # pose bag                                   data bag                                   [output]
+*   /data/newer_college_06_pose_gt_.bag          /data/06_dynamic_spinning_ouster_.bag
+*
+* The bags are handed out to worker threads one at a time, each worker with its own pipeline. The messages of the
+* two bags are merged by header stamp and go through the same pairing and processing as in the nodelet, and the
+* deskewed clouds are written as they come out to <out>/<data bag>_deskewed.oscan, a columnar scan file
+* (scan_file.h, deflated with --compress), or with --format bag to <out>/<data bag>_deskewed.bag. The output of a
+* line overrides the name. Bags are streamed and clouds recycled, so the memory of a worker does not grow with the
+* length of its bag.
+*
+* Each bag is read on a thread of its own, decompressed, deserialized and unpacked a bounded number of chunks
+* (--prefetch, a chunk holds at most one cloud) ahead of the processing, so the disk and the decoding are hidden
+* behind the deskewing. The summary says which side waited for the other.
+*
+* Poses can be nav_msgs/Odometry, or geometry_msgs/PoseStamped and PoseWithCovarianceStamped (e.g. the ground
+* truth the EKF takes), whose velocity is differenced from the neighbouring poses. With --tf-frames they are the
+* world -> body transforms on /tf instead. The pose column can also be a TUM or CSV ground-truth file (.txt, .csv or
+* .tum, see pose_source.h), read in full before the bag.
+*
+* Usage: oblam_deskew_batch manifest [--workers N] [--threads T] [--shard i/n] [--out dir] [--no-output]
+*                           [--format scans|bag] [--compress level] [--prefetch chunks] [--numa] [--anchor-both]
+*                           [--huge-pages off|transparent|explicit]
+*                           [--imu-topic t] [--pose-topic t] [--cloud-topic t] [--tf-frames world body]
+*
+* --shard i/n takes lines i, i + n, i + 2n... of the manifest, to split it across processes or machines. --numa
+* binds worker w to NUMA node w % nodes, so its buffers and OpenMP threads stay on one socket. --anchor-both corrects
+* the IMU propagation of each scan onto the pose after the cloud stamp too (DeskewPipelineConfig::anchorBoth).
+*/
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+#include "utility.h"
+#include "deskew_pipeline.h"
+#include "odom_cloud_sync.h"
+#include "capture_file.h"
+#include "scan_arena.h"
+#include "scan_file.h"
+#include "mem_placement.h"
+#include "prefetch_queue.h"
+#include "pose_source_ros.h"
+
+using namespace std;
+using namespace Eigen;
+
+typedef std::shared_ptr<OdomState> OdomStatePtr;
+
+struct BatchCloud
+{
+    double stamp;
+    CloudCompactPtr cloud;
+};
+typedef std::shared_ptr<BatchCloud> BatchCloudPtr;
+
+typedef OdomCloudSync<OdomStatePtr, BatchCloudPtr> BatchSync;
+
+struct BatchOptions
+{
+    int workers = 1;
+    int threads = 0;                // Per worker, 0 for the cores divided among the workers
+    int shard = 0, shards = 1;
+    enum Format { SCANS, BAG };
+
+    string outDir = ".";
+    bool output = true;
+    Format format = SCANS;
+    int compress = 0;               // Deflate level of the scan files, 0 for raw columns
+    int prefetch = 8;               // Chunks read ahead of the processing, about as many clouds
+    bool numa = false;
+    mem_placement::HugePages hugePages = mem_placement::HUGE_OFF;
+    bool anchorBoth = false;        // Anchor the propagation at the odometry after each cloud too
+
+    string imuTopic = "/os1_cloud_node/imu";
+    string poseTopic = "/pose_gt";
+    string cloudTopic = "/os1_cloud_node/points";
+    string tfWorld, tfBody;         // Poses from /tf between these frames rather than the pose topic, if set
+};
+
+struct BagJob
+{
+    string poseBag;                 // Empty if the data bag has the poses, or a ground-truth file
+    string dataBag;
+    string output;
+};
+
+struct BagStats
+{
+    uint64_t imu = 0, poses = 0, clouds = 0;
+    uint64_t imuDropped = 0;        // Not after the sample before, see ImuStore::push
+    uint64_t scans = 0, points = 0;
+    uint64_t status[DeskewPipeline::SHORT_IMU + 1] = {};
+    BatchSync::Counters sync;
+    double seconds = 0;
+    double inputWait = 0;           // Processing waited for the reader [s]
+    double readWait = 0;            // Reader waited for the processing, the prefetch queue was full [s]
+    string error;
+};
+
+// IMU samples older than this behind the newest message are dropped if no pair is waiting for them [s]
+static const double kImuKeep = 2.0;
+
+// Records read ahead are handed over in chunks, each at most one cloud
+typedef vector<CaptureRecord> RecordChunk;
+static const size_t kChunkRecords = 256;
+
+/* #region  Reading the bags --------------------------------------------------------------------------------------*/
+
+// Records in time order from a bag or a pose file
+class RecordStream
+{
+public:
+
+    virtual ~RecordStream() {}
+
+    // Next record, false at the end
+    virtual bool next(CaptureRecord &rec, BagStats &stats) = 0;
+};
+
+// The messages of one bag on the given topics, decoded into records. Clouds are unpacked into recycled buffers.
+class BagStream : public RecordStream
+{
+public:
+
+    BagStream(const string &path, const BatchOptions &opt, RecyclePool<CloudCompact> &cloudPool)
+        : opt(opt), cloudPool(cloudPool), useTf(!opt.tfWorld.empty()), decoder(opt.tfWorld, opt.tfBody)
+    {
+        bag.open(path, rosbag::bagmode::Read);
+        view.addQuery(bag, rosbag::TopicQuery(vector<string>{opt.imuTopic, useTf ? "/tf" : opt.poseTopic,
+                                                             opt.cloudTopic}));
+        it = view.begin();
+    }
+
+    // Next record in the order of the bag, false at its end
+    bool next(CaptureRecord &rec, BagStats &stats) override
+    {
+        if (popPose(rec, stats))
+            return true;
+
+        auto pushPose = [this](const OdomState &odom) { pending.push_back(odom); };
+
+        for (; it != view.end(); ++it)
+        {
+            const rosbag::MessageInstance &m = *it;
+
+            if (m.getTopic() == opt.imuTopic)
+            {
+                if (sensor_msgs::Imu::ConstPtr msg = m.instantiate<sensor_msgs::Imu>())
+                {
+                    rec.type = capture::IMU;
+                    rec.imu = Util::toImuSample(*msg);
+                    stats.imu++;
+                    ++it;
+                    return true;
+                }
+            }
+            else if (m.getTopic() == opt.cloudTopic)
+            {
+                if (sensor_msgs::PointCloud2::ConstPtr msg = m.instantiate<sensor_msgs::PointCloud2>())
+                {
+                    rec.type = capture::CLOUD;
+                    rec.cloudStamp = msg->header.stamp.toSec();
+                    rec.cloud = cloudPool.acquire();
+                    Util::fromROSMsg(*msg, *rec.cloud, 1);
+                    stats.clouds++;
+                    ++it;
+                    return true;
+                }
+            }
+            else if (useTf)
+            {
+                if (tf2_msgs::TFMessage::ConstPtr msg = m.instantiate<tf2_msgs::TFMessage>())
+                    decoder.decode(*msg, pushPose);
+
+                if (popPose(rec, stats))
+                {
+                    ++it;
+                    return true;
+                }
+            }
+            else if (m.getTopic() == opt.poseTopic)
+            {
+                if (nav_msgs::Odometry::ConstPtr msg = m.instantiate<nav_msgs::Odometry>())
+                    decoder.decode(*msg, pushPose);
+                else if (geometry_msgs::PoseWithCovarianceStamped::ConstPtr msg
+                         = m.instantiate<geometry_msgs::PoseWithCovarianceStamped>())
+                    decoder.decode(*msg, pushPose);
+                else if (geometry_msgs::PoseStamped::ConstPtr msg = m.instantiate<geometry_msgs::PoseStamped>())
+                    decoder.decode(*msg, pushPose);
+                else
+                    throw runtime_error("BagStream: " + opt.poseTopic + " is a " + m.getDataType()
+                                        + ", expected Odometry, PoseStamped or PoseWithCovarianceStamped");
+
+                if (popPose(rec, stats))
+                {
+                    ++it;
+                    return true;
+                }
+            }
+        }
+
+        OdomState last;
+        if (decoder.flush(last))
+            pending.push_back(last);
+        return popPose(rec, stats);
+    }
+
+private:
+
+    bool popPose(CaptureRecord &rec, BagStats &stats)
+    {
+        if (pending.empty())
+            return false;
+
+        rec.type = capture::ODOM;
+        rec.odom = pending.front();
+        pending.pop_front();
+        stats.poses++;
+        return true;
+    }
+
+    const BatchOptions &opt;
+    RecyclePool<CloudCompact> &cloudPool;
+
+    rosbag::Bag bag;
+    rosbag::View view;
+    rosbag::View::iterator it;
+    bool useTf;
+
+    // Poses of the last message (a TF message can hold several) not handed out yet
+    PoseDecoder decoder;
+    deque<OdomState> pending;
+};
+
+// The poses of a ground-truth file
+class PoseFileStream : public RecordStream
+{
+public:
+
+    explicit PoseFileStream(const string &path) : file(path) {}
+
+    bool next(CaptureRecord &rec, BagStats &stats) override
+    {
+        if (k >= file.poses().size())
+            return false;
+
+        rec.type = capture::ODOM;
+        rec.odom = file.poses()[k++];
+        stats.poses++;
+        return true;
+    }
+
+private:
+
+    PoseFile file;
+    size_t k = 0;
+};
+
+static double recordStamp(const CaptureRecord &rec)
+{
+    switch (rec.type)
+    {
+        case capture::IMU:   return rec.imu.t;
+        case capture::ODOM:  return rec.odom.t;
+        case capture::CLOUD: return rec.cloudStamp;
+        default:             return 0;
+    }
+}
+
+/* #endregion  Reading the bags -----------------------------------------------------------------------------------*/
+
+/* #region  Processing --------------------------------------------------------------------------------------------*/
+
+// One worker: a pipeline and its buffers, reused for the bags it is handed
+class BatchWorker
+{
+public:
+
+    BatchWorker(const BatchOptions &opt, const DeskewPipelineConfig &config)
+        : opt(opt), config(config), cloudPool(opt.prefetch + 8) {}
+
+    BagStats run(const BagJob &job)
+    {
+        BagStats stats;
+        auto tic = chrono::steady_clock::now();
+
+        try
+        {
+            // A new pipeline per bag, the IMU store and the bias estimate must not carry over
+            DeskewPipeline pipeline(config, Util::defaultExtrinsic());
+            BatchSync sync;
+
+            bagOut.reset();
+            scanOut.reset();
+            if (opt.output && opt.format == BatchOptions::BAG)
+            {
+                bagOut.reset(new rosbag::Bag());
+                bagOut->open(job.output, rosbag::bagmode::Write);
+            }
+            else if (opt.output)
+                scanOut.reset(new ScanFileWriter(job.output, opt.compress));
+
+            // Reading, decompression and unpacking of the clouds happen on the reader thread, opt.prefetch chunks ahead
+            PrefetchQueue<RecordChunk> queue(opt.prefetch);
+            BagStats input;
+            std::exception_ptr readError;
+            thread reader([&]()
+            {
+                try
+                {
+                    readAhead(job, queue, input);
+                }
+                catch (...)
+                {
+                    readError = std::current_exception();
+                }
+                queue.close();
+            });
+
+            try
+            {
+                RecordChunk chunk;
+                while (queue.pop(chunk))
+                    for (CaptureRecord &rec : chunk)
+                    {
+                        switch (rec.type)
+                        {
+                            case capture::IMU:
+                                pipeline.imu().push(rec.imu);
+                                break;
+                            case capture::ODOM:
+                                sync.pushOdom(rec.odom.t, std::make_shared<OdomState>(rec.odom));
+                                break;
+                            case capture::CLOUD:
+                                sync.pushCloud(rec.cloudStamp,
+                                               std::make_shared<BatchCloud>(BatchCloud{rec.cloudStamp, rec.cloud}));
+                                rec.cloud.reset();
+                                break;
+                            default:
+                                break;
+                        }
+
+                        process(pipeline, sync, stats);
+
+                        if (sync.pending() == 0)
+                            pipeline.imu().prune(recordStamp(rec) - kImuKeep);
+                    }
+            }
+            catch (...)
+            {
+                queue.close();
+                reader.join();
+                throw;
+            }
+
+            reader.join();
+            if (readError)
+                std::rethrow_exception(readError);
+
+            stats.imu = input.imu; stats.poses = input.poses; stats.clouds = input.clouds;
+            stats.readWait = queue.pushWaitSeconds();
+            stats.inputWait = queue.popWaitSeconds();
+
+            if (bagOut)
+                bagOut->close();
+            if (scanOut)
+                scanOut->close();
+            stats.sync = sync.counters();
+            stats.imuDropped = pipeline.imu().dropped();
+        }
+        catch (const std::exception &e)
+        {
+            stats.error = e.what();
+        }
+
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - tic).count();
+        return stats;
+    }
+
+private:
+
+    // The reader thread: the two bags (or the bag and the pose file) merged by header stamp (their record times are
+    // not on a common clock) into chunks of records, each ending at a cloud or after kChunkRecords
+    void readAhead(const BagJob &job, PrefetchQueue<RecordChunk> &queue, BagStats &input)
+    {
+        std::unique_ptr<RecordStream> streams[2];
+        CaptureRecord head[2];
+        bool has[2] = {false, false};
+        streams[0].reset(new BagStream(job.dataBag, opt, cloudPool));
+        if (isPoseFile(job.poseBag))
+            streams[1].reset(new PoseFileStream(job.poseBag));
+        else if (!job.poseBag.empty())
+            streams[1].reset(new BagStream(job.poseBag, opt, cloudPool));
+        for (int s = 0; s < 2; s++)
+            has[s] = streams[s] && streams[s]->next(head[s], input);
+
+        RecordChunk chunk;
+        while (has[0] || has[1])
+        {
+            int s = !has[0] || (has[1] && recordStamp(head[1]) < recordStamp(head[0])) ? 1 : 0;
+            bool cloud = head[s].type == capture::CLOUD;
+            chunk.push_back(std::move(head[s]));
+
+            if (cloud || chunk.size() >= kChunkRecords)
+            {
+                if (!queue.push(std::move(chunk)))
+                    return;
+                chunk = RecordChunk();
+                chunk.reserve(kChunkRecords);
+            }
+
+            has[s] = streams[s]->next(head[s], input);
+        }
+
+        if (!chunk.empty())
+            queue.push(std::move(chunk));
+    }
+
+    // Everything that is ready, like the processing loop of the nodelet
+    void process(DeskewPipeline &pipeline, BatchSync &sync, BagStats &stats)
+    {
+        for (;;)
+        {
+            BatchSync::Status ready = sync.check(pipeline.imu());
+            if (ready == BatchSync::STALE)
+                continue;
+            if (ready != BatchSync::READY)
+                return;
+
+            OdomStatePtr odom, odomNext; BatchCloudPtr cloud;
+            if (!sync.pop(odom, odomNext, cloud))
+                return;
+
+            DeskewResult result;
+            DeskewPipeline::Status status = pipeline.process(*odom, *odomNext, cloud->stamp, *cloud->cloud, result);
+            const OdomState &odomState = pipeline.startOdom();
+            stats.status[status]++;
+            if (status != DeskewPipeline::OK)
+                continue;
+
+            stats.scans++;
+            stats.points += result.size;
+
+            if (scanOut)
+                scanOut->write(cloud->stamp, odomState.tf(), result.data, result.size, *cloud->cloud, result.srcIdx.get());
+
+            if (bagOut)
+            {
+                Util::toROSMsg(result.data, result.size, *cloud->cloud, result.srcIdx.get(), cloudMsg);
+                cloudMsg.is_dense = !result.organized;
+                cloudMsg.header.stamp = ros::Time(odomState.t);
+                cloudMsg.header.frame_id = Util::kDeskewedFrame;
+                bagOut->write("/imu_propagated_deskewed_cloud", cloudMsg.header.stamp, cloudMsg);
+            }
+        }
+    }
+
+    const BatchOptions &opt;
+    DeskewPipelineConfig config;
+
+    // Clouds read ahead, in the pairing and being processed
+    RecyclePool<CloudCompact> cloudPool;
+
+    // Output of the current bag, one of them
+    std::unique_ptr<rosbag::Bag> bagOut;
+    std::unique_ptr<ScanFileWriter> scanOut;
+    sensor_msgs::PointCloud2 cloudMsg;
+};
+
+/* #endregion  Processing -----------------------------------------------------------------------------------------*/
+
+static string bagStem(const string &path)
+{
+    size_t slash = path.find_last_of('/');
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bag") == 0)
+        name.resize(name.size() - 4);
+    return name;
+}
+
+static vector<BagJob> readManifest(const string &path, const BatchOptions &opt)
+{
+    ifstream file(path);
+    if (!file)
+        throw runtime_error("Cannot open the manifest " + path);
+
+    vector<BagJob> jobs;
+    string line;
+    int index = 0, lineNo = 0;
+    while (getline(file, line))
+    {
+        lineNo++;
+        line = line.substr(0, line.find('#'));
+        istringstream fields(line);
+        BagJob job;
+        if (!(fields >> job.poseBag))
+            continue;
+        if (!(fields >> job.dataBag))
+            throw runtime_error(path + ":" + to_string(lineNo) + ": expected a pose bag and a data bag");
+        fields >> job.output;
+
+        if (job.poseBag == "-")
+            job.poseBag.clear();
+        if (job.output.empty())
+            job.output = opt.outDir + "/" + bagStem(job.dataBag)
+                         + (opt.format == BatchOptions::BAG ? "_deskewed.bag" : "_deskewed.oscan");
+
+        if (index++ % opt.shards == opt.shard)
+            jobs.push_back(job);
+    }
+    return jobs;
+}
+
+static void printUsage(const char *prog)
+{
+    printf("Usage: %s manifest [--workers N] [--threads T] [--shard i/n] [--out dir] [--no-output]\n"
+           "       [--format scans|bag] [--compress level] [--prefetch chunks] [--numa] [--anchor-both]\n"
+           "       [--huge-pages off|transparent|explicit]\n"
+           "       [--imu-topic t] [--pose-topic t] [--cloud-topic t] [--tf-frames world body]\n",
+           prog);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    BatchOptions opt;
+    string manifest = argv[1];
+    for (int i = 2; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--workers" && hasValue)
+            opt.workers = max(1, atoi(argv[++i]));
+        else if (arg == "--threads" && hasValue)
+            opt.threads = atoi(argv[++i]);
+        else if (arg == "--shard" && hasValue && sscanf(argv[i + 1], "%d/%d", &opt.shard, &opt.shards) == 2
+                 && opt.shards > 0 && 0 <= opt.shard && opt.shard < opt.shards)
+            i++;
+        else if (arg == "--out" && hasValue)
+            opt.outDir = argv[++i];
+        else if (arg == "--no-output")
+            opt.output = false;
+        else if (arg == "--format" && hasValue && (string(argv[i + 1]) == "scans" || string(argv[i + 1]) == "bag"))
+            opt.format = string(argv[++i]) == "bag" ? BatchOptions::BAG : BatchOptions::SCANS;
+        else if (arg == "--compress" && hasValue)
+            opt.compress = atoi(argv[++i]);
+        else if (arg == "--prefetch" && hasValue)
+            opt.prefetch = max(1, atoi(argv[++i]));
+        else if (arg == "--numa")
+            opt.numa = true;
+        else if (arg == "--anchor-both")
+            opt.anchorBoth = true;
+        else if (arg == "--huge-pages" && hasValue && mem_placement::parseHugePages(argv[i + 1], opt.hugePages))
+            i++;
+        else if (arg == "--imu-topic" && hasValue)
+            opt.imuTopic = argv[++i];
+        else if (arg == "--pose-topic" && hasValue)
+            opt.poseTopic = argv[++i];
+        else if (arg == "--cloud-topic" && hasValue)
+            opt.cloudTopic = argv[++i];
+        else if (arg == "--tf-frames" && i + 2 < argc)
+        {
+            opt.tfWorld = argv[++i];
+            opt.tfBody = argv[++i];
+        }
+        else
+        {
+            printf("Bad argument %s\n", arg.c_str());
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.compress > 0 && !scan_file::deflateAvailable())
+    {
+        printf("--compress needs zlib, this build has none\n");
+        return 1;
+    }
+
+    vector<BagJob> jobs;
+    try
+    {
+        jobs = readManifest(manifest, opt);
+    }
+    catch (const std::exception &e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+
+    opt.workers = min(opt.workers, int(max<size_t>(jobs.size(), 1)));
+    if (opt.threads <= 0)
+        opt.threads = max(1, int(thread::hardware_concurrency())/opt.workers);
+    int nodes = mem_placement::nodeCount();
+    mem_placement::setHugePages(opt.hugePages);
+
+    DeskewPipelineConfig config;
+    config.engine.threads = opt.threads;
+    config.anchorBoth = opt.anchorBoth;
+
+    printf("Deskewing %lu bag pairs (shard %d/%d) with %d workers of %d threads, %d NUMA nodes%s, huge pages %s\n",
+           jobs.size(), opt.shard, opt.shards, opt.workers, opt.threads, nodes, opt.numa ? " (bound)" : "",
+           mem_placement::hugePagesName(opt.hugePages));
+
+    vector<BagStats> results(jobs.size());
+    atomic<size_t> nextJob{0};
+    mutex printMtx;
+
+    auto tic = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for (int w = 0; w < opt.workers; w++)
+        workers.emplace_back([&, w]()
+        {
+            // Before the worker allocates or starts OpenMP threads
+            if (opt.numa)
+                mem_placement::bindToNode(w % nodes);
+
+            BatchWorker worker(opt, config);
+            for (size_t j = nextJob++; j < jobs.size(); j = nextJob++)
+            {
+                results[j] = worker.run(jobs[j]);
+
+                const BagStats &s = results[j];
+                lock_guard<mutex> lock(printMtx);
+                if (!s.error.empty())
+                    printf("[%d] %s: failed: %s\n", w, jobs[j].dataBag.c_str(), s.error.c_str());
+                else
+                    printf("[%d] %s: %lu scans, %lu points in %.1f s (%.1f scans/s, %.2f Mpts/s), %lu not deskewed. "
+                           "Waited for input %.1f s, reader waited %.1f s\n",
+                           w, jobs[j].dataBag.c_str(), s.scans, s.points, s.seconds, s.scans/max(s.seconds, 1e-9),
+                           s.points/max(s.seconds, 1e-9)*1e-6, s.clouds - s.scans, s.inputWait, s.readWait);
+                fflush(stdout);
+            }
+        });
+
+    for (thread &t : workers)
+        t.join();
+
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - tic).count();
+
+    BagStats total;
+    int failed = 0;
+    for (const BagStats &s : results)
+    {
+        failed += !s.error.empty();
+        total.imu += s.imu; total.imuDropped += s.imuDropped; total.poses += s.poses; total.clouds += s.clouds;
+        total.scans += s.scans; total.points += s.points;
+        total.seconds += s.seconds; total.inputWait += s.inputWait; total.readWait += s.readWait;
+        for (int k = 0; k <= DeskewPipeline::SHORT_IMU; k++)
+            total.status[k] += s.status[k];
+        total.sync.paired += s.sync.paired; total.sync.skipped += s.sync.skipped;
+        total.sync.overwritten += s.sync.overwritten; total.sync.stale += s.sync.stale;
+    }
+
+    printf("Bags:       %lu done, %d failed\n", jobs.size() - failed, failed);
+    printf("Input:      %lu IMU (%lu out of order, dropped), %lu poses, %lu clouds\n",
+           total.imu, total.imuDropped, total.poses, total.clouds);
+    printf("Pairing:    %lu paired, %lu skipped at startup, %lu overwritten, %lu stale\n",
+           total.sync.paired, total.sync.skipped, total.sync.overwritten, total.sync.stale);
+    printf("Pipeline:  ");
+    for (int k = 0; k <= DeskewPipeline::SHORT_IMU; k++)
+        printf(" %lu %s%s", total.status[k], DeskewPipeline::statusName(DeskewPipeline::Status(k)),
+               k < DeskewPipeline::SHORT_IMU ? "," : "\n");
+    printf("Prefetch:   processing waited for input %.0f%% of the time, the readers were blocked on a full queue %.0f%%\n",
+           100*total.inputWait/max(total.seconds, 1e-9), 100*total.readWait/max(total.seconds, 1e-9));
+    printf("Throughput: %lu scans, %lu points in %.1f s: %.1f scans/s, %.2f Mpts/s\n",
+           total.scans, total.points, wall, total.scans/max(wall, 1e-9), total.points/max(wall, 1e-9)*1e-6);
+
+    return failed > 0 ? 1 : 0;
+}
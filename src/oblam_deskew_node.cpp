@@ -0,0 +1,23 @@
+#include <ros/ros.h>
+#include <nodelet/loader.h>
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "oblam_deskew");
+
+    // Load the deskew nodelet into this process, so the standalone node and the nodelet share one implementation
+    nodelet::Loader nodelet;
+    nodelet::M_string remap(ros::names::getRemappings());
+    nodelet::V_string nargv;
+    if (!nodelet.load(ros::this_node::getName(), "oblam_deskew/OblamDeskewNodelet", remap, nargv))
+    {
+        ROS_ERROR("Failed to load the deskew nodelet");
+        return 1;
+    }
+
+    ros::spin();
+
+    ROS_ERROR("Reached end!");
+
+    return 0;
+}
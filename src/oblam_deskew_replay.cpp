@@ -0,0 +1,374 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Replays a capture recorded by the node (capture_file param) through the same pairing and processing as the
+* nodelet, without ROS, and reports what was dropped where and the end-to-end latency of each scan.
+*
+*   rate 0:  as fast as possible, deterministic. Records are fed in their recorded order on one thread and every
+*            pair is processed as soon as it is ready. The wait of a scan (from its arrival to the arrival of
+*            the message that made it ready) is on the recorded clock, so it is the same on every run; the
+*            processing time is measured and queued behind the previous scans.
+*   rate r:  real time scaled by r. A feeder thread sleeps between records like they arrived, the processing
+*            thread polls like the nodelet does. Latency is measured on the wall clock.
+*
+* numa_node binds the replay to the CPUs of that node, with its buffers faulted in there (-1 for none), huge_pages
+* is off, transparent or explicit (see mem_placement.h).
+*
+* The pipeline runs with the settings the node had, from the capture. Any of them can be changed with
+* param=value arguments, named like the node params, e.g. imu_decimation=1 or downsample=voxel.
+*
+* Usage: oblam_deskew_replay capture.ocap [rate] [threads] [poll_ms] [numa_node] [huge_pages] [param=value ...]
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "deskew_pipeline.h"
+#include "odom_cloud_sync.h"
+#include "capture_file.h"
+#include "alloc_counter.h"
+#include "mem_placement.h"
+
+using namespace std;
+using namespace Eigen;
+
+typedef std::shared_ptr<OdomState> OdomStatePtr;
+
+struct ReplayCloud
+{
+    double stamp;
+    double arrival;                 // [s], on the recorded clock (rate 0) or the wall clock
+    CloudCompactPtr cloud;
+};
+typedef std::shared_ptr<ReplayCloud> ReplayCloudPtr;
+
+typedef OdomCloudSync<OdomStatePtr, ReplayCloudPtr> ReplaySync;
+
+// An extrinsic fed in, set on the engine by the processing thread before its next scan like in the nodelet
+struct PendingExtrinsic
+{
+    mutex mtx;
+    bool pending = false;
+    mytf tf;
+
+    void put(const mytf &tf_)
+    {
+        lock_guard<mutex> lock(mtx);
+        tf = tf_;
+        pending = true;
+    }
+
+    void apply(DeskewPipeline &pipeline)
+    {
+        lock_guard<mutex> lock(mtx);
+        if (pending)
+            pipeline.engine().setExtrinsic(tf);
+        pending = false;
+    }
+};
+
+struct ReplayStats
+{
+    uint64_t imu = 0, odom = 0, clouds = 0;
+    uint64_t dropped[3] = {};       // IMU, odometry, clouds the node dropped from the capture
+    uint64_t status[DeskewPipeline::SHORT_IMU + 1] = {};
+    vector<double> latencyMs, waitMs, processMs;
+    vector<double> allocs;          // Heap allocations of each processed scan
+};
+
+static double percentile(vector<double> v, double p)
+{
+    if (v.empty())
+        return 0;
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, size_t(p*(v.size() - 1) + 0.5))];
+}
+
+static string joined(const vector<string> &v)
+{
+    string s;
+    for (const string &x : v)
+        s += (s.empty() ? "" : " ") + x;
+    return s;
+}
+
+static double mean(const vector<double> &v)
+{
+    double sum = 0;
+    for (double x : v)
+        sum += x;
+    return v.empty() ? 0 : sum/v.size();
+}
+
+// Hand one record to the IMU store or the odometry/cloud pairing, as the nodelet callbacks do
+static void feed(const CaptureRecord &rec, double arrival, DeskewPipeline &pipeline, ReplaySync &sync,
+                 PendingExtrinsic &extrinsic, ReplayStats &stats)
+{
+    switch (rec.type)
+    {
+        case capture::IMU:
+            stats.imu++;
+            pipeline.imu().push(rec.imu);
+            break;
+        case capture::ODOM:
+            stats.odom++;
+            sync.pushOdom(rec.odom.t, std::make_shared<OdomState>(rec.odom));
+            break;
+        case capture::CLOUD:
+            stats.clouds++;
+            sync.pushCloud(rec.cloudStamp, std::make_shared<ReplayCloud>(ReplayCloud{rec.cloudStamp, arrival, rec.cloud}));
+            break;
+        case capture::EXTRINSIC:
+            extrinsic.put(rec.extrinsic);
+            break;
+        case capture::DROPPED:
+            copy(rec.dropped, rec.dropped + 3, stats.dropped);
+            break;
+        case capture::CONFIG:
+            break;
+    }
+}
+
+static void replayMax(CaptureReader &reader, DeskewPipeline &pipeline, ReplaySync &sync, ReplayStats &stats)
+{
+    double busyUntil = 0;   // End of the last processing, on the recorded clock [s]
+    PendingExtrinsic extrinsic;
+
+    CaptureRecord rec;
+    while (reader.next(rec))
+    {
+        double now = rec.arrivalNs*1e-9;
+        feed(rec, now, pipeline, sync, extrinsic, stats);
+
+        // An ideal consumer: everything that is ready now gets processed, one scan after the other
+        for (;;)
+        {
+            ReplaySync::Status ready = sync.check(pipeline.imu());
+            if (ready == ReplaySync::STALE)
+                continue;
+            if (ready != ReplaySync::READY)
+                break;
+
+            OdomStatePtr odom, odomNext; ReplayCloudPtr cloud;
+            if (!sync.pop(odom, odomNext, cloud))
+                break;
+
+            extrinsic.apply(pipeline);
+
+            auto tic = chrono::steady_clock::now();
+            uint64_t allocStart = AllocCounter::thread();
+            DeskewPipeline::Status status;
+            {
+                DeskewResult result;
+                status = pipeline.process(*odom, *odomNext, cloud->stamp, *cloud->cloud, result);
+            }
+            uint64_t allocs = AllocCounter::thread() - allocStart;
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - tic).count();
+
+            stats.status[status]++;
+            double start = max(now, busyUntil);
+            busyUntil = start + ms*1e-3;
+            if (status == DeskewPipeline::OK)
+            {
+                stats.waitMs.push_back((now - cloud->arrival)*1e3);
+                stats.processMs.push_back(ms);
+                stats.latencyMs.push_back((busyUntil - cloud->arrival)*1e3);
+                stats.allocs.push_back(allocs);
+            }
+        }
+    }
+}
+
+static void replayScaled(CaptureReader &reader, DeskewPipeline &pipeline, ReplaySync &sync, ReplayStats &stats,
+                         double rate, int pollMs)
+{
+    auto wallStart = chrono::steady_clock::now();
+    auto wallNow = [&wallStart]() { return chrono::duration<double>(chrono::steady_clock::now() - wallStart).count(); };
+
+    atomic<bool> fed{false};
+    ReplayStats feedStats;
+    PendingExtrinsic extrinsic;
+    std::exception_ptr feedError;
+
+    thread feeder([&]()
+    {
+        try
+        {
+            CaptureRecord rec;
+            while (reader.next(rec))
+            {
+                this_thread::sleep_until(wallStart + chrono::nanoseconds(int64_t(rec.arrivalNs/rate)));
+                feed(rec, wallNow(), pipeline, sync, extrinsic, feedStats);
+            }
+        }
+        catch (...)
+        {
+            feedError = std::current_exception();
+        }
+        fed = true;
+    });
+
+    // The nodelet's processing loop
+    for (;;)
+    {
+        bool done = fed;
+        ReplaySync::Status ready = sync.check(pipeline.imu());
+        if (ready != ReplaySync::READY)
+        {
+            if (done && ready != ReplaySync::STALE)
+                break;
+            this_thread::sleep_for(chrono::milliseconds(pollMs));
+            continue;
+        }
+
+        OdomStatePtr odom, odomNext; ReplayCloudPtr cloud;
+        if (!sync.pop(odom, odomNext, cloud))
+            continue;
+
+        extrinsic.apply(pipeline);
+
+        auto tic = chrono::steady_clock::now();
+        uint64_t allocStart = AllocCounter::thread();
+        DeskewPipeline::Status status;
+        {
+            DeskewResult result;
+            status = pipeline.process(*odom, *odomNext, cloud->stamp, *cloud->cloud, result);
+        }
+        uint64_t allocs = AllocCounter::thread() - allocStart;
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - tic).count();
+
+        stats.status[status]++;
+        if (status == DeskewPipeline::OK)
+        {
+            stats.allocs.push_back(allocs);
+            stats.processMs.push_back(ms);
+            stats.latencyMs.push_back((wallNow() - cloud->arrival)*1e3);
+            stats.waitMs.push_back(stats.latencyMs.back() - ms);
+        }
+    }
+
+    feeder.join();
+    if (feedError)
+        std::rethrow_exception(feedError);
+    stats.imu = feedStats.imu; stats.odom = feedStats.odom; stats.clouds = feedStats.clouds;
+    copy(feedStats.dropped, feedStats.dropped + 3, stats.dropped);
+}
+
+int main(int argc, char **argv)
+{
+    // param=value overrides of the pipeline settings, wherever they are, the rest are positional
+    vector<string> args, overrides;
+    for (int i = 1; i < argc; i++)
+        (string(argv[i]).find('=') != string::npos ? overrides : args).push_back(argv[i]);
+
+    if (args.empty())
+    {
+        printf("Usage: %s capture.ocap [rate] [threads] [poll_ms] [numa_node] [huge_pages] [param=value ...]\n", argv[0]);
+        return 1;
+    }
+
+    string path = args[0];
+    double rate  = args.size() > 1 ? atof(args[1].c_str()) : 0.0;
+    int threads  = args.size() > 2 ? atoi(args[2].c_str()) : int(thread::hardware_concurrency());
+    int pollMs   = args.size() > 3 ? atoi(args[3].c_str()) : 50;
+    int numaNode = args.size() > 4 ? atoi(args[4].c_str()) : -1;
+    string hugePagesName = args.size() > 5 ? args[5] : "off";
+
+    // Before any buffer or OpenMP thread exists, so all of them are placed on the node
+    mem_placement::HugePages hugePages;
+    if (!mem_placement::parseHugePages(hugePagesName, hugePages))
+    {
+        printf("Unknown huge_pages mode %s, use off, transparent or explicit\n", hugePagesName.c_str());
+        return 1;
+    }
+    mem_placement::setHugePages(hugePages);
+    if (numaNode >= 0 && !mem_placement::bindToNode(numaNode))
+    {
+        printf("Cannot bind to NUMA node %d, there are %d nodes\n", numaNode, mem_placement::nodeCount());
+        return 1;
+    }
+
+    DeskewPipelineConfig config;
+    unique_ptr<DeskewPipeline> pipelinePtr;
+    bool configCaptured = false;
+    ReplaySync sync;
+    ReplayStats stats;
+
+    try
+    {
+        CaptureReader reader(path);
+
+        // The node's settings, then the overrides
+        configCaptured = reader.config(config);
+        for (const string &kv : overrides)
+        {
+            size_t eq = kv.find('=');
+            if (!capture::setConfig(config, kv.substr(0, eq), kv.substr(eq + 1)))
+                throw runtime_error("Unknown setting or bad value in " + kv);
+        }
+        config.engine.threads = threads;
+        pipelinePtr.reset(new DeskewPipeline(config));
+
+        if (rate > 0)
+            replayScaled(reader, *pipelinePtr, sync, stats, rate, pollMs);
+        else
+            replayMax(reader, *pipelinePtr, sync, stats);
+    }
+    catch (const std::exception &e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    DeskewPipeline &pipeline = *pipelinePtr;
+
+    ReplaySync::Counters count = sync.counters();
+    uint64_t unpaired = stats.clouds - count.skipped - count.overwritten - count.paired;
+
+    if (rate > 0)
+        printf("Replayed %s at x%.2f, %d threads\n", path.c_str(), rate, threads);
+    else
+        printf("Replayed %s as fast as possible, %d threads\n", path.c_str(), threads);
+    printf("Settings:  %s%s%s\n", configCaptured ? "from the capture" : "defaults, the capture has none",
+           overrides.empty() ? "" : ", with ", overrides.empty() ? "" : joined(overrides).c_str());
+    printf("Placement: NUMA node %d of %d, huge pages %s, %lu large buffers mapped, %lu without explicit huge pages\n",
+           numaNode, mem_placement::nodeCount(), mem_placement::hugePagesName(hugePages),
+           mem_placement::stats().mappings.load(), mem_placement::stats().explicitFallbacks.load());
+    printf("Input:     %lu IMU (%lu out of order, dropped), %lu odometry, %lu clouds\n",
+           stats.imu, pipeline.imu().dropped(), stats.odom, stats.clouds);
+    if (stats.dropped[0] + stats.dropped[1] + stats.dropped[2] > 0)
+        printf("Capture:   %lu IMU, %lu odometry, %lu clouds dropped by the node, its writer fell behind\n",
+               stats.dropped[0], stats.dropped[1], stats.dropped[2]);
+    printf("Pairing:   %lu paired, %lu skipped at startup, %lu overwritten, %lu never paired\n",
+           count.paired, count.skipped, count.overwritten, unpaired);
+    printf("Buffering: %lu stale, %lu still waiting at the end\n", count.stale, sync.pending());
+    printf("Pipeline: ");
+    for (int s = 0; s <= DeskewPipeline::SHORT_IMU; s++)
+        printf(" %lu %s%s", stats.status[s], DeskewPipeline::statusName(DeskewPipeline::Status(s)),
+               s < DeskewPipeline::SHORT_IMU ? "," : "\n");
+    printf("Latency [ms]: mean %.2f, p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n",
+           mean(stats.latencyMs), percentile(stats.latencyMs, 0.5), percentile(stats.latencyMs, 0.95),
+           percentile(stats.latencyMs, 0.99), percentile(stats.latencyMs, 1.0));
+    printf("  waiting:    mean %.2f, p95 %.2f, max %.2f\n",
+           mean(stats.waitMs), percentile(stats.waitMs, 0.95), percentile(stats.waitMs, 1.0));
+    printf("  processing: mean %.2f, p95 %.2f, max %.2f\n",
+           mean(stats.processMs), percentile(stats.processMs, 0.95), percentile(stats.processMs, 1.0));
+
+    // The buffers grow over the first scans, after that a scan should not allocate
+    const size_t warmup = 3;
+    if (AllocCounter::available() && stats.allocs.size() > warmup)
+    {
+        vector<double> steady(stats.allocs.begin() + warmup, stats.allocs.end());
+        const ScanArena &arena = pipeline.scanArena();
+        printf("Allocations per scan: %.0f on the first, after %lu scans mean %.2f, max %.0f. Scan arena: %lu kB peak, %lu spills\n",
+               stats.allocs.front(), warmup, mean(steady), percentile(steady, 1.0), arena.peak() >> 10, arena.spillCount());
+    }
+
+    return 0;
+}
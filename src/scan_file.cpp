@@ -0,0 +1,332 @@
+/**
+* This file is part of oblam_deskew.
+*
+* Writer and memory-mapped reader of the columnar scan files, with the optional byte shuffle and deflate of
+* the columns. See scan_file.h for the layout.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef OBLAM_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "scan_file.h"
+
+using namespace std;
+using namespace scan_file;
+
+static uint64_t alignUp(uint64_t x) { return (x + kAlign - 1) & ~uint64_t(kAlign - 1); }
+
+// Byte shuffle: byte b of every word goes together, which is what lets deflate find the runs in float columns
+static const size_t kWordBytes[COLUMNS] = {sizeof(float), sizeof(float), sizeof(uint8_t), sizeof(uint32_t)};
+
+static void shuffle(const uint8_t *in, uint8_t *out, size_t bytes, size_t word)
+{
+    size_t n = bytes/word;
+    for (size_t b = 0; b < word; b++)
+        for (size_t i = 0; i < n; i++)
+            out[b*n + i] = in[i*word + b];
+}
+
+static void unshuffle(const uint8_t *in, uint8_t *out, size_t bytes, size_t word)
+{
+    size_t n = bytes/word;
+    for (size_t b = 0; b < word; b++)
+        for (size_t i = 0; i < n; i++)
+            out[i*word + b] = in[b*n + i];
+}
+
+bool scan_file::deflateAvailable()
+{
+#ifdef OBLAM_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* #region  Writer ------------------------------------------------------------------------------------------------*/
+
+ScanFileWriter::ScanFileWriter(const string &path, int compressLevel) : path(path), level(compressLevel)
+{
+    if (level > 0 && !deflateAvailable())
+        throw runtime_error("ScanFileWriter: compression asked for " + path + " but built without zlib");
+    level = min(level, 9);
+
+    file = fopen(path.c_str(), "wb");
+    if (!file)
+        throw runtime_error("ScanFileWriter: cannot open " + path + ": " + strerror(errno));
+
+    FileHeader h = {};
+    h.magic = kMagic;
+    h.version = kVersion;
+    put(&h, sizeof(h));
+}
+
+ScanFileWriter::~ScanFileWriter()
+{
+    try
+    {
+        close();
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+    }
+}
+
+void ScanFileWriter::put(const void *data, size_t bytes)
+{
+    if (bytes > 0 && fwrite(data, bytes, 1, file) != 1)
+        throw runtime_error("ScanFileWriter: cannot write " + path + ": " + strerror(errno));
+    offset += bytes;
+}
+
+void ScanFileWriter::align()
+{
+    static const uint8_t zeros[kAlign] = {0};
+    put(zeros, alignUp(offset) - offset);
+}
+
+void ScanFileWriter::write(double stamp, const mytf &pose, const PointCompact *points, size_t N,
+                           const CloudCompact &attr, const vector<uint32_t> *srcIdx)
+{
+    if (!file)
+        throw runtime_error("ScanFileWriter: " + path + " is closed");
+
+    for (int c = 0; c < COLUMNS; c++)
+        column[c].resize(N*kElemBytes[c]);
+
+    float *xyz = reinterpret_cast<float *>(column[XYZ].data());
+    float *intensity = reinterpret_cast<float *>(column[INTENSITY].data());
+    uint8_t *ring = column[RING].data();
+    uint32_t *t = reinterpret_cast<uint32_t *>(column[T].data());
+
+    for (size_t i = 0; i < N; i++)
+    {
+        const PointCompact &p = points[i];
+        size_t src = srcIdx ? (*srcIdx)[i] : i;
+        xyz[3*i] = p.x; xyz[3*i + 1] = p.y; xyz[3*i + 2] = p.z;
+        intensity[i] = attr.intensity[src];
+        ring[i] = attr.ring[src];
+        t[i] = p.col < attr.col_t.size() ? attr.col_t[p.col] : 0;
+    }
+
+    ScanHeader h = {};
+    h.magic = kScanMagic;
+    h.points = N;
+    h.codec = level > 0 ? DEFLATE : RAW;
+    h.stamp = stamp;
+    h.pose[0] = pose.pos.x(); h.pose[1] = pose.pos.y(); h.pose[2] = pose.pos.z();
+    h.pose[3] = pose.rot.x(); h.pose[4] = pose.rot.y(); h.pose[5] = pose.rot.z(); h.pose[6] = pose.rot.w();
+
+    const uint8_t *stored[COLUMNS];
+    for (int c = 0; c < COLUMNS; c++)
+    {
+        stored[c] = column[c].data();
+        h.bytes[c] = column[c].size();
+
+#ifdef OBLAM_HAVE_ZLIB
+        if (h.codec == DEFLATE && !column[c].empty())
+        {
+            // The shuffled column goes to the back half of the buffer, deflated into the front
+            uLong bound = compressBound(column[c].size());
+            packed[c].resize(bound + column[c].size());
+            uint8_t *shuffled = packed[c].data() + bound;
+            shuffle(column[c].data(), shuffled, column[c].size(), kWordBytes[c]);
+
+            uLongf packedBytes = bound;
+            if (compress2(packed[c].data(), &packedBytes, shuffled, column[c].size(), level) != Z_OK)
+                throw runtime_error("ScanFileWriter: cannot compress a scan for " + path);
+            stored[c] = packed[c].data();
+            h.bytes[c] = packedBytes;
+        }
+#endif
+    }
+
+    align();
+    uint64_t next = offset + sizeof(ScanHeader);
+    for (int c = 0; c < COLUMNS; c++)
+    {
+        h.offset[c] = next;
+        next = alignUp(next + h.bytes[c]);
+    }
+
+    put(&h, sizeof(h));
+    for (int c = 0; c < COLUMNS; c++)
+    {
+        put(stored[c], h.bytes[c]);
+        align();
+    }
+
+    index.push_back(h);
+}
+
+void ScanFileWriter::close()
+{
+    if (!file)
+        return;
+
+    FILE *f = file;
+    file = nullptr;
+
+    FileHeader fh = {};
+    fh.magic = kMagic;
+    fh.version = kVersion;
+    fh.scans = index.size();
+    fh.indexOffset = alignUp(offset);
+
+    bool ok = true;
+    static const uint8_t zeros[kAlign] = {0};
+    size_t pad = fh.indexOffset - offset;
+    ok = ok && (pad == 0 || fwrite(zeros, pad, 1, f) == 1);
+    ok = ok && (index.empty() || fwrite(index.data(), sizeof(ScanHeader), index.size(), f) == index.size());
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&fh, sizeof(fh), 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok)
+        throw runtime_error("ScanFileWriter: cannot write the index of " + path + ": " + strerror(errno));
+}
+
+/* #endregion  Writer ---------------------------------------------------------------------------------------------*/
+
+/* #region  Reader ------------------------------------------------------------------------------------------------*/
+
+ScanFileReader::ScanFileReader(const string &path) : path(path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("ScanFileReader: cannot open " + path + ": " + strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(FileHeader))
+    {
+        ::close(fd);
+        throw runtime_error("ScanFileReader: " + path + " is not a scan file");
+    }
+
+    bytes = st.st_size;
+    void *map = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        throw runtime_error("ScanFileReader: cannot map " + path + ": " + strerror(errno));
+    data = static_cast<const uint8_t *>(map);
+
+    const FileHeader &fh = *reinterpret_cast<const FileHeader *>(data);
+    if (fh.magic != kMagic || fh.version != kVersion)
+    {
+        munmap(const_cast<uint8_t *>(data), bytes);
+        throw runtime_error("ScanFileReader: " + path + " is not a scan file of version " + to_string(kVersion));
+    }
+
+    if (fh.indexOffset != 0 && fh.indexOffset <= bytes && fh.scans <= (bytes - fh.indexOffset)/sizeof(ScanHeader))
+    {
+        headers = reinterpret_cast<const ScanHeader *>(data + fh.indexOffset);
+        count = fh.scans;
+        hasIndex = true;
+        return;
+    }
+
+    // No index, the writer stopped early. Take the scans that were written completely.
+    uint64_t off = sizeof(FileHeader);
+    while (off + sizeof(ScanHeader) <= bytes)
+    {
+        const ScanHeader &h = *reinterpret_cast<const ScanHeader *>(data + off);
+        if (h.magic != kScanMagic)
+            break;
+
+        uint64_t end = off + sizeof(ScanHeader);
+        bool complete = true;
+        for (int c = 0; c < COLUMNS; c++)
+        {
+            complete = complete && h.offset[c] >= off + sizeof(ScanHeader) && h.offset[c] <= bytes
+                       && h.bytes[c] <= bytes - h.offset[c];
+            end = max(end, h.offset[c] + h.bytes[c]);
+        }
+        if (!complete)
+            break;
+
+        rebuilt.push_back(h);
+        off = alignUp(end);
+    }
+    headers = rebuilt.data();
+    count = rebuilt.size();
+}
+
+ScanFileReader::~ScanFileReader()
+{
+    munmap(const_cast<uint8_t *>(data), bytes);
+}
+
+size_t ScanFileReader::lowerBound(double t) const
+{
+    return lower_bound(headers, headers + count, t,
+                       [](const ScanHeader &h, double t) { return h.stamp < t; }) - headers;
+}
+
+void ScanFileReader::range(double tstart, double tend, size_t &first, size_t &last) const
+{
+    first = lowerBound(tstart);
+    last = max(first, lowerBound(tend));
+}
+
+ScanView ScanFileReader::scan(size_t k, Buffer &buffer) const
+{
+    if (k >= count)
+        throw out_of_range("ScanFileReader: scan " + to_string(k) + " of " + to_string(count) + " in " + path);
+
+    const ScanHeader &h = headers[k];
+
+    ScanView view;
+    view.stamp = h.stamp;
+    view.pose = mytf(Quaternd(h.pose[6], h.pose[3], h.pose[4], h.pose[5]), Eigen::Vector3d(h.pose[0], h.pose[1], h.pose[2]));
+    view.size = h.points;
+
+    const uint8_t *col[COLUMNS];
+    for (int c = 0; c < COLUMNS; c++)
+    {
+        size_t rawBytes = size_t(h.points)*kElemBytes[c];
+        if (h.offset[c] > bytes || h.bytes[c] > bytes - h.offset[c] || (h.codec == RAW && h.bytes[c] != rawBytes))
+            throw runtime_error("ScanFileReader: corrupt scan " + to_string(k) + " in " + path);
+
+        if (h.codec == RAW)
+        {
+            col[c] = data + h.offset[c];
+            continue;
+        }
+
+        if (h.codec != DEFLATE)
+            throw runtime_error("ScanFileReader: unknown codec " + to_string(h.codec) + " in " + path);
+
+#ifdef OBLAM_HAVE_ZLIB
+        buffer.packed.resize(rawBytes);
+        buffer.column[c].resize(rawBytes);
+        uLongf unpacked = rawBytes;
+        if (rawBytes > 0 && (uncompress(buffer.packed.data(), &unpacked, data + h.offset[c], h.bytes[c]) != Z_OK
+                             || unpacked != rawBytes))
+            throw runtime_error("ScanFileReader: corrupt scan " + to_string(k) + " in " + path);
+        unshuffle(buffer.packed.data(), buffer.column[c].data(), rawBytes, kWordBytes[c]);
+        col[c] = buffer.column[c].data();
+#else
+        (void)buffer;
+        throw runtime_error("ScanFileReader: " + path + " is compressed but this build has no zlib");
+#endif
+    }
+
+    view.xyz = reinterpret_cast<const float *>(col[XYZ]);
+    view.intensity = reinterpret_cast<const float *>(col[INTENSITY]);
+    view.ring = col[RING];
+    view.t = reinterpret_cast<const uint32_t *>(col[T]);
+    return view;
+}
+
+/* #endregion  Reader ---------------------------------------------------------------------------------------------*/